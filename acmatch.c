@@ -0,0 +1,324 @@
+#include "acmatch.h"
+
+#define AC_LINEAR_EDGES 8    // states with more edges are binary searched
+
+// Temporary trie node edge, only used while building
+struct AcTrieEdge {
+    int32_t to;
+    int32_t next;
+    uint8_t cls;
+};
+
+// Case folding used for targets and input, whitespace matches any whitespace
+static unsigned char ac_fold(unsigned char c) {
+    if (c >= 'A' && c <= 'Z') return c - 'A' + 'a';
+    if (M_ISWS(c)) return MSPACE;
+    return c;
+}
+
+static int ac_isword(unsigned char c) {
+    return isalnum(c) || c == '_' || c >= 128;
+}
+
+static int32_t ac_child(const struct AcTrieEdge *edges, const int32_t *first, int32_t s, uint8_t c) {
+    for (int32_t e = first[s]; e != -1; e = edges[e].next) {
+        if (edges[e].cls == c) return edges[e].to;
+    }
+    return -1;
+}
+
+int ac_build(struct AcMatcher *ac, const struct RuleSet *rs) {
+    memset(ac, 0, sizeof(*ac));
+
+    // Classes are handed out in byte order to the folded bytes the targets use
+    uint8_t used[256] = { 0 };
+    long total = 1;
+    for (int i = 0; i < rs->count; i++) {
+        if (!rules_rule_valid(rs, &rs->rules[i])) return -1;
+        const unsigned char *t = (const unsigned char *)RULE_TARGET(rs, &rs->rules[i]);
+        for (uint32_t j = 0; j < rs->rules[i].target_len; j++) used[ac_fold(t[j])] = 1;
+        total += rs->rules[i].target_len;
+    }
+    uint8_t class_of[256] = { 0 };
+    ac->nclasses = 1;
+    for (int b = 0; b < 256; b++) {
+        if (used[b]) class_of[b] = ac->nclasses++;
+    }
+    for (int b = 0; b < 256; b++) ac->cls[b] = class_of[ac_fold(b)];
+
+    // Build the trie with linked edge lists
+    struct AcTrieEdge *edges = (struct AcTrieEdge *)malloc(sizeof(struct AcTrieEdge) * total);
+    int32_t *first = (int32_t *)malloc(sizeof(int32_t) * total);
+    int32_t *out = (int32_t *)malloc(sizeof(int32_t) * total);
+    int32_t *depth = (int32_t *)malloc(sizeof(int32_t) * total);
+    int32_t *fail = (int32_t *)malloc(sizeof(int32_t) * total);
+    int32_t *order = (int32_t *)malloc(sizeof(int32_t) * total);
+    if (!edges || !first || !out || !depth || !fail || !order) {
+        free(edges); free(first); free(out); free(depth); free(fail); free(order);
+        return -1;
+    }
+
+    int32_t nstates = 1;
+    first[0] = -1;
+    out[0] = -1;
+    depth[0] = 0;
+    for (int i = 0; i < rs->count; i++) {
+        const unsigned char *t = (const unsigned char *)RULE_TARGET(rs, &rs->rules[i]);
+        int32_t s = 0;
+        for (uint32_t j = 0; j < rs->rules[i].target_len; j++) {
+            uint8_t c = ac->cls[t[j]];
+            int32_t next = ac_child(edges, first, s, c);
+            if (next == -1) {
+                next = nstates++;
+                first[next] = -1;
+                out[next] = -1;
+                depth[next] = depth[s] + 1;
+                edges[next - 1].to = next;
+                edges[next - 1].cls = c;
+                edges[next - 1].next = first[s];
+                first[s] = next - 1;
+            }
+            s = next;
+        }
+        if (s != 0 && out[s] == -1) out[s] = i;
+        if (depth[s] > ac->max_depth) ac->max_depth = depth[s];
+    }
+
+    // Breadth first order gives the fail links and the final state numbering
+    int32_t qhead = 0, qtail = 0;
+    order[qtail++] = 0;
+    fail[0] = 0;
+    while (qhead < qtail) {
+        int32_t u = order[qhead++];
+        for (int32_t e = first[u]; e != -1; e = edges[e].next) {
+            int32_t v = edges[e].to;
+            int32_t f = fail[u];
+            int32_t w;
+            while ((w = ac_child(edges, first, f, edges[e].cls)) == -1 && f != 0) f = fail[f];
+            fail[v] = (w != -1 && w != v) ? w : 0;
+            order[qtail++] = v;
+        }
+    }
+
+    // Pack the states in breadth first order
+    int32_t *rename = (int32_t *)malloc(sizeof(int32_t) * nstates);
+    ac->nstates = nstates;
+    ac->root_next = (int32_t *)calloc(ac->nclasses, sizeof(int32_t));
+    ac->states = (struct AcState *)malloc(sizeof(struct AcState) * (nstates + 1));
+    ac->edges = (struct AcEdge *)malloc(sizeof(struct AcEdge) * nstates);
+    if (!rename || !ac->root_next || !ac->states || !ac->edges) {
+        free(rename);
+        free(edges); free(first); free(out); free(depth); free(fail); free(order);
+        ac_free(ac);
+        return -1;
+    }
+    for (int32_t i = 0; i < nstates; i++) rename[order[i]] = i;
+
+    uint32_t nedges = 0;
+    for (int32_t i = 0; i < nstates; i++) {
+        int32_t u = order[i];
+        struct AcState *st = &ac->states[i];
+        st->edge_start = nedges;
+        st->fail = rename[fail[u]];
+        st->out = out[u];
+        st->depth = depth[u];
+
+        // insertion sort the edges of this state by class
+        for (int32_t e = first[u]; e != -1; e = edges[e].next) {
+            uint32_t k = nedges++;
+            while (k > st->edge_start && ac->edges[k - 1].cls > edges[e].cls) {
+                ac->edges[k] = ac->edges[k - 1];
+                k--;
+            }
+            ac->edges[k].cls = edges[e].cls;
+            ac->edges[k].to = rename[edges[e].to];
+        }
+    }
+    ac->states[nstates].edge_start = nedges;
+
+    for (uint32_t k = ac->states[0].edge_start; k < ac->states[1].edge_start; k++) {
+        ac->root_next[ac->edges[k].cls] = ac->edges[k].to;
+    }
+
+    // Fail links always point to shallower states, so BFS order sees them first
+    ac->states[0].dict = -1;
+    for (int32_t i = 1; i < nstates; i++) {
+        int32_t f = ac->states[i].fail;
+        ac->states[i].dict = (ac->states[f].out != -1) ? f : ac->states[f].dict;
+    }
+
+    free(rename);
+    free(edges); free(first); free(out); free(depth); free(fail); free(order);
+    return 0;
+}
+
+void ac_free(struct AcMatcher *ac) {
+    free(ac->root_next);
+    free(ac->states);
+    free(ac->edges);
+    memset(ac, 0, sizeof(*ac));
+}
+
+// Goto/fail transition on one input class
+static inline int32_t ac_step(const struct AcMatcher *ac, int32_t s, uint8_t c) {
+    if (c == 0) return 0;
+    while (s != 0) {
+        uint32_t lo = ac->states[s].edge_start, end = ac->states[s + 1].edge_start;
+        if (end - lo <= AC_LINEAR_EDGES) {
+            for (uint32_t k = lo; k < end; k++) {
+                if (ac->edges[k].cls == c) return ac->edges[k].to;
+            }
+        } else {
+            uint32_t hi = end;
+            while (lo < hi) {
+                uint32_t mid = (lo + hi) / 2;
+                if (ac->edges[mid].cls < c) lo = mid + 1;
+                else hi = mid;
+            }
+            if (lo < end && ac->edges[lo].cls == c) return ac->edges[lo].to;
+        }
+        s = ac->states[s].fail;
+    }
+    return ac->root_next[c];
+}
+
+void ac_stream_init(struct AcStream *st, const struct AcMatcher *ac, const struct RuleSet *rs, int word_bounds, MILE *out) {
+    memset(st, 0, sizeof(*st));
+    st->ac = ac;
+    st->rs = rs;
+    st->word_bounds = word_bounds;
+    st->out = out;
+    st->cand_start = -1;
+    st->last = MSPACE;
+}
+
+void ac_stream_free(struct AcStream *st) {
+    free(st->buf);
+    st->buf = NULL;
+}
+
+// Offer the matches that end at 'end' in state s as the current candidate
+static void ac_consider(struct AcStream *st, int32_t s, int end) {
+    const struct AcMatcher *ac = st->ac;
+    int32_t t = (ac->states[s].out != -1) ? s : ac->states[s].dict;
+
+    // the fail chain runs from the longest match to the shortest
+    for (; t != -1; t = ac->states[t].dict) {
+        int start = end - ac->states[t].depth;
+        if (st->word_bounds) {
+            unsigned char before = (start > st->head) ? st->buf[start - 1] : st->last;
+            if (ac_isword(before)) continue;
+        }
+        if (st->cand_start == -1 || start < st->cand_start ||
+            (start == st->cand_start && end > st->cand_end)) {
+            st->cand_start = start;
+            st->cand_end = end;
+            st->cand_rule = ac->states[t].out;
+        }
+        return;
+    }
+}
+
+// Write out the pending bytes before the candidate, then its replacement
+static void ac_commit(struct AcStream *st) {
+    const struct ReplaceRule *r = &st->rs->rules[st->cand_rule];
+
+    if (st->cand_start > st->head) mputs(st->out, st->buf + st->head, st->cand_start - st->head);
+    mputs(st->out, RULE_REPLACEMENT(st->rs, r), (int)r->replacement_len);
+
+    st->last = st->buf[st->cand_end - 1];
+    st->head = st->cand_end;
+    st->safe = st->cand_end;
+    st->scan = st->cand_end;  // rescan whatever followed the match
+    st->state = 0;
+    st->cand_start = -1;
+}
+
+// Run the automaton over the unscanned pending bytes
+static void ac_run(struct AcStream *st) {
+    const struct AcMatcher *ac = st->ac;
+
+    while (st->scan < st->len) {
+        unsigned char c = st->buf[st->scan];
+        int32_t prev = st->state;
+        st->state = ac_step(ac, prev, ac->cls[c]);
+        st->scan++;
+
+        if (st->word_bounds) {
+            // matches ending before c are only complete when c is not a word byte
+            const struct AcState *p = &ac->states[prev];
+            if (!ac_isword(c) && (p->out != -1 || p->dict != -1)) ac_consider(st, prev, st->scan - 1);
+        } else if (ac->states[st->state].out != -1 || ac->states[st->state].dict != -1) {
+            ac_consider(st, st->state, st->scan);
+        }
+
+        int live = st->scan - ac->states[st->state].depth;  // earliest start a later match can have
+        if (st->cand_start != -1) {
+            if (live > st->cand_start) ac_commit(st);
+        } else {
+            st->safe = live;
+        }
+    }
+}
+
+// Write out the bytes that can no longer be replaced and compact the buffer
+static void ac_drain(struct AcStream *st) {
+    if (st->safe > st->head) {
+        mputs(st->out, st->buf + st->head, st->safe - st->head);
+        st->last = st->buf[st->safe - 1];
+        st->head = st->safe;
+    }
+    if (st->head > 0) {
+        int n = st->len - st->head;
+        memmove(st->buf, st->buf + st->head, n);
+        st->scan -= st->head;
+        st->safe -= st->head;
+        if (st->cand_start != -1) {
+            st->cand_start -= st->head;
+            st->cand_end -= st->head;
+        }
+        st->len = n;
+        st->head = 0;
+    }
+}
+
+int ac_feed(struct AcStream *st, const char *data, int len) {
+    if (st->len + len > st->cap) {
+        int cap = (st->cap > 0) ? st->cap : 4096;
+        while (cap < st->len + len) cap *= 2;
+        char *buf = (char *)realloc(st->buf, cap);
+        if (buf == NULL) return -1;
+        st->buf = buf;
+        st->cap = cap;
+    }
+    memcpy(st->buf + st->len, data, len);
+    st->len += len;
+
+    ac_run(st);
+    ac_drain(st);
+    return len;
+}
+
+void ac_finish(struct AcStream *st) {
+    while (1) {
+        ac_run(st);
+        // the end of the stream is a word boundary
+        if (st->word_bounds) ac_consider(st, st->state, st->scan);
+        if (st->cand_start == -1) break;
+        ac_commit(st);
+    }
+    st->safe = st->len;
+    ac_drain(st);
+    st->state = 0;
+}
+
+// Switch to another automaton between feeds. Pending bytes have not been
+// written yet, so they are simply matched again with the new rules.
+void ac_stream_rebind(struct AcStream *st, const struct AcMatcher *ac, const struct RuleSet *rs) {
+    st->ac = ac;
+    st->rs = rs;
+    st->state = 0;
+    st->scan = st->head;
+    st->safe = st->head;
+    st->cand_start = -1;
+}
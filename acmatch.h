@@ -0,0 +1,58 @@
+#ifndef ACMATCH_H_
+#define ACMATCH_H_
+#include <stdint.h>
+#include "mio.h"
+#include "wreplace.h"
+
+// Aho-Corasick automaton over the targets of a RuleSet. Input bytes are
+// case folded and mapped to a small alphabet of classes; the root keeps a
+// dense transition row and every other state a sorted run of edges.
+struct AcState {
+    uint32_t edge_start;       // edges of state s: edge_start of s .. edge_start of s + 1
+    int32_t fail;
+    int32_t out;               // rule index ending at this state, -1 if none
+    int32_t dict;              // next state on the fail chain with an output
+    int32_t depth;
+};
+
+struct AcEdge {
+    int32_t to;
+    uint8_t cls;
+};
+
+struct AcMatcher {
+    uint8_t cls[256];          // byte -> class, 0 for bytes no target uses
+    int nclasses;
+    int nstates;               // state 0 is the root
+    int32_t *root_next;        // dense transitions out of the root
+    struct AcState *states;    // nstates + 1 entries, the last one only ends the edge runs
+    struct AcEdge *edges;      // sorted by class within each state
+    int max_depth;
+};
+
+// Streaming replacement over raw buffers, matches may cross feeds
+struct AcStream {
+    const struct AcMatcher *ac;
+    const struct RuleSet *rs;
+    int word_bounds;           // only replace matches that start and end on word boundaries
+    MILE *out;
+
+    char *buf;                 // pending input, nothing before 'head' is still needed
+    int head, len, cap;
+    int scan;                  // bytes of buf run through the automaton
+    int safe;                  // bytes before 'safe' can no longer be part of a match
+    int32_t state;
+    int cand_start, cand_end, cand_rule;
+    unsigned char last;        // input byte before buf[head]
+};
+
+int ac_build(struct AcMatcher *ac, const struct RuleSet *rs);
+void ac_free(struct AcMatcher *ac);
+
+void ac_stream_init(struct AcStream *st, const struct AcMatcher *ac, const struct RuleSet *rs, int word_bounds, MILE *out);
+int ac_feed(struct AcStream *st, const char *data, int len);
+void ac_finish(struct AcStream *st);
+void ac_stream_rebind(struct AcStream *st, const struct AcMatcher *ac, const struct RuleSet *rs);
+void ac_stream_free(struct AcStream *st);
+
+#endif
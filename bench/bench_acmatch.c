@@ -0,0 +1,77 @@
+// Streaming replacement throughput of the Aho-Corasick engine as the rule
+// count grows. 32MB of text with one word in ten matching a rule is
+// replaced with 5, 1k and 100k rules.
+//
+//   gcc -O2 -o bench_acmatch bench/bench_acmatch.c acmatch.c wreplace.c mio.c -I.
+#include <stdio.h>
+#include <time.h>
+#include "acmatch.h"
+
+#define TEXT_SIZE (32 << 20)
+#define FEED_SIZE 65536
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Random words, every tenth on average is one of the rule targets
+static int make_text(char *text, int size, int nrules) {
+    unsigned int seed = 42;
+    int len = 0;
+    while (len < size - 32) {
+        seed = seed * 1103515245u + 12345u;
+        unsigned int r = seed >> 8;
+        char sep = (seed & 15) ? ' ' : '\n';
+        if (r % 10 == 0) len += snprintf(text + len, 32, "word%u%c", (r / 10) % nrules, sep);
+        else len += snprintf(text + len, 32, "text%u%c", r % 1000000, sep);
+    }
+    return len;
+}
+
+static void run(char *text, int nrules, MILE *sink) {
+    struct RuleSet rules;
+    struct AcMatcher matcher;
+    struct AcStream stream;
+    char target[32];
+
+    rules_init(&rules);
+    for (int i = 0; i < nrules; i++) {
+        int n = snprintf(target, sizeof(target), "word%d", i);
+        rules_add(&rules, target, n, "X", 1);
+    }
+
+    int len = make_text(text, TEXT_SIZE, nrules);
+
+    double t0 = now_sec();
+    ac_build(&matcher, &rules);
+    double build = now_sec() - t0;
+
+    ac_stream_init(&stream, &matcher, &rules, 1, sink);
+    t0 = now_sec();
+    for (int off = 0; off < len; off += FEED_SIZE) {
+        ac_feed(&stream, text + off, (len - off < FEED_SIZE) ? len - off : FEED_SIZE);
+    }
+    ac_finish(&stream);
+    mflush(sink);
+    double secs = now_sec() - t0;
+
+    printf("%7d rules: %8d states, build %7.1f ms, %7.1f MB/s\n",
+           nrules, matcher.nstates, build * 1e3, len / secs / 1e6);
+
+    ac_stream_free(&stream);
+    ac_free(&matcher);
+    rules_free(&rules);
+}
+
+int main(void) {
+    char *text = (char *)malloc(TEXT_SIZE);
+    MILE *sink = mopen("/dev/null", MODE_WA, FEED_SIZE);
+    int sizes[] = { 5, 1000, 100000 };
+    for (int i = 0; i < 3; i++) run(text, sizes[i], sink);
+
+    mclose(sink);
+    free(text);
+    return 0;
+}
@@ -0,0 +1,94 @@
+// Parsing cost of Run command lines: the old strtok + strdup + realloc-per-
+// argument parser against cmd_parse_run with an arena reset per line.
+//
+//   gcc -O2 -o bench_parse bench/bench_parse.c cmdline.c mio.c -I.
+//   ./bench_parse [lines]
+#include <stdio.h>
+#include <time.h>
+#include "mio.h"
+#include "cmdline.h"
+
+static const char *lines[] = {
+    "Run cat From alice2.txt Pipe word_replacer rwords.txt Pipe word_counter -w -b To out.txt",
+    "Run WordReplace -a rwords.txt From /tmp/in.txt Pipe WordCount -l",
+    "Run grep -i 'the rabbit' alice2.txt Pipe sort Pipe uniq -c To counts.txt &",
+    "Run echo a b c d e f g h i j k l m n o p",
+};
+#define LINE_KINDS (int)(sizeof(lines) / sizeof(lines[0]))
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// What handle_run_command did before: strtok the line, strdup every word
+// and grow each stage's argument vector one realloc at a time
+static long parse_strtok(const char *line) {
+    char *copy = strdup(line);
+    char **stages[64];
+    int counts[64];
+    int nstages = 0;
+    char *files[2] = { NULL, NULL };
+    char *token = strtok(copy, " ");
+    while ((token = strtok(NULL, " ")) != NULL) {
+        if (nstages == 0 || strcmp(token, "Pipe") == 0) {
+            if (strcmp(token, "Pipe") == 0) token = strtok(NULL, " ");
+            stages[nstages] = NULL;
+            counts[nstages] = 0;
+            nstages++;
+        } else if (strcmp(token, "From") == 0 || strcmp(token, "To") == 0) {
+            int to = (token[0] == 'T');
+            token = strtok(NULL, " ");
+            files[to] = strdup(token);
+            continue;
+        } else if (strcmp(token, "&") == 0) {
+            continue;
+        }
+        int s = nstages - 1;
+        stages[s] = (char **)realloc(stages[s], sizeof(char *) * (counts[s] + 2));
+        stages[s][counts[s]++] = strdup(token);
+        stages[s][counts[s]] = NULL;
+    }
+
+    long words = 0;
+    for (int s = 0; s < nstages; s++) {
+        for (int i = 0; i < counts[s]; i++) free(stages[s][i]);
+        free(stages[s]);
+        words += counts[s];
+    }
+    free(files[0]);
+    free(files[1]);
+    free(copy);
+    return words;
+}
+
+static long parse_arena(struct Arena *arena, const char *line) {
+    struct CmdLine cmd;
+    const char *error;
+    long words = 0;
+    if (cmd_parse_run(arena, line + 3, &cmd, &error) == 0) {
+        for (int s = 0; s < cmd.count; s++) words += cmd.stages[s].arg_count;
+    }
+    arena_reset(arena);
+    return words;
+}
+
+int main(int argc, char *argv[]) {
+    long n = (argc > 1) ? atol(argv[1]) : 2000000;
+
+    double t0 = now_sec();
+    long words = 0;
+    for (long i = 0; i < n; i++) words += parse_strtok(lines[i % LINE_KINDS]);
+    double t_strtok = now_sec() - t0;
+    printf("strtok+strdup  %8.1f ns/line  %ld words\n", t_strtok / n * 1e9, words);
+
+    struct Arena arena = { NULL };
+    t0 = now_sec();
+    words = 0;
+    for (long i = 0; i < n; i++) words += parse_arena(&arena, lines[i % LINE_KINDS]);
+    double t_arena = now_sec() - t0;
+    printf("cmd_parse_run  %8.1f ns/line  %ld words\n", t_arena / n * 1e9, words);
+    arena_free(&arena);
+    return 0;
+}
@@ -0,0 +1,58 @@
+#!/bin/sh
+# Compares proc_starter's multi-process and threaded modes on a large input.
+#
+#   bench/bench_pipeline.sh [copies of alice2.txt, default 2000]
+#
+# Run from the repository root; the programs are built into a temporary directory.
+set -e
+
+COPIES=${1:-2000}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+gcc -O2 -o "$TMP/word_counter" word_counter.c wcount.c mio.c
+gcc -O2 -pthread -o "$TMP/word_replacer" word_replacer.c wreplace.c acmatch.c mio.c
+gcc -O2 -pthread -o "$TMP/proc_starter" proc_starter.c wreplace.c wcount.c ring.c pmon.c mio.c
+PATH="$TMP:$PATH"
+
+i=0
+while [ "$i" -lt "$COPIES" ]; do
+    cat alice2.txt
+    i=$((i + 1))
+done > "$TMP/input.txt"
+SIZE=$(wc -c < "$TMP/input.txt")
+
+run() {
+    start=$(date +%s.%N)
+    proc_starter "$@" < "$TMP/input.txt" > "$TMP/out$#.txt"
+    end=$(date +%s.%N)
+    echo "$start $end $SIZE" | awk '{ t = $2 - $1; printf "%8.3f s  %8.1f MB/s\n", t, $3 / t / 1e6 }'
+}
+
+printf "processes: "; run
+printf "threads:   "; run -t
+
+if cmp -s "$TMP/out0.txt" "$TMP/out1.txt"; then
+    echo "outputs match"
+else
+    echo "outputs differ"
+    exit 1
+fi
+
+# a word longer than one token batch of the threaded mode (64KB) must come
+# through whole in every mode
+{
+    cat alice2.txt
+    head -c 70000 /dev/zero | tr '\0' x
+    echo
+    cat alice2.txt
+} > "$TMP/long.txt"
+proc_starter < "$TMP/long.txt" > "$TMP/long0.txt"
+proc_starter -t < "$TMP/long.txt" > "$TMP/long1.txt"
+proc_starter -n 2 < "$TMP/long.txt" > "$TMP/long2.txt"
+if cmp -s "$TMP/long0.txt" "$TMP/long1.txt" && cmp -s "$TMP/long0.txt" "$TMP/long2.txt"; then
+    echo "long token outputs match"
+else
+    echo "long token outputs differ"
+    exit 1
+fi
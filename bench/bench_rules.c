@@ -0,0 +1,89 @@
+// Compares the original linear dictionary scan of word_replacer with the
+// hashed RuleSet lookup for dictionaries of 5, 1k and 100k rules.
+//
+//   gcc -O2 -o bench_rules bench/bench_rules.c wreplace.c mio.c -I.
+#include <stdio.h>
+#include <time.h>
+#include "wreplace.h"
+
+#define QUERIES 200000        // lookups per hashed run
+#define LINEAR_BUDGET 2e8     // string compares allowed per linear run
+
+// The lookup word_replacer used before the rule set was hashed
+static int linear_equal(const char* str1, const char* str2) {
+    while (*str1 != '\0' && *str2 != '\0') {
+        if (tolower(*str1) != tolower(*str2)) return 0;
+        str1++;
+        str2++;
+    }
+    return (*str1 == '\0' && *str2 == '\0');
+}
+
+static int linear_find(const char* word, char** word_array, int word_count) {
+    for (int i = 0; i < word_count; i++) {
+        if (linear_equal(word, word_array[i])) return i;
+    }
+    return -1;
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(int nrules) {
+    struct RuleSet rules;
+    char** targets = (char**)malloc(sizeof(char*) * nrules);
+    char buf[32];
+
+    rules_init(&rules);
+    for (int i = 0; i < nrules; i++) {
+        int len = snprintf(buf, sizeof(buf), "word%d", i);
+        targets[i] = strdup(buf);
+        rules_add(&rules, buf, len, "x", 1);
+    }
+
+    // Half of the queries hit a random rule, the other half miss
+    char** queries = (char**)malloc(sizeof(char*) * QUERIES);
+    unsigned int seed = 12345;
+    for (int i = 0; i < QUERIES; i++) {
+        seed = seed * 1103515245u + 12345u;
+        if (i & 1) snprintf(buf, sizeof(buf), "word%u", (seed >> 8) % nrules);
+        else snprintf(buf, sizeof(buf), "miss%u", (seed >> 8) % nrules);
+        queries[i] = strdup(buf);
+    }
+
+    long hits = 0;
+    double t0 = now_sec();
+    for (int i = 0; i < QUERIES; i++) {
+        if (rules_find(&rules, queries[i], (int)strlen(queries[i])) != NULL) hits++;
+    }
+    double hashed = (now_sec() - t0) / QUERIES;
+
+    // Linear scans on large dictionaries are capped to keep the run short
+    int linear_queries = (int)(LINEAR_BUDGET / nrules);
+    if (linear_queries > QUERIES) linear_queries = QUERIES;
+    if (linear_queries < 10) linear_queries = 10;
+    long linear_hits = 0;
+    t0 = now_sec();
+    for (int i = 0; i < linear_queries; i++) {
+        if (linear_find(queries[i], targets, nrules) != -1) linear_hits++;
+    }
+    double linear = (now_sec() - t0) / linear_queries;
+
+    printf("%7d rules: linear %12.1f ns/lookup (%ld/%d hits), hashed %8.1f ns/lookup (%ld/%d hits)\n",
+           nrules, linear * 1e9, linear_hits, linear_queries, hashed * 1e9, hits, QUERIES);
+
+    for (int i = 0; i < nrules; i++) free(targets[i]);
+    for (int i = 0; i < QUERIES; i++) free(queries[i]);
+    free(targets);
+    free(queries);
+    rules_free(&rules);
+}
+
+int main(void) {
+    int sizes[] = { 5, 1000, 100000 };
+    for (int i = 0; i < 3; i++) run(sizes[i]);
+    return 0;
+}
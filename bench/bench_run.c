@@ -0,0 +1,134 @@
+// Run one command and print what it cost as a JSON object: wall time,
+// throughput over the input, CPU time, peak RSS, context switches and the
+// read/write syscall counts and bytes from /proc/<pid>/io. The command's
+// children count too: wait4 and /proc/<pid>/io include every descendant the
+// command has waited for. Used by bench/run_bench.sh.
+//
+//   gcc -O2 -o bench_run bench/bench_run.c
+//   ./bench_run <name> [-i input] [-I input] [-o output] [-c checked] -- <program> [<args>]
+//
+// -i feeds the input to standard in, -I names an input the command opens
+// itself; either gives the throughput. -c names the file whose size and
+// checksum are reported, by default the output.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long io_field(const char *text, const char *name) {
+    const char *p = strstr(text, name);
+    return (p != NULL) ? atol(p + strlen(name)) : -1;
+}
+
+// FNV-1a of a file, so runs of different pipelines can be checked against each other
+static unsigned long long file_checksum(const char *path, long *size) {
+    unsigned long long h = 14695981039346656037ULL;
+    *size = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    static unsigned char buf[1 << 16];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        for (ssize_t i = 0; i < n; i++) h = (h ^ buf[i]) * 1099511628211ULL;
+        *size += n;
+    }
+    close(fd);
+    return h;
+}
+
+static void json_string(const char *s) {
+    putchar('"');
+    for (; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\') putchar('\\');
+        if ((unsigned char)*s >= 0x20) putchar(*s);
+    }
+    putchar('"');
+}
+
+int main(int argc, char *argv[]) {
+    const char *input = NULL, *measured = NULL, *output = NULL, *checked = NULL;
+    int argi = 2;
+    for (; argi + 1 < argc && strcmp(argv[argi], "--") != 0; argi += 2) {
+        if (strcmp(argv[argi], "-i") == 0) input = measured = argv[argi + 1];
+        else if (strcmp(argv[argi], "-I") == 0) measured = argv[argi + 1];
+        else if (strcmp(argv[argi], "-o") == 0) output = argv[argi + 1];
+        else if (strcmp(argv[argi], "-c") == 0) checked = argv[argi + 1];
+        else break;
+    }
+    if (argc < 2 || argi >= argc || strcmp(argv[argi], "--") != 0 || argi + 1 >= argc) {
+        fprintf(stderr, "Usage: bench_run <name> [-i input] [-I input] [-o output] [-c checked] -- <program> [<args>]\n");
+        return 2;
+    }
+    char **command = &argv[argi + 1];
+    if (checked == NULL) checked = output;
+
+    long input_bytes = 0;
+    struct stat st;
+    if (measured != NULL && stat(measured, &st) == 0) input_bytes = st.st_size;
+
+    double start = now_sec();
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (input != NULL) {
+            int fd = open(input, O_RDONLY);
+            if (fd < 0 || dup2(fd, STDIN_FILENO) < 0) _exit(126);
+            close(fd);
+        }
+        if (output != NULL) {
+            int fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0 || dup2(fd, STDOUT_FILENO) < 0) _exit(126);
+            close(fd);
+        }
+        execvp(command[0], command);
+        perror(command[0]);
+        _exit(127);
+    }
+    if (pid < 0) {
+        perror("fork");
+        return 2;
+    }
+
+    // read /proc/<pid>/io while the command is a zombie, then reap it
+    siginfo_t info;
+    memset(&info, 0, sizeof(info));
+    waitid(P_PID, pid, &info, WEXITED | WNOWAIT);
+    double wall = now_sec() - start;
+    char path[64], io[1024] = "";
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+        ssize_t n = read(fd, io, sizeof(io) - 1);
+        io[(n > 0) ? n : 0] = '\0';
+        close(fd);
+    }
+    int status;
+    struct rusage ru;
+    wait4(pid, &status, 0, &ru);
+
+    long output_bytes = 0;
+    unsigned long long checksum = (checked != NULL) ? file_checksum(checked, &output_bytes) : 0;
+    printf("{\"name\": ");
+    json_string(argv[1]);
+    printf(", \"command\": ");
+    json_string(command[0]);
+    printf(", \"exit\": %d, \"wall_s\": %.6f, \"input_bytes\": %ld, \"mb_per_s\": %.2f", WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status),
+           wall, input_bytes, (wall > 0) ? input_bytes / wall / 1e6 : 0.0);
+    printf(", \"user_s\": %.6f, \"sys_s\": %.6f, \"max_rss_kb\": %ld, \"voluntary_ctxsw\": %ld, \"involuntary_ctxsw\": %ld",
+           ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6, ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6, ru.ru_maxrss, ru.ru_nvcsw, ru.ru_nivcsw);
+    printf(", \"read_syscalls\": %ld, \"write_syscalls\": %ld, \"read_bytes\": %ld, \"written_bytes\": %ld",
+           io_field(io, "syscr: "), io_field(io, "syscw: "), io_field(io, "rchar: "), io_field(io, "wchar: "));
+    printf(", \"output_bytes\": %ld, \"output_fnv\": \"%016llx\"}\n", output_bytes, checksum);
+    return 0;
+}
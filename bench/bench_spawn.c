@@ -0,0 +1,81 @@
+// Launch latency of short commands: fork + execvp as the shell used to do,
+// posix_spawnp, and launch_program with its PATH cache. Each launch starts
+// "true" through $PATH and waits for it. An optional argument makes the
+// process touch that many MB first, as a long-running shell would.
+//
+//   gcc -O2 -o bench_spawn bench/bench_spawn.c launch.c place.c mio.c -I.
+//   ./bench_spawn [resident MB]
+#include <stdio.h>
+#include <time.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include "mio.h"
+#include "launch.h"
+
+#define LAUNCHES 3000
+
+extern char **environ;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static pid_t fork_exec(char *const argv[]) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    return pid;
+}
+
+static pid_t spawnp(char *const argv[]) {
+    pid_t pid;
+    return (posix_spawnp(&pid, argv[0], NULL, NULL, argv, environ) == 0) ? pid : -1;
+}
+
+static pid_t cached(char *const argv[]) {
+    return launch_program(argv[0], argv, -1, -1);
+}
+
+static void run(const char *label, pid_t (*start)(char *const argv[]), double *lat) {
+    char *argv[] = { "true", NULL };
+    double total0 = now_sec();
+    for (int i = 0; i < LAUNCHES; i++) {
+        double t0 = now_sec();
+        pid_t pid = start(argv);
+        if (pid > 0) waitpid(pid, NULL, 0);
+        lat[i] = now_sec() - t0;
+    }
+    double total = now_sec() - total0;
+
+    qsort(lat, LAUNCHES, sizeof(double), compare_double);
+    printf("%-14s %8.1f us mean %8.1f us p50 %8.1f us p99 %8.0f launches/s\n", label,
+           total / LAUNCHES * 1e6, lat[LAUNCHES / 2] * 1e6, lat[LAUNCHES * 99 / 100] * 1e6, LAUNCHES / total);
+}
+
+int main(int argc, char *argv[]) {
+    long resident = (argc > 1) ? atol(argv[1]) << 20 : 0;
+    char *ballast = NULL;
+    if (resident > 0) {
+        ballast = (char *)malloc(resident);
+        memset(ballast, 1, resident);
+        printf("resident ballast: %ld MB\n", resident >> 20);
+    }
+
+    double *lat = (double *)malloc(sizeof(double) * LAUNCHES);
+    run("fork+execvp", fork_exec, lat);
+    run("posix_spawnp", spawnp, lat);
+    run("launch_program", cached, lat);
+
+    free(lat);
+    free(ballast);
+    return 0;
+}
@@ -0,0 +1,194 @@
+// Deterministic synthetic corpora for the benchmarks: text whose word
+// frequencies follow a Zipf law over a generated vocabulary, and optionally a
+// rule file in the rwords.txt format that replaces words spread over the
+// frequency ranks. The same seed and options always give the same bytes.
+//
+//   gcc -O2 -o gen_corpus bench/gen_corpus.c -lm
+//   ./gen_corpus [-s seed] [-v vocabulary] [-z exponent] [-r rules -R rules.txt] <size>[K|M|G] [out.txt]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define VOCABULARY 50000       // distinct words by default
+#define ZIPF_EXPONENT 1.0      // s in p(rank) ~ 1 / rank^s
+#define OUT_BLOCK (1 << 20)    // bytes per fwrite
+#define LINE_WORDS 12          // mean words per line
+
+static unsigned long long rng_state;
+
+// splitmix64: fast, and the same sequence on every platform
+static unsigned long long next_random(void) {
+    unsigned long long z = (rng_state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static double next_unit(void) {
+    return (next_random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Vose's alias table: a rank is drawn in O(1) from one column and a coin
+struct Alias {
+    double *probability;
+    int *alias;
+    int n;
+};
+
+static int alias_init(struct Alias *a, int n, double exponent) {
+    a->n = n;
+    a->probability = (double *)malloc(sizeof(double) * n);
+    a->alias = (int *)malloc(sizeof(int) * n);
+    double *scaled = (double *)malloc(sizeof(double) * n);
+    int *small = (int *)malloc(sizeof(int) * n), *large = (int *)malloc(sizeof(int) * n);
+    if (a->probability == NULL || a->alias == NULL || scaled == NULL || small == NULL || large == NULL) return -1;
+
+    double total = 0;
+    for (int i = 0; i < n; i++) total += 1.0 / pow(i + 1, exponent);
+    int nsmall = 0, nlarge = 0;
+    for (int i = 0; i < n; i++) {
+        scaled[i] = n / pow(i + 1, exponent) / total;
+        if (scaled[i] < 1.0) small[nsmall++] = i;
+        else large[nlarge++] = i;
+    }
+    while (nsmall > 0 && nlarge > 0) {
+        int s = small[--nsmall], l = large[--nlarge];
+        a->probability[s] = scaled[s];
+        a->alias[s] = l;
+        scaled[l] -= 1.0 - scaled[s];
+        if (scaled[l] < 1.0) small[nsmall++] = l;
+        else large[nlarge++] = l;
+    }
+    while (nlarge > 0) a->probability[large[--nlarge]] = 1.0;
+    while (nsmall > 0) a->probability[small[--nsmall]] = 1.0;
+    free(scaled);
+    free(small);
+    free(large);
+    return 0;
+}
+
+static int alias_draw(const struct Alias *a) {
+    unsigned long long r = next_random();
+    int column = (int)((r >> 32) % (unsigned long long)a->n);
+    return ((r & 0xffffffffULL) * (1.0 / 4294967296.0) < a->probability[column]) ? column : a->alias[column];
+}
+
+// Word of a rank, built from syllables so it reads like text; frequent ranks
+// get short words, as in natural language
+static int make_word(int rank, char *out) {
+    static const char *onsets[] = { "b", "c", "d", "f", "g", "h", "l", "m", "n", "p", "r", "s", "t", "v", "w", "br", "ch", "st", "th", "tr" };
+    static const char *vowels[] = { "a", "e", "i", "o", "u", "ai", "ea", "ou" };
+    int length = 0;
+    unsigned int n = (unsigned int)rank;
+    do {
+        const char *onset = onsets[n % 20];
+        n /= 20;
+        const char *vowel = vowels[n % 8];
+        n /= 8;
+        length += sprintf(out + length, "%s%s", onset, vowel);
+    } while (n > 0);
+    if (rank % 3 == 1) out[length++] = "nrst"[rank % 4];
+    out[length] = '\0';
+    return length;
+}
+
+static long parse_size(const char *text) {
+    char *end;
+    double size = strtod(text, &end);
+    if (*end == 'K' || *end == 'k') size *= 1 << 10;
+    else if (*end == 'M' || *end == 'm') size *= 1 << 20;
+    else if (*end == 'G' || *end == 'g') size *= 1 << 30;
+    else if (*end != '\0') return -1;
+    return (long)size;
+}
+
+static int write_rules(const char *path, char **words, int vocabulary, int rules) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) return -1;
+    // sources spread evenly over the ranks, from the most frequent word on;
+    // targets are words outside the vocabulary
+    for (int i = 0; i < rules; i++) {
+        char target[64];
+        make_word(vocabulary + i, target);
+        fprintf(f, "%s %s\n", words[(int)((long)i * vocabulary / rules)], target);
+    }
+    return fclose(f);
+}
+
+int main(int argc, char *argv[]) {
+    unsigned long long seed = 1;
+    int vocabulary = VOCABULARY, rules = 0;
+    double exponent = ZIPF_EXPONENT;
+    const char *rules_path = NULL;
+    int argi = 1;
+    for (; argi + 1 < argc && argv[argi][0] == '-'; argi += 2) {
+        if (strcmp(argv[argi], "-s") == 0) seed = strtoull(argv[argi + 1], NULL, 10);
+        else if (strcmp(argv[argi], "-v") == 0) vocabulary = atoi(argv[argi + 1]);
+        else if (strcmp(argv[argi], "-z") == 0) exponent = atof(argv[argi + 1]);
+        else if (strcmp(argv[argi], "-r") == 0) rules = atoi(argv[argi + 1]);
+        else if (strcmp(argv[argi], "-R") == 0) rules_path = argv[argi + 1];
+        else break;
+    }
+    long size = (argi < argc) ? parse_size(argv[argi]) : -1;
+    if (size < 0 || argc - argi > 2 || vocabulary < 1 || exponent <= 0 || rules < 0 || rules > vocabulary || (rules > 0) != (rules_path != NULL)) {
+        fprintf(stderr, "Usage: gen_corpus [-s seed] [-v vocabulary] [-z exponent] [-r rules -R rules.txt] <size>[K|M|G] [out.txt]\n");
+        return 1;
+    }
+    FILE *out = (argc - argi == 2) ? fopen(argv[argi + 1], "w") : stdout;
+    if (out == NULL) {
+        perror(argv[argi + 1]);
+        return 1;
+    }
+
+    rng_state = seed;
+    struct Alias table;
+    char **words = (char **)malloc(sizeof(char *) * vocabulary);
+    int *lengths = (int *)malloc(sizeof(int) * vocabulary);
+    if (words == NULL || lengths == NULL || alias_init(&table, vocabulary, exponent) == -1) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    for (int i = 0; i < vocabulary; i++) {
+        char word[64];
+        lengths[i] = make_word(i, word);
+        words[i] = strdup(word);
+    }
+    if (rules > 0 && write_rules(rules_path, words, vocabulary, rules) != 0) {
+        perror(rules_path);
+        return 1;
+    }
+
+    // lines of 1 to 2*LINE_WORDS-1 words; a sentence starts with a capital and
+    // ends with a full stop, with the odd comma in between. The last line is
+    // finished, so the output is at most one line over the size.
+    char *block = (char *)malloc(OUT_BLOCK + 256);
+    long written = 0;
+    int used = 0, line_left = 0, capital = 1;
+    while (written + used < size || line_left > 0) {
+        if (line_left == 0) line_left = 1 + (int)(next_random() % (2 * LINE_WORDS - 1));
+        int rank = alias_draw(&table);
+        memcpy(block + used, words[rank], lengths[rank]);
+        if (capital) block[used] -= 'a' - 'A';
+        used += lengths[rank];
+        capital = 0;
+        double u = next_unit();
+        if (u < 0.06) {
+            block[used++] = '.';
+            capital = 1;
+        } else if (u < 0.10) {
+            block[used++] = ',';
+        }
+        block[used++] = (--line_left == 0) ? '\n' : ' ';
+
+        if (used >= OUT_BLOCK || (written + used >= size && line_left == 0)) {
+            if (fwrite(block, 1, used, out) != (size_t)used) {
+                perror("write");
+                return 1;
+            }
+            written += used;
+            used = 0;
+        }
+    }
+    return (fclose(out) == 0) ? 0 : 1;
+}
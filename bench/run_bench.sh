@@ -0,0 +1,87 @@
+#!/bin/sh
+# End-to-end benchmark of word_counter, word_replacer, proc_starter and shell
+# pipelines on generated corpora. Prints one JSON document with a result per
+# pipeline and corpus size: throughput, CPU time, peak RSS, context switches
+# and read/write syscall counts (see bench/bench_run.c). Runs over the same
+# corpus with the same output_fnv produced identical output.
+#
+#   bench/run_bench.sh [-s seed] [-r rules] [-o results.json] [size ...]
+#
+# Sizes take K, M or G (default: 16M 128M). Corpora are generated with a Zipf
+# word distribution by bench/gen_corpus.c, so a seed always gives the same
+# bytes. Run from the repository root; everything is built with -O2 into a
+# temporary directory.
+set -e
+
+SEED=1
+RULES=1000
+OUT=
+while getopts s:r:o: opt; do
+    case $opt in
+        s) SEED=$OPTARG ;;
+        r) RULES=$OPTARG ;;
+        o) OUT=$OPTARG ;;
+        *) echo "Usage: bench/run_bench.sh [-s seed] [-r rules] [-o results.json] [size ...]" >&2; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+[ $# -gt 0 ] || set -- 16M 128M
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+ROOT=$(pwd)
+
+gcc -O2 -o "$TMP/gen_corpus" bench/gen_corpus.c -lm
+gcc -O2 -o "$TMP/bench_run" bench/bench_run.c
+gcc -O2 -o "$TMP/word_counter" word_counter.c wcount.c mio.c
+gcc -O2 -pthread -o "$TMP/word_replacer" word_replacer.c wreplace.c acmatch.c mio.c
+gcc -O2 -pthread -o "$TMP/proc_starter" proc_starter.c wreplace.c wcount.c ring.c pmon.c mio.c
+gcc -O2 -pthread -o "$TMP/myshell" shell2.c launch.c place.c pmon.c netio.c stats.c cmdline.c history.c membuf.c cache.c tee_stage.c wcount.c wreplace.c acmatch.c mio.c
+PATH="$TMP:$PATH"
+export MYSHELL_HISTORY="$TMP/history"
+
+# proc_starter reads its rules from rwords.txt in the working directory
+cd "$TMP"
+
+{
+    printf '{\n  "generated": "%s",\n  "host": "%s",\n  "cpus": %s,\n' "$(date -u +%Y-%m-%dT%H:%M:%SZ)" "$(uname -n)" "$(nproc)"
+    printf '  "commit": "%s",\n  "seed": %s,\n  "rules": %s,\n  "runs": [\n' "$(git -C "$ROOT" rev-parse --short HEAD 2>/dev/null || echo unknown)" "$SEED" "$RULES"
+    first=1
+    for size in "$@"; do
+        corpus="$TMP/corpus-$size.txt"
+        gen_corpus -s "$SEED" -r "$RULES" -R rwords.txt "$size" "$corpus"
+
+        run() {
+            name=$1
+            shift
+            [ $first -eq 1 ] || printf ',\n'
+            first=0
+            printf '    '
+            bench_run "$size/$name" "$@" | tr -d '\n'
+        }
+        shell() {
+            name=$1
+            printf '%s\nQuit\n' "$2" > "$TMP/commands.txt"
+            run "$name" -i "$TMP/commands.txt" -I "$corpus" -o /dev/null -c "$TMP/out.txt" -- myshell
+        }
+
+        run word_counter -i "$corpus" -o "$TMP/out.txt" -- word_counter -w
+        run word_replacer -i "$corpus" -o "$TMP/out.txt" -- word_replacer rwords.txt
+        run word_replacer_automaton -i "$corpus" -o "$TMP/out.txt" -- word_replacer -a rwords.txt
+        run proc_starter -i "$corpus" -o "$TMP/out.txt" -- proc_starter
+        run proc_starter_threads -i "$corpus" -o "$TMP/out.txt" -- proc_starter -t
+        run proc_starter_sharded -i "$corpus" -o "$TMP/out.txt" -- proc_starter -n "$(nproc)"
+        shell shell_pipe "Run word_replacer rwords.txt From $corpus Pipe word_counter -w To $TMP/out.txt"
+        shell shell_builtin "Run WordReplace rwords.txt From $corpus Pipe WordCount -w To $TMP/out.txt"
+        shell shell_tee "Run cat $corpus Pipe Tee $TMP/copy.txt Pipe WordCount -w To $TMP/out.txt"
+        rm -f "$corpus" "$TMP/out.txt" "$TMP/copy.txt"
+    done
+    printf '\n  ]\n}\n'
+} > "$TMP/results.json"
+
+if [ -n "$OUT" ]; then
+    cd "$ROOT"
+    cp "$TMP/results.json" "$OUT"
+else
+    cat "$TMP/results.json"
+fi
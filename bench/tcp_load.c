@@ -0,0 +1,148 @@
+// Load client for Serve: opens the given number of connections, at most
+// 'concurrency' at a time, and on each one sends the request file (if any),
+// shuts down its side and reads the reply to EOF. Prints connections per
+// second and the latency distribution from connect to the end of the reply.
+//
+//   gcc -O2 -pthread -o tcp_load bench/tcp_load.c
+//   ./tcp_load <host> <port> <connections> <concurrency> [<request file>]
+//
+// e.g. with "Serve 9400 Prefork 4 Run WordReplace rwords.txt" in myshell:
+//   ./tcp_load 127.0.0.1 9400 2000 16 alice2.txt
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netdb.h>
+
+static struct addrinfo *target;
+static char *request;
+static long request_len;
+static long connections;
+static long next_connection;   // taken with an atomic add by the threads
+static double *latency;        // seconds per connection, -1 for a failure
+static long reply_bytes;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static int one_connection(long *received) {
+    int fd = socket(target->ai_family, target->ai_socktype, target->ai_protocol);
+    if (fd < 0) return -1;
+    if (connect(fd, target->ai_addr, target->ai_addrlen) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    for (long off = 0; off < request_len;) {
+        ssize_t n = write(fd, request + off, request_len - off);
+        if (n <= 0) {
+            close(fd);
+            return -1;
+        }
+        off += n;
+    }
+    shutdown(fd, SHUT_WR);
+
+    char buffer[65536];
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0) *received += n;
+    close(fd);
+    return (n < 0) ? -1 : 0;
+}
+
+static void *client_thread(void *arg) {
+    (void)arg;
+    long received = 0;
+    long i;
+    while ((i = __atomic_fetch_add(&next_connection, 1, __ATOMIC_RELAXED)) < connections) {
+        double t0 = now_sec();
+        latency[i] = (one_connection(&received) == 0) ? now_sec() - t0 : -1;
+    }
+    __atomic_add_fetch(&reply_bytes, received, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 5 || argc > 6) {
+        fprintf(stderr, "Usage: %s <host> <port> <connections> <concurrency> [<request file>]\n", argv[0]);
+        return 1;
+    }
+    connections = atol(argv[3]);
+    int concurrency = atoi(argv[4]);
+    if (connections <= 0 || concurrency <= 0) {
+        fprintf(stderr, "connections and concurrency must be positive\n");
+        return 1;
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int error = getaddrinfo(argv[1], argv[2], &hints, &target);
+    if (error) {
+        fprintf(stderr, "%s\n", gai_strerror(error));
+        return 1;
+    }
+
+    if (argc == 6) {
+        int fd = open(argv[5], O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            perror(argv[5]);
+            return 1;
+        }
+        request_len = st.st_size;
+        request = (char *)malloc(request_len + 1);
+        for (long off = 0; off < request_len;) {
+            ssize_t n = read(fd, request + off, request_len - off);
+            if (n <= 0) {
+                perror(argv[5]);
+                return 1;
+            }
+            off += n;
+        }
+        close(fd);
+    }
+
+    latency = (double *)malloc(sizeof(double) * connections);
+    pthread_t *threads = (pthread_t *)malloc(sizeof(pthread_t) * concurrency);
+    double start = now_sec();
+    for (int t = 0; t < concurrency; t++) pthread_create(&threads[t], NULL, client_thread, NULL);
+    for (int t = 0; t < concurrency; t++) pthread_join(threads[t], NULL);
+    double total = now_sec() - start;
+
+    // failures sort first
+    qsort(latency, connections, sizeof(double), compare_double);
+    long failed = 0;
+    while (failed < connections && latency[failed] < 0) failed++;
+    long ok = connections - failed;
+
+    printf("%ld connections, %d at a time, %ld failed, %.2f s\n", connections, concurrency, failed, total);
+    printf("%.0f connections/s, %.1f MB received\n", connections / total, reply_bytes / 1048576.0);
+    if (ok > 0) {
+        double *lat = latency + failed;
+        double sum = 0;
+        for (long i = 0; i < ok; i++) sum += lat[i];
+        printf("latency: mean %.2f ms  p50 %.2f ms  p99 %.2f ms  max %.2f ms\n",
+               sum / ok * 1e3, lat[ok / 2] * 1e3, lat[ok * 99 / 100] * 1e3, lat[ok - 1] * 1e3);
+    }
+
+    free(threads);
+    free(latency);
+    free(request);
+    freeaddrinfo(target);
+    return failed > 0;
+}
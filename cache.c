@@ -0,0 +1,246 @@
+#define _GNU_SOURCE  // copy_file_range
+#include <stdio.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include "cache.h"
+
+#define FNV_PRIME 1099511628211ULL
+
+int cache_open(struct Cache *c) {
+    memset(c, 0, sizeof(*c));
+    const char *dir = getenv("MYSHELL_CACHE");
+    if (dir != NULL) {
+        c->dir = strdup(dir);
+    } else {
+        const char *home = getenv("HOME");
+        if (home == NULL) return -1;
+        c->dir = (char *)malloc(strlen(home) + sizeof(CACHE_DIR) + 1);
+        if (c->dir != NULL) sprintf(c->dir, "%s/%s", home, CACHE_DIR);
+    }
+    const char *limit = getenv("MYSHELL_CACHESIZE");
+    c->limit = (limit != NULL && atol(limit) > 0) ? atol(limit) : CACHE_LIMIT;
+    if (c->dir == NULL || (mkdir(c->dir, 0700) == -1 && errno != EEXIST)) {
+        free(c->dir);
+        c->dir = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void cache_close(struct Cache *c) {
+    free(c->dir);
+    c->dir = NULL;
+}
+
+void cache_key_init(struct CacheKey *k) {
+    k->lo = 14695981039346656037ULL;  // FNV-1a offset basis
+    k->hi = 0x9e3779b97f4a7c15ULL;
+}
+
+void cache_key_add(struct CacheKey *k, const void *data, size_t len) {
+    const unsigned char *p = (const unsigned char *)data;
+    unsigned long long lo = k->lo, hi = k->hi;
+    for (size_t i = 0; i < len; i++) {
+        lo = (lo ^ p[i]) * FNV_PRIME;
+        hi = (hi ^ p[i]) * FNV_PRIME;
+    }
+    k->lo = lo;
+    k->hi = hi ^ len;  // keeps the lanes apart
+}
+
+void cache_key_string(struct CacheKey *k, const char *s) {
+    cache_key_add(k, s, strlen(s) + 1);
+}
+
+int cache_key_fd(struct CacheKey *k, int fd, int contents) {
+    struct stat st;
+    if (fstat(fd, &st) == -1) return -1;
+    long long size = st.st_size;
+    cache_key_add(k, &size, sizeof(size));
+    if (!contents) {
+        long long id[4] = { (long long)st.st_dev, (long long)st.st_ino, (long long)st.st_mtim.tv_sec, (long long)st.st_mtim.tv_nsec };
+        cache_key_add(k, id, sizeof(id));
+        return 0;
+    }
+    if (size == 0) return 0;
+    void *text = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (text == MAP_FAILED) return -1;
+    madvise(text, size, MADV_SEQUENTIAL);
+    cache_key_add(k, text, size);
+    munmap(text, size);
+    return 0;
+}
+
+int cache_key_path(struct CacheKey *k, const char *path, int contents) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    int result = cache_key_fd(k, fd, contents);
+    close(fd);
+    return result;
+}
+
+static char *entry_path(struct Cache *c, const struct CacheKey *k, const char *prefix, long suffix) {
+    char *path = (char *)malloc(strlen(c->dir) + 64);
+    if (path == NULL) return NULL;
+    if (prefix == NULL) sprintf(path, "%s/%016llx%016llx", c->dir, k->hi, k->lo);
+    else sprintf(path, "%s/%s%016llx%016llx.%ld", c->dir, prefix, k->hi, k->lo, suffix);
+    return path;
+}
+
+int cache_lookup(struct Cache *c, const struct CacheKey *k) {
+    char *path = entry_path(c, k, NULL, 0);
+    if (path == NULL) return -1;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    free(path);
+    if (fd < 0) {
+        c->misses++;
+        return -1;
+    }
+    futimens(fd, NULL);  // most recently used
+    c->hits++;
+    return fd;
+}
+
+char *cache_begin(struct Cache *c, const struct CacheKey *k) {
+    char *path = entry_path(c, k, ".", (long)getpid());
+    if (path == NULL) return NULL;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        free(path);
+        return NULL;
+    }
+    close(fd);
+    return path;
+}
+
+struct CacheEntry {
+    char name[64];
+    long size;
+    struct timespec used;
+};
+
+static int by_use(const void *a, const void *b) {
+    const struct CacheEntry *x = (const struct CacheEntry *)a, *y = (const struct CacheEntry *)b;
+    if (x->used.tv_sec != y->used.tv_sec) return (x->used.tv_sec < y->used.tv_sec) ? -1 : 1;
+    return (x->used.tv_nsec < y->used.tv_nsec) ? -1 : (x->used.tv_nsec > y->used.tv_nsec);
+}
+
+// Entries of the directory (not temporaries) and their total size
+static struct CacheEntry *list_entries(struct Cache *c, int *count, long *total) {
+    *count = 0;
+    *total = 0;
+    DIR *dir = opendir(c->dir);
+    if (dir == NULL) return NULL;
+    struct CacheEntry *entries = NULL;
+    int cap = 0;
+    struct dirent *d;
+    while ((d = readdir(dir)) != NULL) {
+        struct stat st;
+        if (d->d_name[0] == '.' || strlen(d->d_name) >= sizeof(entries->name)) continue;
+        if (fstatat(dirfd(dir), d->d_name, &st, 0) == -1 || !S_ISREG(st.st_mode)) continue;
+        if (*count == cap) {
+            cap = (cap > 0) ? cap * 2 : 64;
+            struct CacheEntry *p = (struct CacheEntry *)realloc(entries, sizeof(struct CacheEntry) * cap);
+            if (p == NULL) break;
+            entries = p;
+        }
+        struct CacheEntry *e = &entries[(*count)++];
+        strcpy(e->name, d->d_name);
+        e->size = st.st_size;
+        e->used = st.st_mtim;
+        *total += st.st_size;
+    }
+    closedir(dir);
+    return entries;
+}
+
+static void evict(struct Cache *c) {
+    int count;
+    long total;
+    struct CacheEntry *entries = list_entries(c, &count, &total);
+    if (total > c->limit) {
+        qsort(entries, count, sizeof(struct CacheEntry), by_use);
+        int dir = open(c->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        for (int i = 0; i < count && total > c->limit && dir >= 0; i++) {
+            if (unlinkat(dir, entries[i].name, 0) == 0) total -= entries[i].size;
+        }
+        if (dir >= 0) close(dir);
+    }
+    free(entries);
+}
+
+int cache_commit(struct Cache *c, const struct CacheKey *k, const char *temp) {
+    char *path = entry_path(c, k, NULL, 0);
+    if (path == NULL || rename(temp, path) == -1) {
+        free(path);
+        unlink(temp);
+        return -1;
+    }
+    free(path);
+    c->stored++;
+    evict(c);
+    return 0;
+}
+
+long cache_replay(int from, int out) {
+    struct stat st;
+    if (fstat(from, &st) == -1) return -1;
+    long done = 0;
+    int mode = 0;  // 0 copy_file_range, 1 sendfile, 2 read and write
+    static char buffer[1 << 16];
+    while (done < st.st_size) {
+        ssize_t n;
+        if (mode == 0) {
+            n = copy_file_range(from, NULL, out, NULL, st.st_size - done, 0);
+            // another file system, or out is not a regular file or is in append mode
+            if (n == -1 && (errno == EXDEV || errno == EINVAL || errno == EBADF || errno == EOPNOTSUPP || errno == ENOSYS)) {
+                mode = 1;
+                continue;
+            }
+        } else if (mode == 1) {
+            off_t offset = done;
+            n = sendfile(out, from, &offset, st.st_size - done);
+            // out is in append mode
+            if (n == -1 && (errno == EINVAL || errno == EBADF)) {
+                mode = 2;
+                continue;
+            }
+        } else {
+            long want = st.st_size - done;
+            n = pread(from, buffer, (want < (long)sizeof(buffer)) ? want : (long)sizeof(buffer), done);
+            for (ssize_t sent = 0, k; n > 0 && sent < n; sent += k) {
+                k = write(out, buffer + sent, n - sent);
+                if (k == -1 && errno == EINTR) k = 0;
+                else if (k <= 0) return -1;
+            }
+        }
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        done += n;
+    }
+    return done;
+}
+
+void cache_print(struct Cache *c, MILE *out) {
+    int count;
+    long total;
+    struct CacheEntry *entries = list_entries(c, &count, &total);
+    free(entries);
+    char line[256];
+    int length = snprintf(line, sizeof(line), "%s: %d entries, %ld of %ld bytes; this session %ld hits, %ld misses, %ld stored\n",
+                          c->dir, count, total, c->limit, c->hits, c->misses, c->stored);
+    mputs(out, line, length);
+}
+
+int cache_clear(struct Cache *c) {
+    int count;
+    long total;
+    struct CacheEntry *entries = list_entries(c, &count, &total);
+    int dir = open(c->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    for (int i = 0; i < count && dir >= 0; i++) unlinkat(dir, entries[i].name, 0);
+    if (dir >= 0) close(dir);
+    free(entries);
+    return (dir >= 0) ? 0 : -1;
+}
@@ -0,0 +1,56 @@
+#ifndef CACHE_H_
+#define CACHE_H_
+#include "mio.h"
+
+#define CACHE_DIR ".myshell_cache"  // in $HOME unless MYSHELL_CACHE names a directory
+#define CACHE_LIMIT (256L << 20)    // bytes kept on disk, MYSHELL_CACHESIZE overrides
+
+// On-disk cache of command output for Cached. Each entry is a file named by
+// the hex fingerprint of what produced it; a hit refreshes the file's mtime,
+// and once the directory holds more than the limit the entries with the
+// oldest mtime are removed (LRU). Entries are written to a temporary name and
+// renamed into place, so sessions sharing the directory never see a partial
+// entry.
+struct Cache {
+    char *dir;
+    long limit;
+    long hits, misses, stored;  // this session
+};
+
+// 128 bit fingerprint: two FNV-1a lanes with different offsets
+struct CacheKey {
+    unsigned long long lo, hi;
+};
+
+int cache_open(struct Cache *c);
+void cache_close(struct Cache *c);
+
+void cache_key_init(struct CacheKey *k);
+void cache_key_add(struct CacheKey *k, const void *data, size_t len);
+void cache_key_string(struct CacheKey *k, const char *s);  // with its terminator
+
+// Add what identifies an open file: device, inode, size and mtime, or with
+// 'contents' its size and bytes, so the key survives a touch or a copy.
+// Returns -1 if the file can not be read.
+int cache_key_fd(struct CacheKey *k, int fd, int contents);
+int cache_key_path(struct CacheKey *k, const char *path, int contents);
+
+// Read-only descriptor of the entry for k, or -1 on a miss
+int cache_lookup(struct Cache *c, const struct CacheKey *k);
+
+// Temporary path to write an entry to, malloc'd; the file is created empty
+char *cache_begin(struct Cache *c, const struct CacheKey *k);
+
+// Move a finished entry into place and evict down to the limit
+int cache_commit(struct Cache *c, const struct CacheKey *k, const char *temp);
+
+// Copy a whole file to out without passing it through user space where the
+// kernel allows: copy_file_range, then sendfile, then read and write for a
+// target that takes neither (one opened for append). Returns the bytes copied,
+// or -1 if the whole file could not be copied.
+long cache_replay(int from, int out);
+
+void cache_print(struct Cache *c, MILE *out);
+int cache_clear(struct Cache *c);
+
+#endif
@@ -0,0 +1,213 @@
+#include "mio.h"
+#include "cmdline.h"
+
+void *arena_alloc(struct Arena *a, size_t size) {
+    size = (size + 15) & ~(size_t)15;
+    struct ArenaBlock *b = a->head;
+    if (b == NULL || b->used + size > b->size) {
+        size_t cap = (size > ARENA_BLOCK) ? size : ARENA_BLOCK;
+        b = (struct ArenaBlock *)malloc(sizeof(struct ArenaBlock) + cap);
+        if (b == NULL) return NULL;
+        b->size = cap;
+        b->used = 0;
+        b->next = a->head;
+        a->head = b;
+    }
+    void *p = b->data + b->used;
+    b->used += size;
+    return p;
+}
+
+char *arena_strndup(struct Arena *a, const char *s, size_t len) {
+    char *copy = (char *)arena_alloc(a, len + 1);
+    if (copy == NULL) return NULL;
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+void arena_reset(struct Arena *a) {
+    struct ArenaBlock *keep = a->head;
+    for (struct ArenaBlock *b = a->head; b != NULL; b = b->next) {
+        if (b->size > keep->size) keep = b;
+    }
+    struct ArenaBlock *b = a->head;
+    while (b != NULL) {
+        struct ArenaBlock *next = b->next;
+        if (b != keep) free(b);
+        b = next;
+    }
+    if (keep != NULL) {
+        keep->used = 0;
+        keep->next = NULL;
+    }
+    a->head = keep;
+}
+
+void arena_free(struct Arena *a) {
+    while (a->head != NULL) {
+        struct ArenaBlock *next = a->head->next;
+        free(a->head);
+        a->head = next;
+    }
+}
+
+struct Lexer {
+    char *p;                   // next character to read
+    const char *error;
+};
+
+// Return the next word, unquoted in place, or NULL at the end of the line
+// (or on an error). Unquoting only ever moves characters left, so the word
+// stays inside its own span of the line.
+static char *next_word(struct Lexer *lx, int *quoted) {
+    char *p = lx->p;
+    while (*p == ' ' || *p == '\t') p++;
+    if (*p == '\0') {
+        lx->p = p;
+        return NULL;
+    }
+
+    char *word = p, *out = p;
+    *quoted = 0;
+    while (*p != '\0' && *p != ' ' && *p != '\t') {
+        if (*p == '\'' || *p == '"') {
+            char quote = *p++;
+            *quoted = 1;
+            while (*p != '\0' && *p != quote) {
+                if (quote == '"' && *p == '\\' && (p[1] == '"' || p[1] == '\\')) p++;
+                *out++ = *p++;
+            }
+            if (*p == '\0') {
+                lx->error = "Error: unterminated quote\n";
+                return NULL;
+            }
+            p++;
+        } else if (*p == '\\' && p[1] != '\0') {
+            *quoted = 1;
+            p++;
+            *out++ = *p++;
+        } else {
+            *out++ = *p++;
+        }
+    }
+    if (*p != '\0') p++;
+    *out = '\0';
+    lx->p = p;
+    return word;
+}
+
+static int is_keyword(const char *word, int quoted, const char *keyword) {
+    return !quoted && strcmp(word, keyword) == 0;
+}
+
+// Take the Pin/Nice/Node modifiers in front of a stage's program; *word is
+// left on the first word after them
+static int parse_modifiers(struct Lexer *lx, struct CmdStage *stage, char **word, int *quoted, const char **error) {
+    stage->pin = stage->nice = stage->node = NULL;
+    while (*word != NULL) {
+        char **value;
+        if (is_keyword(*word, *quoted, "Pin")) value = &stage->pin;
+        else if (is_keyword(*word, *quoted, "Nice")) value = &stage->nice;
+        else if (is_keyword(*word, *quoted, "Node")) value = &stage->node;
+        else return 0;
+        if (*value != NULL || (*value = next_word(lx, quoted)) == NULL) {
+            *error = "Error: Pin, Nice and Node take one value each\n";
+            return -1;
+        }
+        *word = next_word(lx, quoted);
+    }
+    return 0;
+}
+
+int cmd_tcp_target(char *target, char **hostname, char **port) {
+    *hostname = target + 5; // Skip "/TCP/"
+    char *slash = strchr(*hostname, '/');
+    if (slash == NULL || slash == *hostname || slash[1] == '\0') return -1;
+    *slash = '\0';
+    *port = slash + 1;
+    slash = strchr(*port, '/');
+    if (slash != NULL) *slash = '\0';
+    return 0;
+}
+
+int cmd_parse_run(struct Arena *a, const char *line, struct CmdLine *cmd, const char **error) {
+    memset(cmd, 0, sizeof(*cmd));
+    size_t len = strlen(line);
+    struct Lexer lx;
+    lx.p = arena_strndup(a, line, len);
+    lx.error = NULL;
+
+    // a word takes at least two characters of the line with its separator, so
+    // these bounds hold; the arguments of all stages share one vector, each
+    // stage's run ending in a NULL
+    size_t max_words = len / 2 + 2;
+    char **vector = (char **)arena_alloc(a, sizeof(char *) * (max_words + 1));
+    cmd->stages = (struct CmdStage *)arena_alloc(a, sizeof(struct CmdStage) * (max_words / 2 + 1));
+    if (lx.p == NULL || vector == NULL || cmd->stages == NULL) {
+        *error = "Error: out of memory\n";
+        return -1;
+    }
+    size_t used = 0;
+
+    char *word;
+    int quoted;
+    *error = NULL;
+    while (*error == NULL && (word = next_word(&lx, &quoted)) != NULL) {
+        if (is_keyword(word, quoted, "&")) {
+            if (cmd->count == 0 || next_word(&lx, &quoted) != NULL) *error = "Error: & must end a command\n";
+            cmd->background = 1;
+        } else if (cmd->count == 0 || is_keyword(word, quoted, "Pipe")) {
+            if (cmd->output_file != NULL || cmd->out_host != NULL || cmd->out_mem != NULL) {
+                *error = "Error: To must come after the last stage\n";
+                break;
+            }
+            if (cmd->count > 0) word = next_word(&lx, &quoted);
+            struct CmdStage *stage = &cmd->stages[cmd->count];
+            if (parse_modifiers(&lx, stage, &word, &quoted, error) == -1) break;
+            if (word == NULL || is_keyword(word, quoted, "Pipe") || is_keyword(word, quoted, "From") || is_keyword(word, quoted, "To")) {
+                *error = "Error: Pipe needs a program\n";
+                break;
+            }
+            if (cmd->count++ > 0) used++; // past the previous stage's NULL
+            stage->program = word;
+            stage->arguments = &vector[used];
+            stage->arg_count = 1;
+            vector[used++] = word;
+            vector[used] = NULL;
+        } else if (is_keyword(word, quoted, "From")) {
+            word = next_word(&lx, &quoted);
+            if (word == NULL || cmd->count > 1 || cmd->input_file != NULL || cmd->in_host != NULL || cmd->in_mem != NULL) {
+                *error = "Error: From takes one file on the first stage\n";
+            } else if (strncmp(word, "/TCP/", 5) == 0) {
+                if (cmd_tcp_target(word, &cmd->in_host, &cmd->in_port) == -1) *error = "Error: use From /TCP/host/port\n";
+            } else if (strncmp(word, "/MEM/", 5) == 0) {
+                if (word[5] == '\0') *error = "Error: use From /MEM/name\n";
+                cmd->in_mem = word + 5;
+            } else {
+                cmd->input_file = word;
+            }
+        } else if (is_keyword(word, quoted, "Keep") && cmd->out_host != NULL) {
+            cmd->keep = 1;
+        } else if (is_keyword(word, quoted, "To")) {
+            word = next_word(&lx, &quoted);
+            if (word == NULL || cmd->output_file != NULL || cmd->out_host != NULL || cmd->out_mem != NULL) {
+                *error = "Error: To takes one file, /TCP/host/port or /MEM/name\n";
+            } else if (strncmp(word, "/TCP/", 5) == 0) {
+                if (cmd_tcp_target(word, &cmd->out_host, &cmd->out_port) == -1) *error = "Error: use To /TCP/host/port\n";
+            } else if (strncmp(word, "/MEM/", 5) == 0) {
+                if (word[5] == '\0') *error = "Error: use To /MEM/name\n";
+                cmd->out_mem = word + 5;
+            } else {
+                cmd->output_file = word;
+            }
+        } else {
+            // the current stage is always the last run of the vector
+            cmd->stages[cmd->count - 1].arg_count++;
+            vector[used++] = word;
+            vector[used] = NULL;
+        }
+    }
+    if (*error == NULL) *error = lx.error;
+    return (*error != NULL) ? -1 : 0;
+}
@@ -0,0 +1,61 @@
+#ifndef CMDLINE_H_
+#define CMDLINE_H_
+#include <stddef.h>
+
+#define ARENA_BLOCK 4096       // default block size of a command arena
+
+// Bump allocator for everything parsed from one command line. Nothing is
+// freed on its own: arena_reset drops it all at once and keeps the largest
+// block for the next line, arena_free releases every block.
+struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t size, used;
+    char data[];
+};
+
+struct Arena {
+    struct ArenaBlock *head;
+};
+
+void *arena_alloc(struct Arena *a, size_t size);
+char *arena_strndup(struct Arena *a, const char *s, size_t len);
+void arena_reset(struct Arena *a);
+void arena_free(struct Arena *a);
+
+// One program of a Run command
+struct CmdStage {
+    char *program;
+    char **arguments;          // NULL terminated, arguments[0] is the program
+    int arg_count;
+    char *pin, *nice, *node;   // values of the Pin, Nice and Node modifiers, or NULL
+};
+
+// The parsed form of
+//   [<modifiers>] <program> [<args>] [Pipe <program> [<args>]]... [From <file>|/TCP/h/p|/MEM/name]
+//   [To <file>|/TCP/h/p [Keep]|/MEM/name] [&]
+// where a stage's program may be preceded by Pin <cpus>, Nice <n> and Node <n>
+struct CmdLine {
+    struct CmdStage *stages;
+    int count;
+    char *input_file;
+    char *in_host, *in_port;   // From /TCP/host/port
+    char *in_mem;              // From /MEM/name
+    char *output_file;
+    char *out_host, *out_port; // To /TCP/host/port
+    char *out_mem;             // To /MEM/name
+    int keep;                  // Keep after To /TCP/
+    int background;            // trailing '&'
+};
+
+// Parse the part of a Run command after "Run" in a single pass. The line is
+// copied once into the arena and split there in place, so every word of cmd
+// points into that copy. Words are separated by blanks; '...' quotes
+// literally, "..." honours \" and \\, and a backslash escapes the next
+// character. A quoted word is never taken as a keyword. Returns 0, or -1
+// with *error set to a message ending in a newline.
+int cmd_parse_run(struct Arena *a, const char *line, struct CmdLine *cmd, const char **error);
+
+// Split /TCP/host/port in place; returns -1 if host or port is missing
+int cmd_tcp_target(char *target, char **hostname, char **port);
+
+#endif
@@ -0,0 +1,378 @@
+#include <stdio.h>
+#include <errno.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include "mio.h"
+#include "history.h"
+
+static int open_log(struct History *h) {
+    h->fd = open(h->path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    return (h->fd < 0) ? -1 : 0;
+}
+
+// A compaction elsewhere renamed a new log over the path: follow it
+static int follow_log(struct History *h) {
+    struct stat by_path, by_fd;
+    if (stat(h->path, &by_path) == 0 && fstat(h->fd, &by_fd) == 0 && by_path.st_ino == by_fd.st_ino) return 0;
+    close(h->fd);
+    return open_log(h);
+}
+
+// Take the log's lock, first following any compaction that replaced it
+static int lock_log(struct History *h) {
+    for (int tries = 0; tries < 8; tries++) {
+        if (flock(h->fd, LOCK_EX) == -1) return -1;
+        struct stat by_path, by_fd;
+        if (stat(h->path, &by_path) == 0 && fstat(h->fd, &by_fd) == 0 && by_path.st_ino == by_fd.st_ino) return 0;
+        flock(h->fd, LOCK_UN);
+        if (follow_log(h) == -1) return -1;
+    }
+    return -1;
+}
+
+int history_open(struct History *h, const char *path) {
+    memset(h, 0, sizeof(*h));
+    if (path == NULL) path = getenv("MYSHELL_HISTORY");
+    if (path != NULL) {
+        h->path = strdup(path);
+    } else {
+        const char *home = getenv("HOME");
+        if (home == NULL) return -1;
+        h->path = (char *)malloc(strlen(home) + sizeof(HISTORY_FILE) + 1);
+        if (h->path != NULL) sprintf(h->path, "%s/%s", home, HISTORY_FILE);
+    }
+    const char *limit = getenv("MYSHELL_HISTSIZE");
+    h->limit = (limit != NULL && atol(limit) > 0) ? atol(limit) : HISTORY_LIMIT;
+    if (h->path == NULL || open_log(h) == -1) {
+        free(h->path);
+        return -1;
+    }
+    return 0;
+}
+
+void history_close(struct History *h) {
+    if (h->text != NULL) munmap((void *)h->text, h->mapped);
+    if (h->fd >= 0) close(h->fd);
+    free(h->entries);
+    free(h->suffixes);
+    free(h->recent);
+    free(h->path);
+    memset(h, 0, sizeof(*h));
+    h->fd = -1;
+}
+
+// Order of two suffixes, each ending at its line's newline
+static int suffix_compare(const char *text, unsigned int a, unsigned int b) {
+    const unsigned char *x = (const unsigned char *)text + a;
+    const unsigned char *y = (const unsigned char *)text + b;
+    while (*x == *y && *x != '\n') {
+        x++;
+        y++;
+    }
+    if (*x == *y) return 0;
+    if (*x == '\n') return -1;
+    if (*y == '\n') return 1;
+    return (int)*x - (int)*y;
+}
+
+static int grow(unsigned int **array, long *cap, long needed) {
+    if (needed <= *cap) return 0;
+    long new_cap = (*cap > 0) ? *cap : 1024;
+    while (new_cap < needed) new_cap *= 2;
+    unsigned int *p = (unsigned int *)realloc(*array, sizeof(unsigned int) * new_cap);
+    if (p == NULL) return -1;
+    *array = p;
+    *cap = new_cap;
+    return 0;
+}
+
+// Character 'depth' of a suffix, 0 past the end of its line
+static inline int suffix_char(const char *text, unsigned int pos, int depth) {
+    unsigned char c = (unsigned char)text[pos + depth];
+    return (c == '\n') ? 0 : c;
+}
+
+// Multikey quicksort: partition on one character at a time, so the long
+// prefixes history lines share ("Run cat ...") are not compared over and over
+static void sort_suffixes(const char *text, unsigned int *a, long n, int depth) {
+    while (n > 1) {
+        if (n < 16) {
+            for (long i = 1; i < n; i++) {
+                unsigned int v = a[i];
+                long j = i;
+                for (; j > 0 && suffix_compare(text, a[j - 1], v) > 0; j--) a[j] = a[j - 1];
+                a[j] = v;
+            }
+            return;
+        }
+        int pivot = suffix_char(text, a[n / 2], depth);
+        long lt = 0, i = 0, gt = n;
+        while (i < gt) {
+            int c = suffix_char(text, a[i], depth);
+            unsigned int t = a[i];
+            if (c < pivot) {
+                a[i++] = a[lt];
+                a[lt++] = t;
+            } else if (c > pivot) {
+                a[i] = a[--gt];
+                a[gt] = t;
+            } else {
+                i++;
+            }
+        }
+        sort_suffixes(text, a, lt, depth);
+        sort_suffixes(text, a + gt, n - gt, depth);
+        // the equal part continues on the next character, unless the lines ended
+        if (pivot == 0) return;
+        a += lt;
+        n = gt - lt;
+        depth++;
+    }
+}
+
+// Merge the sorted run 'added' into the sorted run (*run, *count)
+static int merge_run(const char *text, unsigned int **run, long *count, long *cap, const unsigned int *added, long n) {
+    if (grow(run, cap, *count + n) == -1) return -1;
+    unsigned int *r = *run;
+    long i = *count - 1, j = n - 1, k = *count + n - 1;
+    while (j >= 0) {
+        if (i >= 0 && suffix_compare(text, r[i], added[j]) > 0) r[k--] = r[i--];
+        else r[k--] = added[j--];
+    }
+    *count += n;
+    return 0;
+}
+
+int history_refresh(struct History *h) {
+    if (follow_log(h) == -1) return -1;
+    struct stat st;
+    if (fstat(h->fd, &st) == -1) return -1;
+    if (st.st_size > 0xffffffffL) st.st_size = 0xffffffffL;
+
+    int remap = ((size_t)st.st_size != h->mapped);
+    if (st.st_ino != h->inode || (size_t)st.st_size < h->indexed) {
+        // a new log: index it from the start, from a mapping of the new file
+        // even when it has the old one's size
+        remap = 1;
+        h->inode = st.st_ino;
+        h->indexed = 0;
+        h->count = 0;
+        h->nsuffixes = 0;
+        h->nrecent = 0;
+    }
+    if (remap) {
+        if (h->text != NULL) munmap((void *)h->text, h->mapped);
+        h->text = NULL;
+        h->mapped = 0;
+        if (st.st_size > 0) {
+            void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, h->fd, 0);
+            if (p == MAP_FAILED) return -1;
+            h->text = (const char *)p;
+            h->mapped = st.st_size;
+        }
+    }
+
+    // only whole lines are indexed; a line being written is taken next time
+    size_t end = h->mapped;
+    while (end > h->indexed && h->text[end - 1] != '\n') end--;
+    if (end == h->indexed) return 0;
+
+    long words = 0;
+    for (size_t i = h->indexed; i < end; i++) {
+        if (h->text[i] != ' ' && h->text[i] != '\n' && (i == 0 || h->text[i - 1] == ' ' || h->text[i - 1] == '\n')) words++;
+    }
+    unsigned int *added = (unsigned int *)malloc(sizeof(unsigned int) * (words + 1));
+    if (added == NULL) return -1;
+
+    long n = 0;
+    for (size_t i = h->indexed; i < end; i++) {
+        int line_start = (i == 0 || h->text[i - 1] == '\n');
+        if (line_start) {
+            if (grow(&h->entries, &h->cap, h->count + 1) == -1) {
+                free(added);
+                return -1;
+            }
+            h->entries[h->count++] = (unsigned int)i;
+        }
+        if (h->text[i] != ' ' && h->text[i] != '\n' && (line_start || h->text[i - 1] == ' ')) added[n++] = (unsigned int)i;
+    }
+    // new suffixes go to the small recent run, which is folded into the main
+    // array only once it reaches an eighth of it, so a refresh after a few
+    // commands costs little however long the history is
+    sort_suffixes(h->text, added, n, 0);
+    int result = merge_run(h->text, &h->recent, &h->nrecent, &h->recent_cap, added, n);
+    if (result == 0 && h->nrecent > h->nsuffixes / 8) {
+        result = merge_run(h->text, &h->suffixes, &h->nsuffixes, &h->suffix_cap, h->recent, h->nrecent);
+        if (result == 0) h->nrecent = 0;
+    }
+    free(added);
+    if (result == 0) h->indexed = end;
+    return result;
+}
+
+const char *history_entry(struct History *h, long n, int *length) {
+    if (n < 1 || n > h->count) return NULL;
+    const char *start = h->text + h->entries[n - 1];
+    *length = (int)((const char *)memchr(start, '\n', h->text + h->indexed - start) - start);
+    return start;
+}
+
+// <0, 0 or >0 as the suffix at pos sorts before, matches or sorts after the pattern
+static int pattern_compare(const struct History *h, unsigned int pos, const char *pattern, int length) {
+    for (int i = 0; i < length; i++) {
+        unsigned char c = (unsigned char)h->text[pos + i];
+        if (c == '\n') return -1;
+        if (c != (unsigned char)pattern[i]) return (int)c - (int)(unsigned char)pattern[i];
+    }
+    return 0;
+}
+
+static int compare_long(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+// Entry holding offset pos
+static long entry_of(const struct History *h, unsigned int pos) {
+    long lo = 0, hi = h->count;
+    while (hi - lo > 1) {
+        long mid = (lo + hi) / 2;
+        if (h->entries[mid] <= pos) lo = mid;
+        else hi = mid;
+    }
+    return lo + 1;
+}
+
+// Range [*first, *last) of the suffixes in run that start with the pattern
+static void find_range(const struct History *h, const unsigned int *run, long count, const char *pattern, int length,
+                       long *first, long *last) {
+    long lo = 0, hi = count;
+    while (lo < hi) {
+        long mid = (lo + hi) / 2;
+        if (pattern_compare(h, run[mid], pattern, length) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    *first = lo;
+    hi = count;
+    while (lo < hi) {
+        long mid = (lo + hi) / 2;
+        if (pattern_compare(h, run[mid], pattern, length) <= 0) lo = mid + 1;
+        else hi = mid;
+    }
+    *last = lo;
+}
+
+long history_search(struct History *h, const char *pattern, int anywhere, long **found) {
+    *found = NULL;
+    if (history_refresh(h) == -1) return -1;
+    int length = (int)strlen(pattern);
+
+    long first[2], last[2];
+    find_range(h, h->suffixes, h->nsuffixes, pattern, length, &first[0], &last[0]);
+    find_range(h, h->recent, h->nrecent, pattern, length, &first[1], &last[1]);
+
+    long *numbers = (long *)malloc(sizeof(long) * (last[0] - first[0] + last[1] - first[1] + 1));
+    if (numbers == NULL) return -1;
+    long n = 0;
+    for (int r = 0; r < 2; r++) {
+        const unsigned int *run = (r == 0) ? h->suffixes : h->recent;
+        for (long i = first[r]; i < last[r]; i++) {
+            unsigned int pos = run[i];
+            if (!anywhere && pos != 0 && h->text[pos - 1] != '\n') continue;
+            numbers[n++] = entry_of(h, pos);
+        }
+    }
+
+    // chronological, and an entry once however many of its words match
+    qsort(numbers, n, sizeof(long), compare_long);
+    long unique = 0;
+    for (long i = 0; i < n; i++) {
+        if (unique == 0 || numbers[unique - 1] != numbers[i]) numbers[unique++] = numbers[i];
+    }
+    *found = numbers;
+    return unique;
+}
+
+static unsigned int line_hash(const char *s, int length) {
+    unsigned int hash = 2166136261u;  // FNV-1a
+    for (int i = 0; i < length; i++) {
+        hash ^= (unsigned char)s[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+int history_compact(struct History *h, long keep) {
+    if (lock_log(h) == -1) return -1;
+    int result = -1;
+    long *kept = NULL, *table = NULL;
+    if (history_refresh(h) == -1) goto done;
+
+    // walk from the newest entry, keeping the first copy of each command
+    long slots = 1;
+    while (slots < keep * 2 && slots < h->count * 2) slots <<= 1;
+    kept = (long *)malloc(sizeof(long) * (keep + 1));
+    table = (long *)calloc(slots, sizeof(long));
+    if (kept == NULL || table == NULL) goto done;
+    long nkept = 0;
+    for (long n = h->count; n >= 1 && nkept < keep; n--) {
+        int length;
+        const char *line = history_entry(h, n, &length);
+        unsigned int slot = line_hash(line, length) & (slots - 1);
+        int seen = 0;
+        while (table[slot] != 0) {
+            int other_length;
+            const char *other = history_entry(h, table[slot], &other_length);
+            if (other_length == length && memcmp(other, line, length) == 0) {
+                seen = 1;
+                break;
+            }
+            slot = (slot + 1) & (slots - 1);
+        }
+        if (seen) continue;
+        table[slot] = n;
+        kept[nkept++] = n;
+    }
+
+    char *temp = (char *)malloc(strlen(h->path) + 32);
+    if (temp == NULL) goto done;
+    sprintf(temp, "%s.%d.tmp", h->path, (int)getpid());
+    MILE *out = mopen(temp, MODE_WT, 65536);
+    if (out != NULL) {
+        chmod(temp, 0600);
+        for (long i = nkept - 1; i >= 0; i--) {
+            int length;
+            const char *line = history_entry(h, kept[i], &length);
+            mputs(out, line, length);
+            mputc(out, '\n');
+        }
+        if (mclose(out) == 0 && rename(temp, h->path) == 0) result = 0;
+    }
+    if (result == -1) unlink(temp);
+    free(temp);
+
+done:
+    free(kept);
+    free(table);
+    flock(h->fd, LOCK_UN);
+    // the old log is still open and locked by fd; the next refresh moves on
+    if (result == 0) history_refresh(h);
+    return result;
+}
+
+int history_add(struct History *h, const char *line, int length) {
+    struct iovec iov[2] = { { (void *)line, (size_t)length }, { (void *)"\n", 1 } };
+
+    // the lock keeps appends out of a compaction in progress, and the line
+    // goes out in one write so concurrent sessions never interleave within it
+    if (lock_log(h) == -1) return -1;
+    int result = (writev(h->fd, iov, 2) == length + 1) ? 0 : -1;
+    flock(h->fd, LOCK_UN);
+
+    if (result == 0 && ++h->appended >= HISTORY_CHECK) {
+        h->appended = 0;
+        if (history_refresh(h) == 0 && h->count > h->limit + h->limit / 4) history_compact(h, h->limit);
+    }
+    return result;
+}
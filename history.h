@@ -0,0 +1,60 @@
+#ifndef HISTORY_H_
+#define HISTORY_H_
+#include <sys/types.h>
+
+#define HISTORY_FILE ".myshell_history"  // in $HOME unless MYSHELL_HISTORY names a file
+#define HISTORY_LIMIT 100000   // entries kept by compaction, MYSHELL_HISTSIZE overrides
+#define HISTORY_CHECK 1000     // appends between compaction checks
+#define HISTORY_SHOW 20        // entries listed by History
+
+// Command history shared by every session: an append-only log with one
+// command per line, read through mmap. Appends and compaction are serialised
+// with flock; compaction writes a new file and renames it over the log, so
+// readers never see a file shrink under their mapping, and a session notices
+// the new inode on its next refresh.
+//
+// The index is built incrementally from the bytes appended since the last
+// refresh: the start of every entry, and a suffix array of every word start
+// (offsets sorted by the text that follows them, up to the end of the line).
+// A prefix is found by binary search among the suffixes, which answers both
+// "entries starting with" and "entries with a word starting with" queries.
+// Offsets are 32 bit, so the log is limited to 4GB.
+struct History {
+    char *path;
+    int fd;
+    ino_t inode;               // inode the index was built from
+    const char *text;          // mapping of the log, NULL while it is empty
+    size_t mapped;
+    size_t indexed;            // bytes covered by the index, always whole lines
+    unsigned int *entries;     // start offset of each entry, oldest first
+    long count, cap;
+    unsigned int *suffixes;    // word starts in suffix order
+    long nsuffixes, suffix_cap;
+    unsigned int *recent;      // sorted run of the latest word starts, not yet merged
+    long nrecent, recent_cap;
+    long limit;                // entries kept by compaction
+    long appended;             // appends since the last compaction check
+};
+
+int history_open(struct History *h, const char *path);   // NULL for the default file
+void history_close(struct History *h);
+
+// Append a command line; every HISTORY_CHECK appends the log is compacted
+// once it holds more than a quarter over the limit
+int history_add(struct History *h, const char *line, int length);
+
+// Bring the index up to date with the log, including other sessions' appends
+int history_refresh(struct History *h);
+
+// Entry n (1 = oldest) and its length, or NULL
+const char *history_entry(struct History *h, long n, int *length);
+
+// Numbers of the entries starting with pattern, or with any word starting
+// with it when 'anywhere' is set, oldest first. Returns the count and a
+// malloc'd array in *found, or -1.
+long history_search(struct History *h, const char *pattern, int anywhere, long **found);
+
+// Rewrite the log with its newest 'keep' distinct commands
+int history_compact(struct History *h, long keep);
+
+#endif
@@ -0,0 +1,218 @@
+#define _GNU_SOURCE  // pipe2, cpu_set_t
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include "mio.h"
+#include "launch.h"
+
+extern char **environ;
+
+struct PathEntry {
+    unsigned int hash;
+    char *name;
+    char *path;
+    struct PathEntry *next;
+};
+
+static struct PathEntry *path_cache[LAUNCH_BUCKETS];
+static char *cached_path_env;  // PATH the cache was filled under
+
+static unsigned int name_hash(const char *s) {
+    unsigned int h = 2166136261u;  // FNV-1a
+    while (*s != '\0') {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+void launch_flush(void) {
+    for (int i = 0; i < LAUNCH_BUCKETS; i++) {
+        struct PathEntry *e = path_cache[i];
+        while (e != NULL) {
+            struct PathEntry *next = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+            e = next;
+        }
+        path_cache[i] = NULL;
+    }
+    free(cached_path_env);
+    cached_path_env = NULL;
+}
+
+void launch_forget(const char *name) {
+    unsigned int h = name_hash(name);
+    struct PathEntry **link = &path_cache[h % LAUNCH_BUCKETS];
+    while (*link != NULL) {
+        struct PathEntry *e = *link;
+        if (e->hash == h && strcmp(e->name, name) == 0) {
+            *link = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+            return;
+        }
+        link = &e->next;
+    }
+}
+
+// Walk $PATH the way execvp does, returns a malloc'd path or NULL
+static char *search_path(const char *name, const char *path_env) {
+    int name_len = (int)strlen(name);
+    const char *dir = path_env;
+    while (1) {
+        const char *end = strchr(dir, ':');
+        int dir_len = (end != NULL) ? (int)(end - dir) : (int)strlen(dir);
+
+        char *candidate = (char *)malloc(dir_len + name_len + 3);
+        if (candidate == NULL) return NULL;
+        if (dir_len == 0) {
+            // an empty entry means the current directory
+            candidate[0] = '.';
+            dir_len = 1;
+        } else {
+            memcpy(candidate, dir, dir_len);
+        }
+        candidate[dir_len] = '/';
+        memcpy(candidate + dir_len + 1, name, name_len + 1);
+
+        struct stat st;
+        if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0) return candidate;
+        free(candidate);
+
+        if (end == NULL) return NULL;
+        dir = end + 1;
+    }
+}
+
+const char *launch_resolve(const char *name) {
+    if (strchr(name, '/') != NULL) return name;
+
+    const char *path_env = getenv("PATH");
+    if (path_env == NULL) path_env = "/bin:/usr/bin";
+    if (cached_path_env == NULL || strcmp(cached_path_env, path_env) != 0) {
+        launch_flush();
+        cached_path_env = strdup(path_env);
+    }
+
+    unsigned int h = name_hash(name);
+    for (struct PathEntry *e = path_cache[h % LAUNCH_BUCKETS]; e != NULL; e = e->next) {
+        if (e->hash == h && strcmp(e->name, name) == 0) return e->path;
+    }
+
+    char *path = search_path(name, path_env);
+    if (path == NULL) {
+        errno = ENOENT;
+        return NULL;
+    }
+    struct PathEntry *e = (struct PathEntry *)malloc(sizeof(struct PathEntry));
+    if (e == NULL) {
+        free(path);
+        return NULL;
+    }
+    e->hash = h;
+    e->name = strdup(name);
+    e->path = path;
+    e->next = path_cache[h % LAUNCH_BUCKETS];
+    path_cache[h % LAUNCH_BUCKETS] = e;
+    return path;
+}
+
+static pid_t spawn_resolved(const char *path, char *const argv[], int in_fd, int out_fd) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawnattr_init(&attr);
+
+    // dup2 clears close-on-exec on the new standard in/out
+    if (in_fd != -1 && in_fd != STDIN_FILENO) posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    if (out_fd != -1 && out_fd != STDOUT_FILENO) posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+
+    // the program starts with no blocked signals, whatever the shell blocks
+    sigset_t mask;
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+    pid_t pid;
+    int error = posix_spawn(&pid, path, &actions, &attr, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
+    return pid;
+}
+
+pid_t launch_program(const char *program, char *const argv[], int in_fd, int out_fd) {
+    const char *path = launch_resolve(program);
+    if (path == NULL) return -1;
+
+    pid_t pid = spawn_resolved(path, argv, in_fd, out_fd);
+    if (pid == -1 && errno == ENOENT && path != program) {
+        // the cached binary is gone, look it up again once
+        launch_forget(program);
+        path = launch_resolve(program);
+        if (path == NULL) return -1;
+        pid = spawn_resolved(path, argv, in_fd, out_fd);
+    }
+    return pid;
+}
+
+// fork + exec, since posix_spawn can not set affinity, priority or memory
+// policy for the child alone. An exec failure is sent back over a
+// close-on-exec pipe, so it is reported like a failed posix_spawn.
+static pid_t fork_resolved(const char *path, char *const argv[], int in_fd, int out_fd, const struct Placement *place) {
+    int report[2];
+    if (pipe2(report, O_CLOEXEC) == -1) return -1;
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(report[0]);
+        place_apply(place);
+        if (in_fd != -1 && in_fd != STDIN_FILENO) dup2(in_fd, STDIN_FILENO);
+        if (out_fd != -1 && out_fd != STDOUT_FILENO) dup2(out_fd, STDOUT_FILENO);
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+        execv(path, argv);
+        int error = errno;
+        if (write(report[1], &error, sizeof(error)) < 0) _exit(127);
+        _exit(127);
+    }
+    close(report[1]);
+    if (pid == -1) {
+        close(report[0]);
+        return -1;
+    }
+
+    int error;
+    ssize_t n;
+    do {
+        n = read(report[0], &error, sizeof(error));
+    } while (n == -1 && errno == EINTR);
+    close(report[0]);
+    if (n == sizeof(error)) {
+        waitpid(pid, NULL, 0);
+        errno = error;
+        return -1;
+    }
+    return pid;
+}
+
+pid_t launch_placed(const char *program, char *const argv[], int in_fd, int out_fd, const struct Placement *place) {
+    const char *path = launch_resolve(program);
+    if (path == NULL) return -1;
+
+    pid_t pid = fork_resolved(path, argv, in_fd, out_fd, place);
+    if (pid == -1 && errno == ENOENT && path != program) {
+        launch_forget(program);
+        path = launch_resolve(program);
+        if (path == NULL) return -1;
+        pid = fork_resolved(path, argv, in_fd, out_fd, place);
+    }
+    return pid;
+}
@@ -0,0 +1,25 @@
+#ifndef LAUNCH_H_
+#define LAUNCH_H_
+#include <sys/types.h>
+#include "place.h"
+
+#define LAUNCH_BUCKETS 64      // buckets of the command name -> path cache
+
+// Resolve a command name through $PATH, remembering the result. The cache is
+// dropped when PATH changes; names containing a '/' are used as they are.
+// Returns NULL (errno ENOENT) when no executable is found.
+const char *launch_resolve(const char *name);
+void launch_forget(const char *name);
+void launch_flush(void);
+
+// Start a program with posix_spawn, which glibc runs as clone(CLONE_VFORK), so
+// the cost does not grow with the shell's memory. in_fd/out_fd become the
+// child's standard in/out, -1 keeps the shell's. Returns the pid, or -1 with
+// errno set if the program could not be started.
+pid_t launch_program(const char *program, char *const argv[], int in_fd, int out_fd);
+
+// Like launch_program, for a stage with Pin, Nice or Node: the child is
+// forked so the placement can be applied to it before exec
+pid_t launch_placed(const char *program, char *const argv[], int in_fd, int out_fd, const struct Placement *place);
+
+#endif
@@ -0,0 +1,87 @@
+#define _GNU_SOURCE  // memfd_create
+#include <stdio.h>
+#include <sys/mman.h>
+#include "membuf.h"
+
+static struct MemBuffer *find_buffer(struct MemBuffers *m, const char *name) {
+    for (int i = 0; i < m->count; i++) {
+        if (strcmp(m->buffers[i].name, name) == 0) return &m->buffers[i];
+    }
+    return NULL;
+}
+
+// A new open file description of the buffer, with its own offset
+static int reopen_buffer(struct MemBuffer *b, int flags) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", b->fd);
+    return open(path, flags | O_CLOEXEC);
+}
+
+int membuf_writer(struct MemBuffers *m, const char *name) {
+    struct MemBuffer *b = find_buffer(m, name);
+    if (b == NULL) {
+        if (m->count == m->cap) {
+            int cap = (m->cap > 0) ? m->cap * 2 : 8;
+            struct MemBuffer *p = (struct MemBuffer *)realloc(m->buffers, sizeof(struct MemBuffer) * cap);
+            if (p == NULL) return -1;
+            m->buffers = p;
+            m->cap = cap;
+        }
+        char label[64];
+        snprintf(label, sizeof(label), "myshell-mem:%s", name);
+        int fd = memfd_create(label, MFD_CLOEXEC);
+        if (fd < 0) return -1;
+        b = &m->buffers[m->count++];
+        b->name = strdup(name);
+        b->fd = fd;
+    } else if (ftruncate(b->fd, 0) == -1) {
+        return -1;
+    }
+    return reopen_buffer(b, O_WRONLY);
+}
+
+int membuf_reader(struct MemBuffers *m, const char *name) {
+    struct MemBuffer *b = find_buffer(m, name);
+    return (b != NULL) ? reopen_buffer(b, O_RDONLY) : -1;
+}
+
+static long buffer_size(const struct MemBuffer *b) {
+    struct stat st;
+    return (fstat(b->fd, &st) == 0) ? (long)st.st_size : 0;
+}
+
+long membuf_size(struct MemBuffers *m, const char *name) {
+    struct MemBuffer *b = find_buffer(m, name);
+    return (b != NULL) ? buffer_size(b) : -1;
+}
+
+long membuf_total(struct MemBuffers *m, const char *except) {
+    long total = 0;
+    for (int i = 0; i < m->count; i++) {
+        if (except == NULL || strcmp(m->buffers[i].name, except) != 0) total += buffer_size(&m->buffers[i]);
+    }
+    return total;
+}
+
+void membuf_list(struct MemBuffers *m, MILE *out) {
+    char line[160];
+    for (int i = 0; i < m->count; i++) {
+        int length = snprintf(line, sizeof(line), "/MEM/%-20s %12ld bytes\n", m->buffers[i].name, buffer_size(&m->buffers[i]));
+        mputs(out, line, length);
+    }
+    int length = snprintf(line, sizeof(line), "%d buffers, %ld of %ld bytes used\n", m->count, membuf_total(m, NULL), m->limit);
+    mputs(out, line, length);
+}
+
+int membuf_drop(struct MemBuffers *m, const char *name) {
+    int dropped = 0;
+    for (int i = m->count - 1; i >= 0; i--) {
+        struct MemBuffer *b = &m->buffers[i];
+        if (name != NULL && strcmp(b->name, name) != 0) continue;
+        close(b->fd);
+        free(b->name);
+        *b = m->buffers[--m->count];
+        dropped++;
+    }
+    return (name != NULL && dropped == 0) ? -1 : 0;
+}
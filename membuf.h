@@ -0,0 +1,38 @@
+#ifndef MEMBUF_H_
+#define MEMBUF_H_
+#include "mio.h"
+
+#define MEMBUF_LIMIT (1L << 30)  // default cap on the bytes held by all buffers
+
+// Named in-memory files for /MEM/<name> redirections. Each buffer is a memfd
+// held by the shell; stages get their own open file description of it
+// (through /proc/self/fd), so every reader starts at offset 0 and nothing
+// touches the disk.
+struct MemBuffer {
+    char *name;
+    int fd;
+};
+
+struct MemBuffers {
+    struct MemBuffer *buffers;
+    int count, cap;
+    long limit;                // bytes, enforced on writers with RLIMIT_FSIZE
+};
+
+// Close-on-exec descriptor writing buffer 'name' from the start; the buffer is
+// created, or emptied if it exists. Returns -1 on error.
+int membuf_writer(struct MemBuffers *m, const char *name);
+
+// Close-on-exec descriptor reading buffer 'name' from the start, -1 if it does not exist
+int membuf_reader(struct MemBuffers *m, const char *name);
+
+// Size of buffer 'name', -1 if it does not exist
+long membuf_size(struct MemBuffers *m, const char *name);
+
+// Bytes held by all buffers other than 'except' (NULL counts them all)
+long membuf_total(struct MemBuffers *m, const char *except);
+
+void membuf_list(struct MemBuffers *m, MILE *out);
+int membuf_drop(struct MemBuffers *m, const char *name);  // NULL drops all, -1 if there is no such buffer
+
+#endif
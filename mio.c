@@ -49,11 +49,15 @@ MILE *mopen(const char *name, const int mode, const int bsize) {
     file->fd = myfd;
     file->rw = mode;
 
+    file->bsize = bsize;
+
     if (bsize > 0) { // Buffered operation
-        file->rb = (char *)malloc(sizeof(char) * MBSIZE);
-        file->wb = (char *)malloc(sizeof(char) * MBSIZE);
+        file->rb = (char *)malloc(sizeof(char) * bsize);
+        file->wb = (char *)malloc(sizeof(char) * bsize);
 
         if (file->rb == NULL || file->wb == NULL) {
+            free(file->rb);
+            free(file->wb);
             free(file);
             return NULL; // Memory allocation error for buffers
         }
@@ -361,6 +365,25 @@ int mputi(MILE *m, const int val) {
     return result;
 }
 
+// Function to write a long integer to a file, for counters that can pass INT_MAX
+int mputl(MILE *m, const long val) {
+    char digits[24];
+    int pos = sizeof(digits);
+    unsigned long temp = (val < 0) ? -(unsigned long)val : (unsigned long)val;
+
+    // Convert from the last digit backwards into the local buffer
+    do {
+        digits[--pos] = '0' + (temp % 10);
+        temp = temp / 10;
+    } while (temp != 0);
+
+    if (val < 0) {
+        digits[--pos] = '-';
+    }
+
+    return mwrite(m, &digits[pos], (int)sizeof(digits) - pos);
+}
+
 // Function to read a line from a file
 char *mgetline(MILE *m, int *length) {
     char *result_line = NULL;
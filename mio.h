@@ -69,5 +69,6 @@ int mputs(MILE *m, const char *str, const int len);
 
 int mgeti(MILE *m, int *val);
 int mputi(MILE *m, const int val);
+int mputl(MILE *m, const long val);
 
 #endif
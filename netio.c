@@ -0,0 +1,199 @@
+#define _GNU_SOURCE  // splice, POLLRDHUP
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include "mio.h"
+#include "netio.h"
+
+#define NET_SPLICE 1048576     // bytes moved per splice call
+
+static void net_error(const char *message) {
+    mputs(mtderr, message, strlen(message));
+}
+
+// Non-blocking connect to one address, returns the socket or -1
+static int connect_address(const struct addrinfo *ai, int timeout_ms) {
+    int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC | SOCK_NONBLOCK, ai->ai_protocol);
+    if (fd < 0) return -1;
+
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+        if (errno != EINPROGRESS) {
+            close(fd);
+            return -1;
+        }
+        struct pollfd pfd = { fd, POLLOUT, 0 };
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if (poll(&pfd, 1, timeout_ms) != 1 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0) {
+            close(fd);
+            return -1;
+        }
+    }
+
+    // the stages get an ordinary blocking socket
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    return fd;
+}
+
+int net_connect(const char *host, const char *port, int timeout_ms) {
+    struct addrinfo hints, *res0;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int error = getaddrinfo(host, port, &hints, &res0);
+    if (error) {
+        const char *errMsg = gai_strerror(error);
+        mputs(mtderr, errMsg, strlen(errMsg));
+        mputs(mtderr, "\n", 1);
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo *ai = res0; ai != NULL && fd < 0; ai = ai->ai_next) fd = connect_address(ai, timeout_ms);
+    freeaddrinfo(res0);
+
+    if (fd < 0) net_error("cannot connect\n");
+    return fd;
+}
+
+int net_listen(const char *port, int backlog) {
+    struct addrinfo hints, *res0;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    int error = getaddrinfo(NULL, port, &hints, &res0);
+    if (error) {
+        const char *errMsg = gai_strerror(error);
+        mputs(mtderr, errMsg, strlen(errMsg));
+        mputs(mtderr, "\n", 1);
+        return -1;
+    }
+
+    // an IPv6 wildcard socket that also takes IPv4 is preferred, then any that binds
+    int fd = -1;
+    for (int pass = 0; pass < 2 && fd < 0; pass++) {
+        for (struct addrinfo *ai = res0; ai != NULL && fd < 0; ai = ai->ai_next) {
+            if (pass == 0 && ai->ai_family != AF_INET6) continue;
+            fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC | SOCK_NONBLOCK, ai->ai_protocol);
+            if (fd < 0) continue;
+            int on = 1, off = 0;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            if (ai->ai_family == AF_INET6) setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+            if (bind(fd, ai->ai_addr, ai->ai_addrlen) < 0 || listen(fd, backlog) < 0) {
+                close(fd);
+                fd = -1;
+            }
+        }
+    }
+    freeaddrinfo(res0);
+
+    if (fd < 0) net_error("cannot listen\n");
+    return fd;
+}
+
+// A pooled connection is reusable unless the peer has closed or reset it
+static int conn_alive(int fd) {
+    struct pollfd pfd = { fd, POLLIN | POLLRDHUP, 0 };
+    if (poll(&pfd, 1, 0) < 0) return 0;
+    return (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR | POLLNVAL)) == 0;
+}
+
+static void pool_remove(struct NetPool *pool, int i) {
+    free(pool->conns[i].host);
+    free(pool->conns[i].port);
+    pool->conns[i] = pool->conns[--pool->count];
+}
+
+int net_pool_get(struct NetPool *pool, const char *host, const char *port, int keep) {
+    for (int i = 0; i < pool->count; i++) {
+        struct NetConn *c = &pool->conns[i];
+        if (strcmp(c->host, host) != 0 || strcmp(c->port, port) != 0) continue;
+
+        if (!conn_alive(c->fd)) {
+            close(c->fd);
+            pool_remove(pool, i);
+            break;
+        }
+        c->uses++;
+        if (keep) return fcntl(c->fd, F_DUPFD_CLOEXEC, 0);
+
+        int fd = c->fd;
+        pool_remove(pool, i);
+        return fd;
+    }
+
+    int fd = net_connect(host, port, NET_CONNECT_TIMEOUT);
+    if (fd < 0 || !keep) return fd;
+
+    if (pool->count == pool->cap) {
+        int cap = (pool->cap > 0) ? pool->cap * 2 : 4;
+        struct NetConn *p = (struct NetConn *)realloc(pool->conns, sizeof(struct NetConn) * cap);
+        if (p == NULL) return fd; // not pooled, the caller still gets its connection
+        pool->conns = p;
+        pool->cap = cap;
+    }
+    struct NetConn *c = &pool->conns[pool->count++];
+    c->host = strdup(host);
+    c->port = strdup(port);
+    c->fd = fd;
+    c->uses = 1;
+    return fcntl(fd, F_DUPFD_CLOEXEC, 0);
+}
+
+void net_pool_list(struct NetPool *pool) {
+    for (int i = 0; i < pool->count; i++) {
+        struct NetConn *c = &pool->conns[i];
+        mputs(mtdout, c->host, strlen(c->host));
+        mputc(mtdout, ':');
+        mputs(mtdout, c->port, strlen(c->port));
+        const char *state = conn_alive(c->fd) ? "  open  uses " : "  closed by peer  uses ";
+        mputs(mtdout, state, strlen(state));
+        mputi(mtdout, c->uses);
+        mputc(mtdout, '\n');
+    }
+}
+
+void net_pool_close(struct NetPool *pool, const char *host, const char *port) {
+    for (int i = pool->count - 1; i >= 0; i--) {
+        struct NetConn *c = &pool->conns[i];
+        if (host != NULL && (strcmp(c->host, host) != 0 || strcmp(c->port, port) != 0)) continue;
+        close(c->fd);
+        pool_remove(pool, i);
+    }
+}
+
+long net_send_file(int sock, int file_fd) {
+    int pipe_fd[2];
+    if (pipe2(pipe_fd, O_CLOEXEC) < 0) return -1;
+    fcntl(pipe_fd[1], F_SETPIPE_SZ, NET_SPLICE); // best effort
+
+    long total = 0;
+    while (1) {
+        ssize_t in = splice(file_fd, NULL, pipe_fd[1], NULL, NET_SPLICE, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in < 0 && errno == EINTR) continue;
+        if (in <= 0) {
+            if (in < 0) total = -1;
+            break;
+        }
+        while (in > 0) {
+            ssize_t out = splice(pipe_fd[0], NULL, sock, NULL, in, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (out < 0 && errno == EINTR) continue;
+            if (out <= 0) {
+                total = -1;
+                break;
+            }
+            in -= out;
+            total += out;
+        }
+        if (total < 0) break;
+    }
+
+    close(pipe_fd[0]);
+    close(pipe_fd[1]);
+    return total;
+}
@@ -0,0 +1,38 @@
+#ifndef NETIO_H_
+#define NETIO_H_
+
+#define NET_CONNECT_TIMEOUT 5000   // ms allowed for each resolved address
+
+// Connect to host:port trying every address getaddrinfo returns, each with a
+// non-blocking connect bounded by timeout_ms. Returns a blocking,
+// close-on-exec socket or -1 after reporting the error on mtderr.
+int net_connect(const char *host, const char *port, int timeout_ms);
+
+// Listen on port on every local address (IPv4 and IPv6 where available).
+// Returns a non-blocking, close-on-exec socket or -1 after reporting the error.
+int net_listen(const char *port, int backlog);
+
+// Per-session pool of open connections, keyed on host and port
+struct NetConn {
+    char *host;
+    char *port;
+    int fd;
+    int uses;
+};
+
+struct NetPool {
+    struct NetConn *conns;
+    int count, cap;
+};
+
+// Get a connection to host:port. With 'keep' the pool keeps it and the caller
+// gets a duplicate to close when done; otherwise a pooled connection is taken
+// out of the pool (or a new one made) and the caller owns it.
+int net_pool_get(struct NetPool *pool, const char *host, const char *port, int keep);
+void net_pool_list(struct NetPool *pool);
+void net_pool_close(struct NetPool *pool, const char *host, const char *port);  // NULL host closes all
+
+// Copy a file to a socket with splice through a pipe, returns bytes sent or -1
+long net_send_file(int sock, int file_fd);
+
+#endif
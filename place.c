@@ -0,0 +1,187 @@
+#define _GNU_SOURCE  // cpu_set_t, sched_getcpu
+#include <stdio.h>
+#include <errno.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include "mio.h"
+#include "place.h"
+
+#define PLACE_NODES 1024       // bits of the node mask given to set_mempolicy
+
+// Caches and node of one CPU, as sysfs describes them
+struct CpuTopology {
+    int cpu;
+    cpu_set_t core;            // SMT siblings, including the CPU itself
+    cpu_set_t l2, l3;          // CPUs sharing each cache level
+    int node;
+};
+
+// Parse a kernel style CPU list into set; an empty list gives an empty set
+static int parse_list(const char *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+    const char *p = list;
+    while (*p != '\0' && *p != '\n') {
+        char *end;
+        long first = strtol(p, &end, 10), last = first;
+        if (end == p || first < 0) return -1;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first) return -1;
+        }
+        if (last >= CPU_SETSIZE) return -1;
+        for (long c = first; c <= last; c++) CPU_SET(c, set);
+        p = end;
+        if (*p == ',') p++;
+        else if (*p != '\0' && *p != '\n') return -1;
+    }
+    return 0;
+}
+
+static int read_text(const char *path, char *buf, int size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    int n = read(fd, buf, size - 1);
+    close(fd);
+    if (n < 0) return -1;
+    buf[n] = '\0';
+    return n;
+}
+
+static int read_list(const char *path, cpu_set_t *set) {
+    char buf[4096];
+    if (read_text(path, buf, sizeof(buf)) < 0) return -1;
+    return parse_list(buf, set);
+}
+
+int place_parse_cpus(const char *list, cpu_set_t *set) {
+    cpu_set_t allowed, both;
+    if (parse_list(list, set) == -1 || CPU_COUNT(set) == 0) return -1;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) return -1;
+    CPU_AND(&both, set, &allowed);
+    return CPU_EQUAL(&both, set) ? 0 : -1;
+}
+
+int place_node_cpus(int node, cpu_set_t *set) {
+    char path[96];
+    if (node < 0 || node >= PLACE_NODES - 1) return -1;
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    return read_list(path, set);
+}
+
+static void read_topology(struct CpuTopology *t, int cpu) {
+    char path[128], text[32];
+    t->cpu = cpu;
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+    if (read_list(path, &t->core) == -1) {
+        CPU_ZERO(&t->core);
+        CPU_SET(cpu, &t->core);
+    }
+    CPU_ZERO(&t->l2);
+    CPU_ZERO(&t->l3);
+    for (int i = 0; i < PLACE_CACHES; i++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/level", cpu, i);
+        if (read_text(path, text, sizeof(text)) < 0) break;
+        int level = atoi(text);
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/type", cpu, i);
+        if (read_text(path, text, sizeof(text)) < 0 || strncmp(text, "Instruction", 11) == 0) continue;
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list", cpu, i);
+        if (level == 2) read_list(path, &t->l2);
+        else if (level == 3) read_list(path, &t->l3);
+    }
+    t->node = 0;
+    for (int node = 0; node < PLACE_NODES - 1; node++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", node);
+        if (access(path, F_OK) == -1) break;
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/node%d", cpu, node);
+        if (access(path, F_OK) == 0) {
+            t->node = node;
+            break;
+        }
+    }
+}
+
+// How far apart two CPUs are for a pipe between them, lower is closer. A
+// separate core sharing a cache beats an SMT sibling, which competes for
+// the same execution units.
+static int distance(const struct CpuTopology *a, const struct CpuTopology *b) {
+    int sibling = CPU_ISSET(b->cpu, &a->core);
+    if (!sibling && CPU_ISSET(b->cpu, &a->l2)) return 0;
+    if (!sibling && CPU_ISSET(b->cpu, &a->l3)) return 1;
+    if (sibling) return 2;
+    return (a->node == b->node) ? 3 : 4;
+}
+
+int place_auto(int count, int *cpus) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) return -1;
+    int n = CPU_COUNT(&allowed);
+    struct CpuTopology *topology = (struct CpuTopology *)malloc(sizeof(struct CpuTopology) * n);
+    char *used = (char *)calloc(n, 1);
+    if (topology == NULL || used == NULL) {
+        free(topology);
+        free(used);
+        return -1;
+    }
+
+    int k = 0, previous = 0, here = sched_getcpu();
+    for (int cpu = 0; cpu < CPU_SETSIZE && k < n; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed)) continue;
+        if (cpu == here) previous = k;
+        read_topology(&topology[k++], cpu);
+    }
+
+    int free_cpus = n;
+    for (int i = 0; i < count; i++) {
+        if (free_cpus == 0) {
+            memset(used, 0, n);
+            free_cpus = n;
+        }
+        int best = -1;
+        if (i == 0) {
+            best = previous;
+        } else {
+            for (int j = 0; j < n; j++) {
+                if (used[j]) continue;
+                if (best == -1 || distance(&topology[previous], &topology[j]) < distance(&topology[previous], &topology[best])) best = j;
+            }
+        }
+        used[best] = 1;
+        free_cpus--;
+        cpus[i] = topology[best].cpu;
+        previous = best;
+    }
+    free(topology);
+    free(used);
+    return 0;
+}
+
+// Runs between fork and exec, so no mio: its buffers belong to the shell
+static void warn(const char *what) {
+    char line[160];
+    int length = snprintf(line, sizeof(line), "Warning: unable to %s: %s\n", what, strerror(errno));
+    if (write(STDERR_FILENO, line, length) < 0) return;
+}
+
+int place_apply(const struct Placement *p) {
+    int failed = 0;
+    if (p->node >= 0) {
+        unsigned long mask[PLACE_NODES / (8 * sizeof(unsigned long))];
+        memset(mask, 0, sizeof(mask));
+        mask[p->node / (8 * sizeof(unsigned long))] |= 1UL << (p->node % (8 * sizeof(unsigned long)));
+        if (syscall(SYS_set_mempolicy, MPOL_BIND, mask, PLACE_NODES) == -1) {
+            warn("bind memory to the node");
+            failed = 1;
+        }
+    }
+    if (p->pinned && sched_setaffinity(0, sizeof(p->cpus), &p->cpus) == -1) {
+        warn("set the CPU affinity");
+        failed = 1;
+    }
+    if (p->niced && setpriority(PRIO_PROCESS, 0, p->nice) == -1) {
+        warn("set the priority");
+        failed = 1;
+    }
+    return failed ? -1 : 0;
+}
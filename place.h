@@ -0,0 +1,34 @@
+#ifndef PLACE_H_
+#define PLACE_H_
+#include <sched.h>  // cpu_set_t needs _GNU_SOURCE
+
+#define PLACE_CACHES 10        // cache index directories looked at per CPU
+
+// Scheduling of one stage, set in the child between fork and exec
+struct Placement {
+    cpu_set_t cpus;
+    int pinned;                // cpus holds the affinity
+    int nice;
+    int niced;                 // nice holds the priority to set
+    int node;                  // memory node to bind to, -1 for none
+};
+
+// Parse a CPU list such as "0-3,8,10-11"; -1 if it is malformed or names a
+// CPU the shell may not run on
+int place_parse_cpus(const char *list, cpu_set_t *set);
+
+// CPUs of a NUMA node, -1 if there is no such node
+int place_node_cpus(int node, cpu_set_t *set);
+
+// Pick a CPU for each of 'count' pipeline stages, starting from the CPU the
+// shell runs on. Each next stage goes to the free CPU sharing the closest
+// cache with the previous one: another core sharing L2, then L3, then an SMT
+// sibling, then the same node. Stages wrap around when there are more stages
+// than CPUs. Returns -1 if the topology can not be read.
+int place_auto(int count, int *cpus);
+
+// Apply a placement to the calling process. Failures are reported on stderr
+// and the rest is still applied, as nice(1) does; returns -1 if any failed.
+int place_apply(const struct Placement *p);
+
+#endif
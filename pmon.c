@@ -0,0 +1,330 @@
+#include <stdio.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include "pmon.h"
+
+#define PMON_TICK_MS 50        // reaping granularity, samples are taken every interval_ms
+
+static double pmon_now(const struct Pmon *m) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9 - m->t0;
+}
+
+static void pmon_print(MILE *out, const char *text) {
+    if (out != NULL) mputs(out, text, (int)strlen(text));
+}
+
+static void trace_event(struct Pmon *m, const char *event) {
+    if (m->trace == NULL) return;
+    pmon_print(m->trace, (m->trace_events++ == 0) ? "[\n" : ",\n");
+    pmon_print(m->trace, event);
+}
+
+// Read state and utime + stime; the command name may contain spaces or
+// parentheses, so the fields are taken after the last ')'
+static int read_stat(pid_t pid, char *state, long *ticks) {
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return -1;
+    int n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) return -1;
+    buf[n] = '\0';
+
+    char *p = strrchr(buf, ')');
+    unsigned long utime, stime;
+    if (p == NULL || sscanf(p + 1, " %c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                            state, &utime, &stime) != 3) {
+        return -1;
+    }
+    *ticks = (long)(utime + stime);
+    return 0;
+}
+
+static void read_io(pid_t pid, long *rchar, long *wchar) {
+    char path[64], buf[512];
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return;
+    int n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) return;
+    buf[n] = '\0';
+
+    char *p = strstr(buf, "rchar:");
+    if (p != NULL) *rchar = atol(p + 6);
+    p = strstr(buf, "wchar:");
+    if (p != NULL) *wchar = atol(p + 6);
+}
+
+static void format_bytes(char *out, int size, long bytes) {
+    if (bytes >= (1L << 20)) snprintf(out, size, "%.1fMB", bytes / 1048576.0);
+    else if (bytes >= 1024) snprintf(out, size, "%.1fKB", bytes / 1024.0);
+    else snprintf(out, size, "%ldB", bytes);
+}
+
+// Take one sample of a stage; 'dt' is the time since the previous one.
+// Returns the share of that time spent on CPU.
+static double sample_stage(struct Pmon *m, struct PmonStage *s, double dt) {
+    static long hz = 0;
+    if (hz == 0) hz = sysconf(_SC_CLK_TCK);
+
+    char state;
+    long ticks;
+    double cpu = 0;
+    if (read_stat(s->pid, &state, &ticks) == 0) {
+        if (dt > 0) cpu = (double)(ticks - s->ticks) / hz / dt;
+        s->ticks = ticks;
+        if (state == 'S' || state == 'D') s->blocked_ms += (long)(dt * 1000);
+    }
+    read_io(s->pid, &s->rchar, &s->wchar);
+
+    int queued = 0;
+    if (s->in_fd != -1 && ioctl(s->in_fd, FIONREAD, &queued) == 0) {
+        s->queued = queued;
+        if (queued > s->queued_max) s->queued_max = queued;
+        s->queued_sum += queued;
+    }
+    s->samples++;
+
+    if (m->trace != NULL) {
+        char event[256];
+        long ts = (long)(pmon_now(m) * 1e6);
+        snprintf(event, sizeof(event),
+                 "{\"name\":\"%s\",\"ph\":\"C\",\"ts\":%ld,\"pid\":1,\"args\":{\"cpu %%\":%.0f,\"queued\":%ld}}",
+                 s->name, ts, cpu * 100, s->queued);
+        trace_event(m, event);
+    }
+    return cpu;
+}
+
+// Drop the monitor's read end once the stage is gone: while it is held, the
+// writer upstream of a reader that exited early never gets SIGPIPE
+static void release_input(struct PmonStage *s) {
+    if (s->in_fd != -1) {
+        close(s->in_fd);
+        s->in_fd = -1;
+    }
+}
+
+// Reap a finished child; its last /proc values are read while it is still a zombie
+static void reap_stage(struct Pmon *m, struct PmonStage *s, double dt) {
+    siginfo_t info;
+    memset(&info, 0, sizeof(info));
+    if (waitid(P_PID, s->pid, &info, WEXITED | WNOHANG | WNOWAIT) == -1 || info.si_pid != s->pid) return;
+
+    sample_stage(m, s, dt);
+    wait4(s->pid, &s->status, 0, &s->usage);
+    s->end = pmon_now(m);
+    s->done = 1;
+    release_input(s);
+
+    if (m->trace != NULL) {
+        char event[320];
+        snprintf(event, sizeof(event),
+                 "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%ld,\"dur\":%ld,\"pid\":1,\"tid\":%d,"
+                 "\"args\":{\"pid\":%d,\"read\":%ld,\"written\":%ld}}",
+                 s->name, (long)(s->start * 1e6), (long)((s->end - s->start) * 1e6),
+                 (int)(s - m->stages) + 1, (int)s->pid, s->rchar, s->wchar);
+        trace_event(m, event);
+    }
+}
+
+// cpu[] and blocked[] are the shares of the last interval
+static void periodic_report(struct Pmon *m, const double *cpu, const double *blocked) {
+    char line[256], in[24], out[24], queued[24];
+    snprintf(line, sizeof(line), "pmon %.1fs\n", pmon_now(m));
+    pmon_print(m->report, line);
+
+    for (int i = 0; i < m->count; i++) {
+        struct PmonStage *s = &m->stages[i];
+        if (s->done) continue;
+        format_bytes(in, sizeof(in), s->rchar);
+        format_bytes(out, sizeof(out), s->wchar);
+        format_bytes(queued, sizeof(queued), s->queued);
+        snprintf(line, sizeof(line), "  %-16s cpu %3.0f%%  blocked %3.0f%%  in %9s  out %9s  queued %9s\n",
+                 s->name, cpu[i] * 100, blocked[i] * 100, in, out,
+                 s->piped ? queued : "-");
+        pmon_print(m->report, line);
+    }
+    mflush(m->report);
+}
+
+// Sampling thread: reaps finished children every tick and samples all
+// stages every interval until the last child is gone
+static void *pmon_thread(void *arg) {
+    struct Pmon *m = (struct Pmon *)arg;
+    double *cpu = (double *)calloc(m->count, sizeof(double));
+    double *blocked = (double *)calloc(m->count, sizeof(double));
+    double last = pmon_now(m);
+    struct timespec tick = { 0, PMON_TICK_MS * 1000000L };
+
+    while (1) {
+        nanosleep(&tick, NULL);
+        double now = pmon_now(m);
+
+        int alive = 0;
+        for (int i = 0; i < m->count; i++) {
+            struct PmonStage *s = &m->stages[i];
+            if (s->child && !s->done) reap_stage(m, s, now - last);
+            if (s->child && !s->done) alive++;
+        }
+        if (alive == 0) break;
+
+        if ((now - last) * 1000 >= m->interval_ms) {
+            for (int i = 0; i < m->count; i++) {
+                struct PmonStage *s = &m->stages[i];
+                if (s->done) continue;
+                long before = s->blocked_ms;
+                cpu[i] = sample_stage(m, s, now - last);
+                blocked[i] = (s->blocked_ms - before) / 1000.0 / (now - last);
+            }
+            periodic_report(m, cpu, blocked);
+            last = now;
+        }
+    }
+    free(cpu);
+    free(blocked);
+    return NULL;
+}
+
+int pmon_init(struct Pmon *m, int interval_ms, const char *trace_path, MILE *report) {
+    memset(m, 0, sizeof(*m));
+    m->interval_ms = (interval_ms > 0) ? interval_ms : PMON_INTERVAL;
+    m->report = report;
+    m->t0 = 0;
+    m->t0 = pmon_now(m);
+
+    if (trace_path != NULL) {
+        m->trace = mopen(trace_path, MODE_WT, 65536);
+        if (m->trace == NULL) return -1;
+    }
+    return 0;
+}
+
+int pmon_add(struct Pmon *m, const char *name, pid_t pid, int in_fd) {
+    if (m->count == m->cap) {
+        int cap = (m->cap > 0) ? m->cap * 2 : 4;
+        struct PmonStage *p = (struct PmonStage *)realloc(m->stages, sizeof(struct PmonStage) * cap);
+        if (p == NULL) return -1;
+        m->stages = p;
+        m->cap = cap;
+    }
+
+    struct PmonStage *s = &m->stages[m->count++];
+    memset(s, 0, sizeof(*s));
+    // names end up in JSON strings
+    int n = 0;
+    for (; name[n] != '\0' && n < PMON_NAME - 1; n++) {
+        s->name[n] = (name[n] == '"' || name[n] == '\\' || (unsigned char)name[n] < 32) ? '_' : name[n];
+    }
+    s->pid = pid;
+    s->child = (pid != getpid());
+    // a read end is held so the fill level stays readable after the caller
+    // closes its copy; it is released when the stage is reaped
+    s->in_fd = (in_fd != -1) ? fcntl(in_fd, F_DUPFD_CLOEXEC, 0) : -1;
+    s->piped = (s->in_fd != -1);
+    s->start = pmon_now(m);
+
+    char state;
+    read_stat(pid, &state, &s->ticks);
+
+    if (m->trace != NULL) {
+        char event[128];
+        snprintf(event, sizeof(event),
+                 "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                 m->count, s->name);
+        trace_event(m, event);
+    }
+    return 0;
+}
+
+int pmon_start(struct Pmon *m) {
+    if (pthread_create(&m->thread, NULL, pmon_thread, m) != 0) return -1;
+    m->running = 1;
+    return 0;
+}
+
+static void final_report(struct Pmon *m) {
+    char line[256], in[24], out[24], queued[24];
+    snprintf(line, sizeof(line), "pmon summary after %.2fs\n"
+             "  %-16s %7s %8s %8s %8s %9s %9s %9s %9s %9s %5s\n", pmon_now(m),
+             "stage", "pid", "user", "sys", "blocked", "read", "written", "max rss", "queued", "max q", "exit");
+    pmon_print(m->report, line);
+
+    int busiest = -1;
+    double busiest_share = 0;
+    for (int i = 0; i < m->count; i++) {
+        struct PmonStage *s = &m->stages[i];
+        double user = s->usage.ru_utime.tv_sec + s->usage.ru_utime.tv_usec / 1e6;
+        double sys = s->usage.ru_stime.tv_sec + s->usage.ru_stime.tv_usec / 1e6;
+        double life = s->end - s->start;
+        if (life > 0 && (user + sys) / life > busiest_share) {
+            busiest_share = (user + sys) / life;
+            busiest = i;
+        }
+
+        format_bytes(in, sizeof(in), s->rchar);
+        format_bytes(out, sizeof(out), s->wchar);
+        format_bytes(queued, sizeof(queued), (s->samples > 0) ? (long)(s->queued_sum / s->samples) : 0);
+        char max_queued[24], rss[24], status[16];
+        format_bytes(max_queued, sizeof(max_queued), s->queued_max);
+        format_bytes(rss, sizeof(rss), s->usage.ru_maxrss * 1024L);
+        if (!s->child) snprintf(status, sizeof(status), "-");
+        else if (WIFEXITED(s->status)) snprintf(status, sizeof(status), "%d", WEXITSTATUS(s->status));
+        else snprintf(status, sizeof(status), "sig%d", WTERMSIG(s->status));
+
+        snprintf(line, sizeof(line), "  %-16s %7d %7.2fs %7.2fs %7.0f%% %9s %9s %9s %9s %9s %5s\n",
+                 s->name, (int)s->pid, user, sys, (life > 0) ? s->blocked_ms / 10.0 / life : 0, in, out, rss,
+                 s->piped ? queued : "-", s->piped ? max_queued : "-", status);
+        pmon_print(m->report, line);
+    }
+
+    if (busiest != -1) {
+        snprintf(line, sizeof(line), "busiest stage: %s (%.0f%% of its run time on CPU)\n",
+                 m->stages[busiest].name, busiest_share * 100);
+        pmon_print(m->report, line);
+    }
+    mflush(m->report);
+}
+
+void pmon_wait(struct Pmon *m) {
+    if (m->running) {
+        pthread_join(m->thread, NULL);
+        m->running = 0;
+    }
+
+    // the monitoring process itself ends here
+    for (int i = 0; i < m->count; i++) {
+        struct PmonStage *s = &m->stages[i];
+        if (s->child) continue;
+        sample_stage(m, s, 0);
+        getrusage(RUSAGE_SELF, &s->usage);
+        s->end = pmon_now(m);
+        s->done = 1;
+        release_input(s);
+        if (m->trace != NULL) {
+            char event[256];
+            snprintf(event, sizeof(event),
+                     "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%ld,\"dur\":%ld,\"pid\":1,\"tid\":%d}",
+                     s->name, (long)(s->start * 1e6), (long)((s->end - s->start) * 1e6), i + 1);
+            trace_event(m, event);
+        }
+    }
+    final_report(m);
+}
+
+void pmon_free(struct Pmon *m) {
+    for (int i = 0; i < m->count; i++) release_input(&m->stages[i]);
+    if (m->trace != NULL) {
+        pmon_print(m->trace, (m->trace_events > 0) ? "\n]\n" : "[]\n");
+        mclose(m->trace);
+        m->trace = NULL;
+    }
+    free(m->stages);
+    m->stages = NULL;
+    m->count = m->cap = 0;
+}
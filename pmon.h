@@ -0,0 +1,54 @@
+#ifndef PMON_H_
+#define PMON_H_
+#include <pthread.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "mio.h"
+
+#define PMON_INTERVAL 1000     // default sampling interval in ms
+#define PMON_NAME 32
+
+// One monitored pipeline stage. CPU and state come from /proc/<pid>/stat,
+// bytes from the rchar/wchar lines of /proc/<pid>/io, and the fill level of
+// the pipe feeding the stage from FIONREAD on a duplicate of its read end,
+// held until the stage is reaped so an early exit still breaks the pipe.
+struct PmonStage {
+    char name[PMON_NAME];
+    pid_t pid;
+    int child;                 // reaped by the monitor, 0 for the monitoring process itself
+    int in_fd;                 // duplicate of the input pipe, -1 if none or once the stage is done
+    int piped;                 // the stage reads from a pipe
+
+    long ticks;                // utime + stime at the last sample
+    long rchar, wchar;
+    long blocked_ms;           // time sampled in S or D state
+    long queued, queued_max;   // bytes waiting in the input pipe
+    double queued_sum;
+    long samples;
+
+    double start, end;         // seconds since the monitor started
+    int done, status;
+    struct rusage usage;
+};
+
+struct Pmon {
+    struct PmonStage *stages;
+    int count, cap;
+    int interval_ms;
+    double t0;                 // CLOCK_MONOTONIC at pmon_init
+    MILE *report;              // periodic and final report
+    MILE *trace;               // Chrome trace-event JSON, NULL if not requested
+    int trace_events;
+    pthread_t thread;
+    int running;
+};
+
+int pmon_init(struct Pmon *m, int interval_ms, const char *trace_path, MILE *report);
+int pmon_add(struct Pmon *m, const char *name, pid_t pid, int in_fd);
+int pmon_start(struct Pmon *m);
+
+// wait for every child stage (instead of waitpid), then print the final report
+void pmon_wait(struct Pmon *m);
+void pmon_free(struct Pmon *m);
+
+#endif
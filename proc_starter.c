@@ -1,10 +1,132 @@
+#define _GNU_SOURCE  // pipe2, splice, F_SETPIPE_SZ
 #include "mio.h"
+#include "wreplace.h"
+#include "wcount.h"
+#include "ring.h"
+#include "pmon.h"
+#include <stdio.h>
 #include <sys/wait.h>
+#include <signal.h>
+#include <poll.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
-int main(int argc, char *argv[]) {
-    
-    // Initialize custom I/O streams
-    minit();
+#define PS_RULES "rwords.txt"     // replacement rules used by both modes
+#define PS_BLOCK 65536            // bytes per input block in threaded mode
+#define PS_BATCH_BYTES 65536      // token bytes per batch passed to the counter
+#define PS_BATCH_TOKENS 16384     // tokens per batch passed to the counter
+#define PS_RING 8                 // blocks/batches in flight between two stages
+#define PS_FEED 1048576           // bytes moved per splice/write by the process mode feeder
+#define PS_CHUNK 65536            // target chunk size handed to a sharded replacer
+#define PS_WINDOW_PER_WORKER 4    // default chunks in flight per sharded replacer
+
+// Input block passed from the feeder to the replacer thread
+struct InputBlock {
+    char data[PS_BLOCK];
+    int len;
+};
+
+// Replaced words passed from the replacer to the counter thread
+struct TokenBatch {
+    char bytes[PS_BATCH_BYTES];
+    int off[PS_BATCH_TOKENS];
+    int len[PS_BATCH_TOKENS];
+    int used, count;
+    char *big;                    // malloc'd word longer than bytes, then the batch's only token
+};
+
+// Ring pairs linking the threaded stages, full items go forward and
+// drained ones come back on the free ring to be reused
+struct ThreadPipeline {
+    struct Ring blocks_full, blocks_free;
+    struct Ring batches_full, batches_free;
+    const struct RuleSet *rules;
+    struct TokenBatch *batch;     // batch the replacer is filling
+};
+
+// One word_replacer -F worker of the sharded mode and the collector's
+// progress on the frame it is currently sending back
+struct Shard {
+    pid_t pid;
+    int in_fd, out_fd;
+    int outstanding;              // chunks sent and not yet answered
+    struct FrameHeader header;
+    int header_got;
+    char *payload;
+    int payload_got;
+    int eof;
+};
+
+// Sharded mode state shared by the feeder and the collector thread
+struct ShardedPipeline {
+    struct Shard *shards;
+    int nshards;
+    int by_load;                  // pick the least loaded worker instead of round-robin
+    int window;                   // chunks allowed in flight in total
+    int in_flight;
+    pthread_mutex_t lock;
+    pthread_cond_t room;
+    char **ready;                 // answered chunks waiting for their turn, by seq % window
+    int *ready_len;
+    uint32_t next_seq;            // next chunk to hand to the counter
+    int counter_fd;
+    int aborted;                  // a worker ended with chunks unanswered, the output can not be completed
+};
+
+// Stage monitor of the process modes, NULL unless -m or -T is given
+static struct Pmon *monitor;
+
+void write_error(const char *message) {
+    mwrite(mtderr, message, (int)strlen(message));
+}
+
+int write_full(int fd, const char *buf, int size) {
+    int total = 0;
+    while (total < size) {
+        int n = write(fd, buf + total, size - total);
+        if (n <= 0) return -1;
+        total += n;
+    }
+    return total;
+}
+
+// Copy standard in to the replacer's pipe in large blocks. word_replacer does
+// its own tokenizing, so the input is passed on unchanged: spliced straight
+// from a file or pipe, otherwise read and written a block at a time.
+int feed_input(int out_fd) {
+    fcntl(out_fd, F_SETPIPE_SZ, PS_FEED); // best effort, fewer wakeups per MB
+
+    struct stat st;
+    if (fstat(STDIN_FILENO, &st) == 0 && (S_ISREG(st.st_mode) || S_ISFIFO(st.st_mode))) {
+        while (1) {
+            ssize_t n = splice(STDIN_FILENO, NULL, out_fd, NULL, PS_FEED, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (n == 0) return 0;
+            if (n > 0) continue;
+            if (errno == EINTR) continue;
+            if (errno == EINVAL) break; // not spliceable here, copy instead
+            return -1;
+        }
+    }
+
+    char *buffer = (char *)malloc(PS_FEED);
+    if (buffer == NULL) return -1;
+    int result = 0;
+    while (1) {
+        int n = read(STDIN_FILENO, buffer, PS_FEED);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        if (write_full(out_fd, buffer, n) == -1) {
+            result = -1;
+            break;
+        }
+    }
+    free(buffer);
+    return result;
+}
+
+// Multi-process mode: word_replacer and word_counter connected by pipes
+int run_processes() {
 
     // Create Pipe 1 and Pipe 2
     int pipe1[2], pipe2[2];
@@ -34,7 +156,7 @@ int main(int argc, char *argv[]) {
         dup2(pipe2[1], STDOUT_FILENO);
 
         // Execute WordReplacer with the provided filename as an argument
-        execlp("word_replacer", "child_1","rwords.txt", (char *)NULL);
+        execlp("word_replacer", "child_1", PS_RULES, (char *)NULL);
 
         // If execlp fails, report an error
         const char *errMessage = "Error executing WordReplacer.\n";
@@ -42,7 +164,7 @@ int main(int argc, char *argv[]) {
         return -1;
     } else {
         pid_t child2 = fork();
-        
+
         if (child2 == -1) {
             const char *errMessage = "Error creating Child 2 (Oper2).\n";
             mwrite(mtderr, errMessage, (int)strlen(errMessage));
@@ -67,49 +189,511 @@ int main(int argc, char *argv[]) {
             return -1;
         } else {
             // Parent process
+            if (monitor != NULL) {
+                pmon_add(monitor, "feeder", getpid(), -1);
+                pmon_add(monitor, "word_replacer", child1, pipe1[0]);
+                pmon_add(monitor, "word_counter", child2, pipe2[0]);
+                pmon_start(monitor);
+            }
             close(pipe2[0]);  // Close read end of Pipe 2
             close(pipe2[1]);
             close(pipe1[0]);
-            // Create MILE objects for pipe1
-            MILE *pipe1_stream = mdopen(pipe1[1], O_WRONLY, 0); // Pass buffer size
 
-            if (pipe1_stream == NULL) {
-                const char *errMessage = "Error creating MILE for Pipe 1.\n";
+            // Pass standard in to Pipe 1 in large blocks
+            if (feed_input(pipe1[1]) == -1) {
+                const char *errMessage = "Error writing to Pipe 1.\n";
                 mwrite(mtderr, errMessage, (int)strlen(errMessage));
-                return -1;
             }
+            // Close write end of Pipe 1 (Child 1 will detect EOF)
+            close(pipe1[1]);
 
-            char buffer[0];
-            int bytesRead;
+            // Wait for Child 1 (Oper1) and Child 2 (Oper2) to complete
+            if (monitor != NULL) {
+                pmon_wait(monitor);
+            } else {
+                waitpid(child1, NULL, 0);
+                waitpid(child2, NULL, 0);
+            }
+        }
+    }
 
-             // Loop to get user input
-            while (1) {
-                int length;
-                char* string;
-                string = mgets(mtdin, &length);
+    return 0;
+}
 
-                if (string == NULL) {
-                    break; // Exit the loop on EOF or error
-                }
+// Replacer token sink: append the word to the current batch. A replacement
+// may hold several words, which are split here like word_counter would.
+void batch_emit(void *arg, const char *word, int len) {
+    struct ThreadPipeline *p = (struct ThreadPipeline *)arg;
 
-                // Write the acquired string to Pipe 1 using MILE
-                if (mputs(pipe1_stream, string, length) == -1) {
-                    const char *errMessage = "Error writing to Pipe 1.\n";
-                    mputs(mtderr, errMessage, (int)strlen(errMessage));
-                    mputc(mtdout, ' ');
-                    return -1;
-                }
-                mputc(pipe1_stream, ' ');
+    for (int i = 0; i < len;) {
+        while (i < len && M_ISWS(word[i])) i++;
+        int start = i;
+        while (i < len && !M_ISWS(word[i])) i++;
+        int n = i - start;
+        if (n == 0) break;
+
+        struct TokenBatch *b = p->batch;
+        if (b == NULL || b->count == PS_BATCH_TOKENS || (b->count > 0 && b->used + n > PS_BATCH_BYTES)) {
+            if (b != NULL) ring_push(&p->batches_full, b);
+            b = p->batch = (struct TokenBatch *)ring_pop(&p->batches_free);
+            b->used = 0;
+            b->count = 0;
+        }
+        if (n > PS_BATCH_BYTES) {
+            // a word longer than a batch goes alone, in its own allocation
+            b->big = (char *)malloc(n);
+            if (b->big == NULL) {
+                write_error("Error allocating a word.\n");
+                exit(-1);
             }
-            // Close MILE and write end of Pipe 1 (Child 1 will detect EOF)
-            mclose(pipe1_stream);
-            //close(pipe1[1]);
+            memcpy(b->big, word + start, n);
+            b->off[0] = 0;
+            b->len[0] = n;
+            b->count = 1;
+            ring_push(&p->batches_full, b);
+            p->batch = NULL;
+            continue;
+        }
+        memcpy(b->bytes + b->used, word + start, n);
+        b->off[b->count] = b->used;
+        b->len[b->count] = n;
+        b->used += n;
+        b->count++;
+    }
+}
 
-            // Wait for Child 1 (Oper1) and Child 2 (Oper2) to complete
-            waitpid(child1, NULL, 0);
-            waitpid(child2, NULL, 0);
+// Replacer stage: input blocks in, token batches out
+void *replacer_thread(void *arg) {
+    struct ThreadPipeline *p = (struct ThreadPipeline *)arg;
+    struct Replacer replacer;
+
+    if (replacer_init(&replacer, p->rules, NULL) == -1) {
+        write_error("Error allocating the replacement buffers.\n");
+        exit(-1);
+    }
+    replacer.emit = batch_emit;
+    replacer.emit_arg = p;
+
+    struct InputBlock *block;
+    while ((block = (struct InputBlock *)ring_pop(&p->blocks_full)) != NULL) {
+        replacer_feed(&replacer, block->data, block->len);
+        ring_push(&p->blocks_free, block);
+    }
+    replacer_finish(&replacer);
+
+    if (p->batch != NULL && p->batch->count > 0) ring_push(&p->batches_full, p->batch);
+    ring_close(&p->batches_full);
+    replacer_free(&replacer);
+    return NULL;
+}
+
+// Counter stage: token batches in, the word_counter report out
+void *counter_thread(void *arg) {
+    struct ThreadPipeline *p = (struct ThreadPipeline *)arg;
+    MILE *out = mdopen(STDOUT_FILENO, MODE_WA, PS_BLOCK);
+    struct WordCounter counter;
+
+    if (out == NULL || wc_init(&counter, WC_LEGACY, WC_BUCKETS, WC_BUCKETS, out) == -1) {
+        write_error("Error allocating the word tables.\n");
+        exit(-1);
+    }
+
+    struct TokenBatch *batch;
+    while ((batch = (struct TokenBatch *)ring_pop(&p->batches_full)) != NULL) {
+        const char *bytes = (batch->big != NULL) ? batch->big : batch->bytes;
+        for (int i = 0; i < batch->count; i++) wc_word(&counter, bytes + batch->off[i], batch->len[i]);
+        free(batch->big);
+        batch->big = NULL;
+        ring_push(&p->batches_free, batch);
+        mflush(out);
+    }
+
+    wc_report(&counter, out);
+    mflush(out);
+    wc_free(&counter);
+    mclose(out);
+    return NULL;
+}
+
+// Threaded mode: the replacer and counter engines run as threads of this
+// process and pass data through in-memory rings instead of kernel pipes
+int run_threads() {
+    struct RuleSet rules;
+    if (rules_load(&rules, PS_RULES) == -1) {
+        write_error("Error opening " PS_RULES ".\n");
+        return -1;
+    }
+
+    struct ThreadPipeline p;
+    memset(&p, 0, sizeof(p));
+    p.rules = &rules;
+    if (ring_init(&p.blocks_full, PS_RING) == -1 || ring_init(&p.blocks_free, PS_RING) == -1 ||
+        ring_init(&p.batches_full, PS_RING) == -1 || ring_init(&p.batches_free, PS_RING) == -1) {
+        write_error("Error creating the stage rings.\n");
+        return -1;
+    }
+
+    struct InputBlock *blocks = (struct InputBlock *)malloc(sizeof(struct InputBlock) * PS_RING);
+    struct TokenBatch *batches = (struct TokenBatch *)malloc(sizeof(struct TokenBatch) * PS_RING);
+    if (blocks == NULL || batches == NULL) {
+        write_error("Error allocating the stage buffers.\n");
+        return -1;
+    }
+    for (int i = 0; i < PS_RING; i++) {
+        ring_push(&p.blocks_free, &blocks[i]);
+        batches[i].big = NULL;
+        ring_push(&p.batches_free, &batches[i]);
+    }
+
+    pthread_t replacer, counter;
+    if (pthread_create(&replacer, NULL, replacer_thread, &p) != 0 ||
+        pthread_create(&counter, NULL, counter_thread, &p) != 0) {
+        write_error("Error starting the stage threads.\n");
+        return -1;
+    }
+
+    // Feeder: this thread reads standard in into free blocks
+    while (1) {
+        struct InputBlock *block = (struct InputBlock *)ring_pop(&p.blocks_free);
+        block->len = mread(mtdin, block->data, PS_BLOCK);
+        if (block->len <= 0) break;
+        ring_push(&p.blocks_full, block);
+    }
+    ring_close(&p.blocks_full);
+
+    pthread_join(replacer, NULL);
+    pthread_join(counter, NULL);
+
+    ring_free(&p.blocks_full);
+    ring_free(&p.blocks_free);
+    ring_free(&p.batches_full);
+    ring_free(&p.batches_free);
+    free(blocks);
+    free(batches);
+    rules_free(&rules);
+    return 0;
+}
+
+// Start a child with the given standard in/out. All other pipe ends are
+// close-on-exec, so the child only keeps what it is handed here.
+pid_t spawn_stage(const char *program, char *const argv[], int in_fd, int out_fd) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (in_fd != STDIN_FILENO) dup2(in_fd, STDIN_FILENO);
+        if (out_fd != STDOUT_FILENO) dup2(out_fd, STDOUT_FILENO);
+        execvp(program, argv);
+
+        const char *errMessage = "Error executing stage.\n";
+        mwrite(mtderr, errMessage, (int)strlen(errMessage));
+        _exit(1);
+    }
+    return pid;
+}
+
+// Hand one chunk to a worker, blocking while the window is full; -1 once
+// the pipeline has been aborted
+int send_chunk(struct ShardedPipeline *sp, uint32_t seq, const char *data, int len) {
+    pthread_mutex_lock(&sp->lock);
+    while (sp->in_flight >= sp->window && !sp->aborted) pthread_cond_wait(&sp->room, &sp->lock);
+    if (sp->aborted) {
+        pthread_mutex_unlock(&sp->lock);
+        return -1;
+    }
+    sp->in_flight++;
+
+    int w = seq % sp->nshards;
+    if (sp->by_load) {
+        for (int i = 0; i < sp->nshards; i++) {
+            if (sp->shards[i].outstanding < sp->shards[w].outstanding) w = i;
         }
     }
+    sp->shards[w].outstanding++;
+    pthread_mutex_unlock(&sp->lock);
 
+    // a worker that died gives EPIPE here, SIGPIPE is ignored; the collector
+    // sees its end and aborts the pipeline
+    struct FrameHeader header = { seq, (uint32_t)len };
+    if (write_full(sp->shards[w].in_fd, (const char *)&header, sizeof(header)) == -1 ||
+        write_full(sp->shards[w].in_fd, data, len) == -1) {
+        return -1;
+    }
     return 0;
 }
+
+// Read what a worker has sent; returns 1 when a whole frame has arrived
+int read_frame(struct Shard *sh) {
+    if (sh->header_got < (int)sizeof(sh->header)) {
+        int n = read(sh->out_fd, (char *)&sh->header + sh->header_got, sizeof(sh->header) - sh->header_got);
+        if (n <= 0) {
+            sh->eof = 1;
+            return 0;
+        }
+        sh->header_got += n;
+        if (sh->header_got < (int)sizeof(sh->header)) return 0;
+
+        sh->payload = (char *)malloc(sh->header.len > 0 ? sh->header.len : 1);
+        sh->payload_got = 0;
+        if (sh->header.len == 0) return 1;
+        return 0;
+    }
+
+    int n = read(sh->out_fd, sh->payload + sh->payload_got, sh->header.len - sh->payload_got);
+    if (n <= 0) {
+        sh->eof = 1;
+        return 0;
+    }
+    sh->payload_got += n;
+    return sh->payload_got == (int)sh->header.len;
+}
+
+// Collector: gathers frames from every worker and writes them to the
+// counter in sequence order
+void *collector_thread(void *arg) {
+    struct ShardedPipeline *sp = (struct ShardedPipeline *)arg;
+    struct pollfd *fds = (struct pollfd *)malloc(sizeof(struct pollfd) * sp->nshards);
+    int open_shards = sp->nshards;
+
+    while (open_shards > 0 && !sp->aborted) {
+        for (int i = 0; i < sp->nshards; i++) {
+            fds[i].fd = sp->shards[i].eof ? -1 : sp->shards[i].out_fd;
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+        if (poll(fds, sp->nshards, -1) == -1) continue;
+
+        for (int i = 0; i < sp->nshards; i++) {
+            struct Shard *sh = &sp->shards[i];
+            if (fds[i].revents == 0) continue;
+
+            if (read_frame(sh)) {
+                pthread_mutex_lock(&sp->lock);
+                sp->ready[sh->header.seq % sp->window] = sh->payload;
+                sp->ready_len[sh->header.seq % sp->window] = sh->header.len;
+                sh->outstanding--;
+                pthread_mutex_unlock(&sp->lock);
+                sh->payload = NULL;
+                sh->header_got = 0;
+            }
+            if (sh->eof) {
+                open_shards--;
+                if (sh->outstanding > 0 || sh->header_got > 0) {
+                    // its chunks will never come back: wake the feeder and stop.
+                    // The other workers are stopped too, as nothing reads their
+                    // output now and the feeder may be blocked writing to one.
+                    pthread_mutex_lock(&sp->lock);
+                    sp->aborted = 1;
+                    pthread_cond_broadcast(&sp->room);
+                    pthread_mutex_unlock(&sp->lock);
+                    for (int j = 0; j < sp->nshards; j++) kill(sp->shards[j].pid, SIGTERM);
+                    break;
+                }
+            }
+        }
+        if (sp->aborted) break;
+
+        // forward every chunk whose predecessors have all been written
+        while (1) {
+            int slot = sp->next_seq % sp->window;
+            pthread_mutex_lock(&sp->lock);
+            char *data = sp->ready[slot];
+            pthread_mutex_unlock(&sp->lock);
+            if (data == NULL) break;
+
+            write_full(sp->counter_fd, data, sp->ready_len[slot]);
+            free(data);
+
+            pthread_mutex_lock(&sp->lock);
+            sp->ready[slot] = NULL;
+            sp->next_seq++;
+            sp->in_flight--;
+            pthread_cond_signal(&sp->room);
+            pthread_mutex_unlock(&sp->lock);
+        }
+    }
+
+    if (!sp->aborted) close(sp->counter_fd); // word_counter sees EOF
+    free(fds);
+    return NULL;
+}
+
+// Sharded mode: the input is cut into chunks on whitespace, replaced by
+// several word_replacer workers and put back in order for word_counter
+int run_sharded(int nshards, int window, int by_load) {
+    struct ShardedPipeline sp;
+    memset(&sp, 0, sizeof(sp));
+    sp.nshards = nshards;
+    sp.by_load = by_load;
+    sp.window = (window > 0) ? window : nshards * PS_WINDOW_PER_WORKER;
+    sp.shards = (struct Shard *)calloc(nshards, sizeof(struct Shard));
+    sp.ready = (char **)calloc(sp.window, sizeof(char *));
+    sp.ready_len = (int *)calloc(sp.window, sizeof(int));
+    if (sp.shards == NULL || sp.ready == NULL || sp.ready_len == NULL) {
+        write_error("Error allocating the shard tables.\n");
+        return -1;
+    }
+    pthread_mutex_init(&sp.lock, NULL);
+    pthread_cond_init(&sp.room, NULL);
+
+    // Counter first, it reads the reassembled stream
+    int counter_pipe[2];
+    if (pipe2(counter_pipe, O_CLOEXEC) == -1) {
+        write_error("Error creating pipes.\n");
+        return -1;
+    }
+    char *counter_argv[] = { "child_2", NULL };
+    pid_t counter = spawn_stage("word_counter", counter_argv, counter_pipe[0], STDOUT_FILENO);
+    if (monitor != NULL) {
+        pmon_add(monitor, "feeder", getpid(), -1);
+        pmon_add(monitor, "word_counter", counter, counter_pipe[0]);
+    }
+    close(counter_pipe[0]);
+    sp.counter_fd = counter_pipe[1];
+
+    char *worker_argv[] = { "child_1", "-F", PS_RULES, NULL };
+    for (int i = 0; i < nshards; i++) {
+        int to_worker[2], from_worker[2];
+        if (pipe2(to_worker, O_CLOEXEC) == -1 || pipe2(from_worker, O_CLOEXEC) == -1) {
+            write_error("Error creating pipes.\n");
+            return -1;
+        }
+        sp.shards[i].pid = spawn_stage("word_replacer", worker_argv, to_worker[0], from_worker[1]);
+        if (monitor != NULL) {
+            char name[PMON_NAME];
+            snprintf(name, sizeof(name), "word_replacer.%d", i);
+            pmon_add(monitor, name, sp.shards[i].pid, to_worker[0]);
+        }
+        close(to_worker[0]);
+        close(from_worker[1]);
+        sp.shards[i].in_fd = to_worker[1];
+        sp.shards[i].out_fd = from_worker[0];
+        if (sp.shards[i].pid == -1) {
+            write_error("Error creating a replacer worker.\n");
+            return -1;
+        }
+    }
+
+    if (monitor != NULL) pmon_start(monitor);
+    // a worker that dies must not kill the feeder with SIGPIPE; the children
+    // are started, so they keep the default
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_t collector;
+    if (pthread_create(&collector, NULL, collector_thread, &sp) != 0) {
+        write_error("Error starting the collector thread.\n");
+        return -1;
+    }
+
+    // Feeder: cut chunks after the last whitespace so no word is split
+    int cap = PS_CHUNK * 2;
+    int len = 0;
+    char *buf = (char *)malloc(cap);
+    uint32_t seq = 0;
+    int error = 0;
+    while (buf != NULL && error == 0) {
+        int bytes_read = mread(mtdin, buf + len, cap - len);
+        if (bytes_read <= 0) {
+            if (len > 0) error = send_chunk(&sp, seq++, buf, len);
+            break;
+        }
+        len += bytes_read;
+        if (len < PS_CHUNK) continue;
+
+        int cut = len;
+        while (cut > 0 && !M_ISWS(buf[cut - 1])) cut--;
+        if (cut == 0) {
+            // one word fills the buffer, let it grow
+            if (len == cap) {
+                char *p = (char *)realloc(buf, cap * 2);
+                if (p == NULL) break;
+                buf = p;
+                cap *= 2;
+            }
+            continue;
+        }
+        error = send_chunk(&sp, seq++, buf, cut);
+        memmove(buf, buf + cut, len - cut);
+        len -= cut;
+    }
+    free(buf);
+
+    for (int i = 0; i < nshards; i++) close(sp.shards[i].in_fd);
+    pthread_join(collector, NULL);
+    if (sp.aborted) {
+        // the counter would only report on part of the input
+        write_error("Error: a replacer worker ended before answering all its chunks.\n");
+        kill(counter, SIGTERM);
+        close(sp.counter_fd);
+        error = -1;
+    } else if (error == -1) {
+        write_error("Error writing to a replacer worker.\n");
+    }
+
+    if (monitor != NULL) pmon_wait(monitor);
+    for (int i = 0; i < nshards; i++) {
+        if (monitor == NULL) waitpid(sp.shards[i].pid, NULL, 0);
+        close(sp.shards[i].out_fd);
+    }
+    if (monitor == NULL) waitpid(counter, NULL, 0);
+
+    pthread_mutex_destroy(&sp.lock);
+    pthread_cond_destroy(&sp.room);
+    for (int i = 0; i < sp.window; i++) free(sp.ready[i]);
+    for (int i = 0; i < nshards; i++) free(sp.shards[i].payload);
+    free(sp.shards);
+    free(sp.ready);
+    free(sp.ready_len);
+    return error;
+}
+
+int main(int argc, char *argv[]) {
+
+    // Initialize custom I/O streams
+    minit();
+
+    // -t runs the stages as threads of this process instead of child processes,
+    // -n N shards the replacer over N workers (-l: least loaded, -w: chunks in flight),
+    // -m [ms] reports per-stage telemetry on stderr, -T file also writes a Chrome trace
+    int threads = 0;
+    int nshards = 0;
+    int window = 0;
+    int by_load = 0;
+    int monitor_ms = -1;
+    const char *trace_path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0) {
+            threads = 1;
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            nshards = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            window = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-l") == 0) {
+            by_load = 1;
+        } else if (strcmp(argv[i], "-m") == 0) {
+            monitor_ms = (i + 1 < argc && isdigit((unsigned char)argv[i + 1][0])) ? atoi(argv[++i]) : PMON_INTERVAL;
+        } else if (strcmp(argv[i], "-T") == 0 && i + 1 < argc) {
+            trace_path = argv[++i];
+            if (monitor_ms == -1) monitor_ms = PMON_INTERVAL;
+        } else {
+            write_error("Usage: proc_starter [-t | -n workers [-l] [-w window]] [-m [ms]] [-T trace.json]\n");
+            return 1;
+        }
+    }
+
+    struct Pmon pmon;
+    if (monitor_ms != -1) {
+        if (threads) {
+            write_error("-m and -T monitor child processes and can not be used with -t.\n");
+            return 1;
+        }
+        if (pmon_init(&pmon, monitor_ms, trace_path, mtderr) == -1) {
+            write_error("Error opening the trace file.\n");
+            return 1;
+        }
+        monitor = &pmon;
+    }
+
+    if (threads) return run_threads();
+    int result = (nshards > 0) ? run_sharded(nshards, window, by_load) : run_processes();
+    if (monitor != NULL) pmon_free(monitor);
+    return result;
+}
@@ -0,0 +1,54 @@
+#include <stdlib.h>
+#include "ring.h"
+
+int ring_init(struct Ring *r, int cap) {
+    r->slots = (void **)malloc(sizeof(void *) * cap);
+    if (r->slots == NULL) return -1;
+    r->cap = cap;
+    r->head = 0;
+    r->count = 0;
+    r->closed = 0;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->not_empty, NULL);
+    pthread_cond_init(&r->not_full, NULL);
+    return 0;
+}
+
+void ring_free(struct Ring *r) {
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->not_empty);
+    pthread_cond_destroy(&r->not_full);
+    free(r->slots);
+    r->slots = NULL;
+}
+
+void ring_push(struct Ring *r, void *item) {
+    pthread_mutex_lock(&r->lock);
+    while (r->count == r->cap) pthread_cond_wait(&r->not_full, &r->lock);
+    r->slots[(r->head + r->count) % r->cap] = item;
+    r->count++;
+    pthread_cond_signal(&r->not_empty);
+    pthread_mutex_unlock(&r->lock);
+}
+
+void *ring_pop(struct Ring *r) {
+    pthread_mutex_lock(&r->lock);
+    while (r->count == 0 && !r->closed) pthread_cond_wait(&r->not_empty, &r->lock);
+
+    void *item = NULL;
+    if (r->count > 0) {
+        item = r->slots[r->head];
+        r->head = (r->head + 1) % r->cap;
+        r->count--;
+        pthread_cond_signal(&r->not_full);
+    }
+    pthread_mutex_unlock(&r->lock);
+    return item;
+}
+
+void ring_close(struct Ring *r) {
+    pthread_mutex_lock(&r->lock);
+    r->closed = 1;
+    pthread_cond_broadcast(&r->not_empty);
+    pthread_mutex_unlock(&r->lock);
+}
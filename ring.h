@@ -0,0 +1,23 @@
+#ifndef RING_H_
+#define RING_H_
+#include <pthread.h>
+
+// Bounded queue of pointers between threads. Pushing blocks while the ring is
+// full and popping blocks while it is empty, which gives backpressure between
+// pipeline stages.
+struct Ring {
+    void **slots;
+    int cap, head, count;
+    int closed;                // no more pushes, pops drain what is left
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty, not_full;
+};
+
+int ring_init(struct Ring *r, int cap);
+void ring_free(struct Ring *r);
+
+void ring_push(struct Ring *r, void *item);
+void *ring_pop(struct Ring *r);     // NULL once the ring is closed and empty
+void ring_close(struct Ring *r);
+
+#endif
@@ -1,23 +1,152 @@
+#define _GNU_SOURCE  // pipe2, memfd_create, cpu_set_t
 #include "mio.h"
+#include "pmon.h"
+#include "launch.h"
+#include "wcount.h"
+#include "wreplace.h"
+#include "acmatch.h"
+#include "netio.h"
+#include "stats.h"
+#include "cmdline.h"
+#include "history.h"
+#include "membuf.h"
+#include "cache.h"
+#include "tee_stage.h"
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/signalfd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
+#include <stdio.h>
+#include <time.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 
+// One program of a Run command; the words point into the job's arena
+struct Stage {
+    char *program;
+    char **arguments;          // NULL terminated, arguments[0] is the program
+    int arg_count;
+    pid_t pid;
+    int status;
+    int done;                  // reaped (or never started)
+    double start;              // launch time, for the wall time in usage
+    struct StageUsage usage;
+    struct Placement *place;   // Pin/Nice/Node or Place, NULL to start it as usual
+};
+
+// A Run command: stages connected by Pipe, From feeds the first, To takes the last
+struct Job {
+    struct Stage *stages;
+    int count;
+    char *input_file;
+    char *in_host, *in_port;   // From /TCP/host/port
+    char *in_mem;              // From /MEM/name
+    char *output_file;
+    char *tcp_host, *tcp_port;
+    char *out_mem;             // To /MEM/name
+    int keep;                  // leave the To connection open in the pool
+    int background;            // started with a trailing '&'
+    int timed;                 // print each stage's usage when it ends (Time)
+    char *command;             // command line as typed, copied for the job table
+    struct Arena arena;        // the parsed command, owned by the job once in the background
+};
+
+// A job started with '&', kept in the job table until it has been reported
+struct BackgroundJob {
+    int id;
+    struct Job job;
+    int launched;
+    int remaining;             // stages not reaped yet
+};
+
 void init_shell();
 void print_prompt();
 void print_help();
 void print_exit_message();
 void parse_and_execute_command(char *input_command);
 void handle_run_command(char *input_command);
-void execute_program(char *program, char **arguments);
-void execute_program_with_pipe(char *program1, char **arguments1, char *program2, char **arguments2);
-void execute_program_with_redirection(char *program, char **arguments, char *filename);
-void execute_program_with_input_redirection(char *program, char **arguments, char *filename);
-void execute_program_with_tcp_redirection(char *program, char **arguments, char *hostname, char *port);
-void parse_arguments(char *input_command, char **program, char ***arguments, int *arg_count);
-void free_arguments(char **arguments, int arg_count);
+void free_job(struct Job *job);
+void handle_send_command(char *input_command);
+void handle_serve_command(char *input_command);
+void handle_history_command(char *argument);
+void handle_memcap_command(char *argument);
+void handle_rerun_command(char *argument);
+int serve(const char *port, struct Stage *stage, int max, int prefork, long count);
+void execute_job(struct Job *job);
+void run_cached(struct Job *job, int contents);
+int place_job(struct Job *job, struct CmdLine *cmd, int automatic);
+void report_job(struct Job *job, int launched);
+void account_job(struct Job *job, int launched);
+void add_background_job(struct Job *job, int launched);
+int reap_children();
+void finish_background_job(int index);
+void list_jobs();
+void wait_jobs(char *argument);
+void handle_parallel_command(char *input_command);
+int run_parallel(char **commands, int count, int workers, int ordered);
+int run_batch_file(const char *filename, int workers, int ordered);
+int is_builtin_stage(const char *program);
+int run_builtin_stage(struct Stage *stage, int in_fd, const char *in_file, int out_fd);
+int builtin_tee(char **arguments, int in_fd, const char *in_file, int out_fd);
+
+#define BUILTIN_BLOCK 65536    // read and output buffer size of the builtin stages
+#define SERVE_MAX 64           // default cap on connections served at once
+#define SERVE_BACKLOG 512      // listen backlog of Serve
+
+// Stage monitor of the current command, set by the Monitor prefix
+static struct Pmon *job_monitor = NULL;
+
+// Exit status of the last stage of the last job (128 + signal if it was killed)
+static int last_status = 0;
+
+// Background job table, children are reaped from the event loop on SIGCHLD
+static struct BackgroundJob *background_jobs = NULL;
+static int background_count = 0, background_cap = 0;
+static int next_job_id = 1;
+
+// Connections kept open with Keep, reused by later commands to the same endpoint
+static struct NetPool net_pool;
+
+// Set in the shells running Parallel jobs: no "finished" messages in the captured output
+static int quiet_jobs = 0;
+
+// Arena of the command being parsed, reset after each one
+static struct Arena command_arena;
+
+// In-memory files of /MEM/ redirections
+static struct MemBuffers mem_buffers = { NULL, 0, 0, MEMBUF_LIMIT };
+
+// Command history of interactive sessions
+static struct History history;
+static int history_ready = 0;
+
+// Set while a command prefixed with Time runs
+static int time_jobs = 0;
+
+// Output cache of Cached jobs, opened on first use; cache_jobs is set while a
+// command prefixed with Cached runs (2 with Hash)
+static struct Cache cache;
+static int cache_ready = 0;
+static int cache_jobs = 0;
+
+// Set while a command prefixed with Place runs
+static int place_jobs = 0;
+
+// Set in a forked builtin stage, which may close its own output early
+static int stage_child = 0;
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
 void init_shell() {
     char *welcome_message = "Welcome to MyShellv2 by Jose Cardenas\n";
@@ -33,7 +162,20 @@ void print_prompt() {
 }
 
 void print_help() {
-    char *help_text = "Commands: 'Help', 'Quit', 'Run <program> [<arg1> <arg2> …]' or 'Run <program1> [<arg1.1> <arg1.2> …] Pipe <program2> [<arg2.1> <arg2.2> …]'\n";
+    char *help_text = "Commands: 'Help', 'Quit', 'Run <program> [<arg1> <arg2> …]' or 'Run <program1> [<arg1.1> <arg1.2> …] Pipe <program2> [<arg2.1> <arg2.2> …]'\n"
+                      "Any number of Pipe stages may follow; 'From <file>' feeds the first and 'To <file>' or 'To /TCP/<host>/<port>' takes the last\n"
+                      "'WordCount [-w] [-b] [-c] [-l]', 'WordReplace [-a [-s]] <rules>' and 'Tee <file>|/TCP/<host>/<port> ...' run inside the shell as stages\n"
+                      "End a Run command with '&' to run it in the background; 'Jobs' lists background jobs and 'Wait [<job>]' waits for them\n"
+                      "'Parallel [-j N] [-k] <command> ; <command> ...' runs commands on N workers (-k keeps their output in order)\n"
+                      "'From /TCP/<host>/<port>' reads from a connection; 'To /TCP/<host>/<port> Keep' keeps it open for later commands ('Connections', 'Disconnect')\n"
+                      "'Send <file> To /TCP/<host>/<port> [Keep]' copies a file to a connection without passing it through the shell\n"
+                      "'Serve <port> [Max N] [Prefork N] [Count N] Run <program> [<args>]' runs the program on each connection until Ctrl-C\n"
+                      "'To /MEM/<name>' keeps output in memory for a later 'From /MEM/<name>'; 'Mem' lists buffers, 'Drop [<name>]' frees them, 'MemCap [<size>]' sets their cap\n"
+                      "'History [-s] [<prefix>]' lists past commands (-s matches any word), 'History Compact' trims the log, 'Rerun [<n>|<prefix>]' runs one again\n"
+                      "Prefix a Pipe command with 'Monitor [Trace <file.json>]' for per-stage telemetry\n"
+                      "Prefix a Run command with 'Cached [Hash]' to replay its output from ~/.myshell_cache while the programs and From input are unchanged ('Cache', 'Cache Clear')\n"
+                      "'Pin <cpus>', 'Nice <n>' and 'Node <n>' before a stage's program set its CPUs, priority and memory node; prefix a Run command with 'Place' to put neighbouring stages on CPUs sharing a cache\n"
+                      "Prefix a Run command with 'Time' to print each stage's time, CPU, memory and I/O; 'Stats [<program>]' shows the session totals ('Stats Reset' clears them)\n";
     mputs(mtdout, help_text, strlen(help_text));
 }
 
@@ -50,6 +192,94 @@ void parse_and_execute_command(char *input_command) {
         exit(0);
     } else if (strncmp(input_command, "Run", 3) == 0) {
         handle_run_command(input_command);
+    } else if (strncmp(input_command, "Parallel ", 9) == 0) {
+        handle_parallel_command(input_command);
+    } else if (strncmp(input_command, "Send ", 5) == 0) {
+        handle_send_command(input_command);
+    } else if (strncmp(input_command, "Serve ", 6) == 0) {
+        handle_serve_command(input_command);
+    } else if (strcmp(input_command, "Connections") == 0) {
+        net_pool_list(&net_pool);
+    } else if (strcmp(input_command, "Disconnect") == 0) {
+        net_pool_close(&net_pool, NULL, NULL);
+    } else if (strncmp(input_command, "Disconnect ", 11) == 0) {
+        char *host = strtok(input_command + 11, " ");
+        char *port = strtok(NULL, " ");
+        if (host == NULL || port == NULL) {
+            mputs(mtderr, "Error: use Disconnect [<host> <port>]\n", 38);
+        } else {
+            net_pool_close(&net_pool, host, port);
+        }
+    } else if (strncmp(input_command, "Time ", 5) == 0) {
+        time_jobs = 1;
+        parse_and_execute_command(input_command + 5);
+        time_jobs = 0;
+    } else if (strncmp(input_command, "Cached ", 7) == 0) {
+        char *rest = input_command + 7;
+        cache_jobs = 1;
+        if (strncmp(rest, "Hash ", 5) == 0) {
+            cache_jobs = 2;
+            rest += 5;
+        }
+        parse_and_execute_command(rest);
+        cache_jobs = 0;
+    } else if (strcmp(input_command, "Cache") == 0 || strcmp(input_command, "Cache Clear") == 0) {
+        if (!cache_ready && cache_open(&cache) == 0) cache_ready = 1;
+        if (!cache_ready) {
+            mputs(mtderr, "Error: Unable to open the cache directory\n", 42);
+        } else if (input_command[5] == ' ') {
+            cache_clear(&cache);
+        } else {
+            cache_print(&cache, mtdout);
+        }
+    } else if (strncmp(input_command, "Place ", 6) == 0) {
+        place_jobs = 1;
+        parse_and_execute_command(input_command + 6);
+        place_jobs = 0;
+    } else if (strcmp(input_command, "Stats") == 0) {
+        stats_print(mtdout, NULL);
+    } else if (strcmp(input_command, "Stats Reset") == 0) {
+        stats_reset();
+    } else if (strncmp(input_command, "Stats ", 6) == 0) {
+        stats_print(mtdout, input_command + 6);
+    } else if (strcmp(input_command, "History") == 0 || strncmp(input_command, "History ", 8) == 0) {
+        handle_history_command((input_command[7] == ' ') ? input_command + 8 : NULL);
+    } else if (strcmp(input_command, "Rerun") == 0 || strncmp(input_command, "Rerun ", 6) == 0) {
+        handle_rerun_command((input_command[5] == ' ') ? input_command + 6 : NULL);
+    } else if (strcmp(input_command, "Mem") == 0) {
+        membuf_list(&mem_buffers, mtdout);
+    } else if (strcmp(input_command, "Drop") == 0) {
+        membuf_drop(&mem_buffers, NULL);
+    } else if (strncmp(input_command, "Drop ", 5) == 0) {
+        char *name = input_command + 5;
+        if (strncmp(name, "/MEM/", 5) == 0) name += 5;
+        if (membuf_drop(&mem_buffers, name) == -1) mputs(mtderr, "Error: no such /MEM/ buffer\n", 28);
+    } else if (strcmp(input_command, "MemCap") == 0 || strncmp(input_command, "MemCap ", 7) == 0) {
+        handle_memcap_command((input_command[6] == ' ') ? input_command + 7 : NULL);
+    } else if (strcmp(input_command, "Jobs") == 0) {
+        list_jobs();
+    } else if (strcmp(input_command, "Wait") == 0 || strncmp(input_command, "Wait ", 5) == 0) {
+        wait_jobs((input_command[4] == ' ') ? input_command + 5 : NULL);
+    } else if (strncmp(input_command, "Monitor ", 8) == 0) {
+        // Monitor [Trace <file>] Run ...
+        char *rest = input_command + 8;
+        char *trace_path = NULL;
+        if (strncmp(rest, "Trace ", 6) == 0) {
+            trace_path = rest + 6;
+            rest = strchr(trace_path, ' ');
+            if (rest == NULL) rest = trace_path + strlen(trace_path);
+            else *rest++ = '\0';
+        }
+
+        struct Pmon monitor;
+        if (pmon_init(&monitor, PMON_INTERVAL, trace_path, mtderr) == -1) {
+            mputs(mtderr, "Error opening the trace file\n", 29);
+            return;
+        }
+        job_monitor = &monitor;
+        parse_and_execute_command(rest);
+        job_monitor = NULL;
+        pmon_free(&monitor);
     } else {
         char *unknown = "Unknown Command, Use 'Help' for a list of commands\n";
         mputs(mtdout, unknown, strlen(unknown));
@@ -57,384 +287,1442 @@ void parse_and_execute_command(char *input_command) {
 }
 
 void handle_run_command(char *input_command) {
-    char *token;
-    char *program1 = NULL;
-    char *program2 = NULL;
-    char *filename = NULL;
-    char **arguments1 = NULL;
-    char **arguments2 = NULL;
-    int arg_count1 = 0;
-    int arg_count2 = 0;
-    int is_pipe = 0;
-    int is_redirection = 0;
-    int is_input_redirection = 0;
-    int is_tcp_redirection = 0;
-
-    // Tokenize the command
-    token = strtok(input_command, " "); // Skips "Run"
-
-    // Get the first program name
-    token = strtok(NULL, " ");
-    if (token != NULL) {
-        program1 = strdup(token);
-        arg_count1++;
-        arguments1 = (char **)malloc(sizeof(char *));
-        arguments1[0] = program1;
-    }
-
-    // Parse the rest of the command
-    while ((token = strtok(NULL, " ")) != NULL) {
-        if (strcmp(token, "Pipe") == 0) {
-            // Handle Pipe case
-            is_pipe = 1;
-            token = strtok(NULL, " ");
-            if (token != NULL) {
-                program2 = strdup(token);
-                arg_count2++;
-                arguments2 = (char **)malloc(sizeof(char *));
-                arguments2[0] = program2;
+    struct Job job;
+    memset(&job, 0, sizeof(job));
+    job.command = input_command;
+    job.timed = time_jobs;
+    job.arena = command_arena;
+
+    struct CmdLine cmd;
+    const char *error;
+    if (cmd_parse_run(&job.arena, input_command + 3, &cmd, &error) == -1) { // Skips "Run"
+        mputs(mtderr, error, strlen(error));
+    } else if (cmd.count > 0) {
+        job.stages = (struct Stage *)arena_alloc(&job.arena, sizeof(struct Stage) * cmd.count);
+        if (job.stages != NULL) {
+            memset(job.stages, 0, sizeof(struct Stage) * cmd.count);
+            for (int i = 0; i < cmd.count; i++) {
+                job.stages[i].program = cmd.stages[i].program;
+                job.stages[i].arguments = cmd.stages[i].arguments;
+                job.stages[i].arg_count = cmd.stages[i].arg_count;
             }
-            continue;
-        } else if (strcmp(token, "To") == 0) {
-            token = strtok(NULL, " ");
-            if (token != NULL) {
-                if (strncmp(token, "/TCP/", 5) == 0) {
-                    // Handle TCP Redirection case
-                    is_tcp_redirection = 1;
-
-                    // Ensure arguments array is null-terminated
-                    arguments1 = (char **)realloc(arguments1, sizeof(char *) * (arg_count1 + 1));
-                    arguments1[arg_count1] = NULL;
-
-                    char *tcp_info = strdup(token + 5); // Skip "/TCP/"
-                    char *hostname = strtok(tcp_info, "/");
-                    char *port = strtok(NULL, "/");
-                    execute_program_with_tcp_redirection(program1, arguments1, hostname, port);
-                    free(tcp_info);
-                    break;
-                } else {
-                    // Handle File Redirection case
-                    is_redirection = 1;
-                    filename = strdup(token);
-
-                    // Ensure arguments array is null-terminated
-                    arguments1 = (char **)realloc(arguments1, sizeof(char *) * (arg_count1 + 1));
-                    arguments1[arg_count1] = NULL;
-
-                    break;
-                }
+            job.count = cmd.count;
+            job.input_file = cmd.input_file;
+            job.in_host = cmd.in_host;
+            job.in_port = cmd.in_port;
+            job.in_mem = cmd.in_mem;
+            job.output_file = cmd.output_file;
+            job.tcp_host = cmd.out_host;
+            job.tcp_port = cmd.out_port;
+            job.out_mem = cmd.out_mem;
+            job.keep = cmd.keep;
+            job.background = cmd.background;
+            if (place_job(&job, &cmd, place_jobs) == -1) last_status = 1;
+            else if (cache_jobs) run_cached(&job, cache_jobs == 2);
+            else execute_job(&job);
+        }
+    }
+
+    // a background job has taken the arena along (leaving job empty),
+    // otherwise it is kept for the next command
+    command_arena = job.arena;
+    arena_reset(&command_arena);
+}
+
+// Turn the stages' Pin/Nice/Node modifiers into placements in the job's arena.
+// With 'automatic' (Place) every stage without Pin or Node also gets a CPU
+// from place_auto, so neighbouring stages share a cache.
+int place_job(struct Job *job, struct CmdLine *cmd, int automatic) {
+    int *auto_cpus = NULL;
+    if (automatic) {
+        auto_cpus = (int *)arena_alloc(&job->arena, sizeof(int) * job->count);
+        if (auto_cpus == NULL || place_auto(job->count, auto_cpus) == -1) {
+            mputs(mtderr, "Error: Unable to read the CPU topology\n", 39);
+            return -1;
+        }
+    }
+    for (int i = 0; i < job->count; i++) {
+        struct CmdStage *c = &cmd->stages[i];
+        if (c->pin == NULL && c->nice == NULL && c->node == NULL && !automatic) continue;
+        struct Placement *p = (struct Placement *)arena_alloc(&job->arena, sizeof(struct Placement));
+        if (p == NULL) return -1;
+        memset(p, 0, sizeof(*p));
+        p->node = -1;
+        if (c->pin != NULL) {
+            if (place_parse_cpus(c->pin, &p->cpus) == -1) {
+                mputs(mtderr, "Error: Pin takes a list of usable CPUs such as 0-3,8\n", 53);
+                return -1;
             }
+            p->pinned = 1;
         }
-        else if (strcmp(token, "From") == 0) {
-            // Handle Input Redirection case
-            is_input_redirection = 1;
-            token = strtok(NULL, " ");
-            if (token != NULL) {
-                filename = strdup(token);
+        if (c->nice != NULL) {
+            char *end;
+            p->nice = (int)strtol(c->nice, &end, 10);
+            if (end == c->nice || *end != '\0' || p->nice < -20 || p->nice > 19) {
+                mputs(mtderr, "Error: Nice takes a priority from -20 to 19\n", 44);
+                return -1;
             }
-            break;
+            p->niced = 1;
         }
-        
-        // Add to arguments
-        if (!is_pipe) {
-            arg_count1++;
-            arguments1 = (char **)realloc(arguments1, sizeof(char *) * arg_count1);
-            arguments1[arg_count1 - 1] = strdup(token);
-        } else {
-            arg_count2++;
-            arguments2 = (char **)realloc(arguments2, sizeof(char *) * arg_count2);
-            arguments2[arg_count2 - 1] = strdup(token);
+        if (c->node != NULL) {
+            char *end;
+            cpu_set_t node_cpus;
+            p->node = (int)strtol(c->node, &end, 10);
+            if (end == c->node || *end != '\0' || place_node_cpus(p->node, &node_cpus) == -1) {
+                mputs(mtderr, "Error: no such NUMA node\n", 25);
+                return -1;
+            }
+            // run on the node's CPUs as well, unless Pin chose others
+            if (!p->pinned && CPU_COUNT(&node_cpus) > 0) {
+                p->cpus = node_cpus;
+                p->pinned = 1;
+            }
+        }
+        if (automatic && !p->pinned) {
+            CPU_ZERO(&p->cpus);
+            CPU_SET(auto_cpus[i], &p->cpus);
+            p->pinned = 1;
         }
+        job->stages[i].place = p;
     }
+    return 0;
+}
 
-    // Null-terminate argument arrays
-    if (arg_count1 > 0) {
-        arguments1 = (char **)realloc(arguments1, sizeof(char *) * (arg_count1 + 1));
-        arguments1[arg_count1] = NULL;
-    }
-    if (arg_count2 > 0) {
-        arguments2 = (char **)realloc(arguments2, sizeof(char *) * (arg_count2 + 1));
-        arguments2[arg_count2] = NULL;
+// Release a background job's command; the stages and words all live in its arena
+void free_job(struct Job *job) {
+    arena_free(&job->arena);
+    free(job->command);
+}
+
+// Open the job's To target: a file, a connection or a /MEM/ buffer. *out_fd
+// stays -1 when the job writes to the shell's stdout. Returns -1 after
+// printing the error.
+static int open_job_output(struct Job *job, int *out_fd) {
+    *out_fd = -1;
+    if (job->output_file != NULL) {
+        *out_fd = open(job->output_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (*out_fd < 0) {
+            mputs(mtderr, "Error: Unable to open file for redirection\n", 44);
+            return -1;
+        }
+    } else if (job->tcp_host != NULL) {
+        *out_fd = net_pool_get(&net_pool, job->tcp_host, job->tcp_port, job->keep);
+        if (*out_fd < 0) return -1;
+    } else if (job->out_mem != NULL) {
+        *out_fd = membuf_writer(&mem_buffers, job->out_mem);
+        if (*out_fd < 0) {
+            mputs(mtderr, "Error: Unable to create the /MEM/ buffer\n", 41);
+            return -1;
+        }
     }
+    return 0;
+}
 
-    // Execute based on command type
-    if (is_pipe) {
-        execute_program_with_pipe(program1, arguments1, program2, arguments2);
-    } else if (is_redirection) {
-        execute_program_with_redirection(program1, arguments1, filename);
-    } else if (is_input_redirection){
-        execute_program_with_input_redirection(program1, arguments1, filename);
-    } else {
-        execute_program(program1, arguments1);
+// Launch every stage of the job at once, connected by pipes, then reap them all.
+// Stages are started with posix_spawn and a cached PATH lookup (see launch.c).
+// Every descriptor the shell opens is close-on-exec, so a child keeps only
+// the standard in/out it was given.
+void execute_job(struct Job *job) {
+    int in_fd = -1;
+    int out_fd = -1;
+
+    if (job->background && job_monitor != NULL) {
+        mputs(mtderr, "Error: Monitor jobs can not run in the background\n", 50);
+        return;
     }
 
-    // Free memory
-    for (int i = 0; i < arg_count1; i++) {
-        free(arguments1[i]);
+    if (job->in_mem != NULL && job->out_mem != NULL && strcmp(job->in_mem, job->out_mem) == 0) {
+        mputs(mtderr, "Error: a /MEM/ buffer can not be both input and output\n", 55);
+        return;
     }
-    free(arguments1);
-    if (is_pipe) {
-        for (int i = 0; i < arg_count2; i++) {
-            free(arguments2[i]);
+
+    if (job->in_host != NULL) {
+        in_fd = net_pool_get(&net_pool, job->in_host, job->in_port, 0);
+        if (in_fd < 0) return;
+    } else if (job->in_mem != NULL) {
+        in_fd = membuf_reader(&mem_buffers, job->in_mem);
+        if (in_fd < 0) {
+            mputs(mtderr, "Error: no such /MEM/ buffer\n", 28);
+            return;
         }
-        free(arguments2);
+    } else if (job->input_file != NULL || job->background) {
+        // background jobs must not take the shell's input
+        in_fd = open((job->input_file != NULL) ? job->input_file : "/dev/null", O_RDONLY | O_CLOEXEC);
+        if (in_fd < 0) {
+            mputs(mtderr, "Error: Unable to open file for input redirection\n", 50);
+            return;
+        }
+    }
+    if (open_job_output(job, &out_fd) == -1) {
+        if (in_fd != -1) close(in_fd);
+        return;
     }
-    if (is_redirection) {
-        free(filename);
+
+    // the stage writing a /MEM/ buffer may only fill what the cap leaves;
+    // RLIMIT_FSIZE is inherited by the stage and enforced by the kernel
+    struct rlimit saved_limit, mem_limit;
+    long mem_room = -1;
+    if (job->out_mem != NULL) {
+        mem_room = mem_buffers.limit - membuf_total(&mem_buffers, job->out_mem);
+        if (mem_room < 0) mem_room = 0;
+        getrlimit(RLIMIT_FSIZE, &saved_limit);
+        mem_limit = saved_limit;
+        if (mem_limit.rlim_max == RLIM_INFINITY || (rlim_t)mem_room < mem_limit.rlim_max) mem_limit.rlim_cur = mem_room;
     }
-}
 
+    int prev_read = in_fd; // what the next stage reads, -1 for the shell's stdin
+    int launched = 0;
+    struct Stage *in_shell = NULL; // builtin run by the shell after the others start
+    for (int i = 0; i < job->count; i++) {
+        struct Stage *stage = &job->stages[i];
+        int pipe_fd[2] = { -1, -1 };
+        int stage_out = out_fd;
+
+        if (i == job->count - 1 && is_builtin_stage(stage->program) && !job->background && stage->place == NULL) {
+            in_shell = stage;
+            launched++;
+            if (job_monitor != NULL) pmon_add(job_monitor, stage->program, getpid(), (i > 0) ? prev_read : -1);
+            break;
+        }
+
+        if (i < job->count - 1) {
+            if (pipe2(pipe_fd, O_CLOEXEC) < 0) {
+                mputs(mtderr, "Error creating pipe\n", 20);
+                break;
+            }
+            stage_out = pipe_fd[1];
+        }
 
-void execute_program(char *program, char **arguments) {
-    pid_t pid = fork(); // Create a new process
+        stage->start = now_seconds();
+        if (mem_room >= 0 && i == job->count - 1) setrlimit(RLIMIT_FSIZE, &mem_limit);
+        if (is_builtin_stage(stage->program)) {
+            stage->pid = fork();
+            if (stage->pid == 0) {
+                // nothing is exec'd, so drop the descriptors meant for other stages
+                if (pipe_fd[0] != -1) close(pipe_fd[0]);
+                net_pool_close(&net_pool, NULL, NULL);
+                if (out_fd != -1 && out_fd != stage_out) close(out_fd);
+                if (stage->place != NULL) place_apply(stage->place);
+                stage_child = 1;
+                _exit(run_builtin_stage(stage, prev_read, (i == 0) ? job->input_file : NULL, stage_out));
+            }
+        } else if (stage->place != NULL) {
+            stage->pid = launch_placed(stage->program, stage->arguments, prev_read, stage_out, stage->place);
+        } else {
+            stage->pid = launch_program(stage->program, stage->arguments, prev_read, stage_out);
+        }
+        if (mem_room >= 0 && i == job->count - 1) setrlimit(RLIMIT_FSIZE, &saved_limit);
+        if (stage->pid < 0) {
+            // the rest of the pipeline still runs, as it would after a failed exec
+            mputs(mtderr, "Error: Execution failed\n", 24);
+            stage->status = 127 << 8;
+            stage->done = 1;
+        }
+        launched++;
+
+        // Hand the read end on to the next stage
+        if (job_monitor != NULL && stage->pid > 0) pmon_add(job_monitor, stage->program, stage->pid, (i > 0) ? prev_read : -1);
+        if (prev_read != -1) close(prev_read);
+        if (pipe_fd[1] != -1) close(pipe_fd[1]);
+        prev_read = pipe_fd[0];
+    }
+
+    if (job_monitor != NULL) pmon_start(job_monitor);
+    if (in_shell != NULL) {
+        // a vanished reader must not kill the shell
+        void (*saved)(int) = signal(SIGPIPE, SIG_IGN);
+        // over the /MEM/ cap, writes fail with EFBIG instead of SIGXFSZ killing the shell
+        void (*saved_xfsz)(int) = SIG_DFL;
+        if (mem_room >= 0) {
+            saved_xfsz = signal(SIGXFSZ, SIG_IGN);
+            setrlimit(RLIMIT_FSIZE, &mem_limit);
+        }
+        struct StatsSnapshot before;
+        stats_snapshot(&before);
+        in_shell->start = now_seconds();
+        int code = run_builtin_stage(in_shell, prev_read, (job->count == 1) ? job->input_file : NULL, out_fd);
+        in_shell->usage.wall = now_seconds() - in_shell->start;
+        stats_since(&before, &in_shell->usage);
+        if (mem_room >= 0) {
+            setrlimit(RLIMIT_FSIZE, &saved_limit);
+            signal(SIGXFSZ, saved_xfsz);
+        }
+        signal(SIGPIPE, saved);
+        in_shell->status = code << 8;
+    }
+    if (prev_read != -1) close(prev_read);
+    if (out_fd != -1) close(out_fd);
 
-    if (pid == -1) {
-        // Fork failed
-        mputs(mtdout, "Error: Unable to fork process\n", 30);
-    } else if (pid == 0) {
-        // Child process
-        execvp(program, arguments); // Replace the child process with the new program
+    if (job->background) {
+        add_background_job(job, launched);
+        return;
+    }
 
-        // If execvp returns, it must have failed
-        mputs(mtdout, "Error: Execution failed\n", 24);
-        exit(1); // Exit with an error status
+    // Wait for every launched stage to complete
+    if (job_monitor != NULL) {
+        pmon_wait(job_monitor);
+        for (int i = 0; i < job_monitor->count; i++) {
+            struct PmonStage *s = &job_monitor->stages[i];
+            for (int j = 0; j < launched; j++) {
+                struct Stage *stage = &job->stages[j];
+                if (stage->pid != s->pid) continue;
+                stage->status = s->status;
+                stats_from_rusage(&stage->usage, &s->usage);
+                stage->usage.rchar = s->rchar;
+                stage->usage.wchar = s->wchar;
+                stage->usage.wall = s->end - s->start;
+            }
+        }
     } else {
-        // Parent process
-        int status;
-        waitpid(pid, &status, 0); // Wait for the child process to finish
+        for (int i = 0; i < launched; i++) {
+            struct Stage *stage = &job->stages[i];
+            if (stage->pid <= 0) continue;
+            stats_wait(stage->pid, &stage->status, 0, &stage->usage);
+            stage->usage.wall = now_seconds() - stage->start;
+        }
+    }
+    account_job(job, launched);
+    report_job(job, launched);
+    if (mem_room >= 0 && membuf_size(&mem_buffers, job->out_mem) >= mem_room) {
+        mputs(mtderr, "Error: the /MEM/ buffer reached the memory cap (see MemCap)\n", 60);
+    }
+}
 
-        mputs(mtdout, "Child process has finished.\n", 29);
+// Fingerprint what decides a job's output: the working directory, every
+// stage's arguments and binary (the shell itself for builtins) and the From
+// input. Arguments naming files are taken as text only.
+static int job_key(struct Job *job, int contents, struct CacheKey *key) {
+    char cwd[4096];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) return -1;
+    cache_key_init(key);
+    cache_key_string(key, cwd);
+    for (int i = 0; i < job->count; i++) {
+        struct Stage *stage = &job->stages[i];
+        cache_key_add(key, &stage->arg_count, sizeof(stage->arg_count));
+        for (int j = 0; j < stage->arg_count; j++) cache_key_string(key, stage->arguments[j]);
+        const char *binary = is_builtin_stage(stage->program) ? "/proc/self/exe" : launch_resolve(stage->program);
+        if (binary == NULL || cache_key_path(key, binary, 0) == -1) return -1;
     }
+    if (job->input_file != NULL) {
+        cache_key_string(key, "From");
+        return cache_key_path(key, job->input_file, contents);
+    }
+    if (job->in_mem != NULL) {
+        int fd = membuf_reader(&mem_buffers, job->in_mem);
+        if (fd < 0) return -1;
+        cache_key_string(key, "From /MEM/");
+        int result = cache_key_fd(key, fd, contents);
+        close(fd);
+        return result;
+    }
+    return 0;
 }
 
-void execute_program_with_pipe(char *program1, char **arguments1, char *program2, char **arguments2) {
-    int pipe_fd[2]; // File descriptors for the pipe
+// Copy a cache file to where the job's output goes; -1 if it did not get there
+static int replay_output(struct Job *job, int entry) {
+    struct stat st;
+    if (fstat(entry, &st) == -1) return -1;
+    if (job->out_mem != NULL && st.st_size > mem_buffers.limit - membuf_total(&mem_buffers, job->out_mem)) {
+        mputs(mtderr, "Error: the /MEM/ buffer reached the memory cap (see MemCap)\n", 60);
+        return -1;
+    }
+    int out_fd;
+    if (open_job_output(job, &out_fd) == -1) return -1;
+    if (out_fd == -1) mflush(mtdout);
+    int result = 0;
+    if (cache_replay(entry, (out_fd == -1) ? STDOUT_FILENO : out_fd) < 0 && st.st_size > 0) {
+        mputs(mtderr, "Error: Unable to copy the cached output\n", 40);
+        result = -1;
+    }
+    if (out_fd != -1) close(out_fd);
+    return result;
+}
 
-    // Create a pipe
-    if (pipe(pipe_fd) < 0) {
-        mputs(mtderr, "Error creating pipe\n", 20);
+// Cached [Hash] Run ...: replay the output of an identical earlier run, or run
+// the job into a new cache entry and then copy that to the job's target. Only
+// runs whose stages all exit 0 are kept.
+void run_cached(struct Job *job, int contents) {
+    if (job->background || job->in_host != NULL || job_monitor != NULL) {
+        mputs(mtderr, "Note: background, monitored and /TCP/ input jobs are not cached\n", 64);
+        execute_job(job);
+        return;
+    }
+    if (!cache_ready && cache_open(&cache) == 0) cache_ready = 1;
+    struct CacheKey key;
+    if (!cache_ready || job_key(job, contents, &key) == -1) {
+        execute_job(job); // reports a missing program or input itself
         return;
     }
 
-    // Fork the first child process
-    pid_t child_pid1 = fork();
-    
-    if (child_pid1 < 0) {
-        mputs(mtderr, "Error forking first child process\n", 34);
+    double start = now_seconds();
+    int entry = cache_lookup(&cache, &key);
+    if (entry >= 0) {
+        replay_output(job, entry);
+        if (job->timed) {
+            char line[96];
+            struct stat st;
+            fstat(entry, &st);
+            int length = snprintf(line, sizeof(line), "cache hit: %ld bytes in %.3f ms\n", (long)st.st_size, (now_seconds() - start) * 1000);
+            mputs(mtderr, line, length);
+        }
+        close(entry);
+        last_status = 0;
         return;
-    } else if (child_pid1 == 0) {
-        // First child process
-        close(pipe_fd[0]); // Close read end of the pipe
-        dup2(pipe_fd[1], STDOUT_FILENO); // Redirect STDOUT to the pipe
-        close(pipe_fd[1]); // Close the original file descriptor
+    }
+
+    char *temp = cache_begin(&cache, &key);
+    if (temp == NULL) {
+        execute_job(job);
+        return;
+    }
+    struct Job run = *job;
+    run.output_file = temp;
+    run.tcp_host = NULL;
+    run.out_mem = NULL;
+    run.keep = 0;
+    execute_job(&run);
+
+    int succeeded = (run.count > 0);
+    for (int i = 0; i < run.count; i++) {
+        if (!WIFEXITED(run.stages[i].status) || WEXITSTATUS(run.stages[i].status) != 0) succeeded = 0;
+    }
+    int fd = open(temp, O_RDONLY | O_CLOEXEC);
+    int replayed = (fd >= 0 && replay_output(job, fd) == 0);
+    if (fd >= 0) close(fd);
+    if (!replayed) {
+        // the output is not where it should be: leave it where it is
+        char line[512];
+        int length = snprintf(line, sizeof(line), "Note: the output was kept in %s\n", temp);
+        mputs(mtderr, line, length);
+    } else if (!succeeded || cache_commit(&cache, &key, temp) == -1) {
+        unlink(temp);
+    }
+    free(temp);
+}
 
-        // Execute the first program
-        if (execvp(program1, arguments1) < 0) {
-            mputs(mtderr, "Error executing first program\n", 30);
-            exit(1);
+// Move a started job into the job table; the caller's Job is left empty
+void add_background_job(struct Job *job, int launched) {
+    if (background_count == background_cap) {
+        int cap = (background_cap > 0) ? background_cap * 2 : 8;
+        struct BackgroundJob *p = (struct BackgroundJob *)realloc(background_jobs, sizeof(struct BackgroundJob) * cap);
+        if (p == NULL) {
+            // no table entry, so wait for it here instead
+            for (int i = 0; i < launched; i++) {
+                if (!job->stages[i].done) waitpid(job->stages[i].pid, &job->stages[i].status, 0);
+            }
+            return;
         }
+        background_jobs = p;
+        background_cap = cap;
     }
 
-    // Fork the second child process
-    pid_t child_pid2 = fork();
+    struct BackgroundJob *bg = &background_jobs[background_count++];
+    bg->id = next_job_id++;
+    bg->job = *job;
+    bg->job.command = strdup(job->command);
+    bg->launched = launched;
+    bg->remaining = 0;
+    for (int i = 0; i < launched; i++) {
+        if (!job->stages[i].done) bg->remaining++;
+    }
+    memset(job, 0, sizeof(*job));
 
-    if (child_pid2 < 0) {
-        mputs(mtderr, "Error forking second child process\n", 35);
-        return;
-    } else if (child_pid2 == 0) {
-        // Second child process
-        close(pipe_fd[1]); // Close write end of the pipe
-        dup2(pipe_fd[0], STDIN_FILENO); // Redirect STDIN from the pipe
-        close(pipe_fd[0]); // Close the original file descriptor
+    mputc(mtdout, '[');
+    mputi(mtdout, bg->id);
+    mputs(mtdout, "] ", 2);
+    for (int i = 0; i < launched; i++) {
+        if (bg->job.stages[i].done) continue;
+        mputi(mtdout, bg->job.stages[i].pid);
+        mputc(mtdout, ' ');
+    }
+    mputc(mtdout, '\n');
+
+    if (bg->remaining == 0) finish_background_job(background_count - 1);
+}
 
-        // Execute the second program
-        if (execvp(program2, arguments2) < 0) {
-            mputs(mtderr, "Error executing second program\n", 31);
-            exit(1);
+// Record a reaped child; returns 1 if it completed a background job
+static int background_child_done(pid_t pid, int status, const struct StageUsage *usage) {
+    for (int j = 0; j < background_count; j++) {
+        struct BackgroundJob *bg = &background_jobs[j];
+        for (int i = 0; i < bg->launched; i++) {
+            struct Stage *stage = &bg->job.stages[i];
+            if (stage->done || stage->pid != pid) continue;
+            stage->status = status;
+            stage->usage = *usage;
+            stage->usage.wall = now_seconds() - stage->start;
+            stage->done = 1;
+            if (--bg->remaining == 0) {
+                finish_background_job(j);
+                return 1;
+            }
+            return 0;
         }
     }
+    return 0;
+}
 
-    // Parent process
-    close(pipe_fd[0]); // Close read end
-    close(pipe_fd[1]); // Close write end
+// Reap every child that has exited, returns the number of jobs reported
+int reap_children() {
+    int reported = 0;
+    int status;
+    struct StageUsage usage;
+    pid_t pid;
+    while ((pid = stats_wait(-1, &status, WNOHANG, &usage)) > 0) reported += background_child_done(pid, status, &usage);
+    return reported;
+}
 
-    // Wait for both child processes to complete
-    int status1, status2;
-    waitpid(child_pid1, &status1, 0);
-    waitpid(child_pid2, &status2, 0);
-    
+// Report a finished job ("[n] Done ..." or how its last stage ended) and drop it
+void finish_background_job(int index) {
+    struct BackgroundJob *bg = &background_jobs[index];
+    int status = (bg->launched > 0) ? bg->job.stages[bg->launched - 1].status : 127 << 8;
+    account_job(&bg->job, bg->launched);
+
+    mputc(mtdout, '[');
+    mputi(mtdout, bg->id);
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        mputs(mtdout, "] Done  ", 8);
+    } else if (WIFEXITED(status)) {
+        mputs(mtdout, "] Exit ", 7);
+        mputi(mtdout, WEXITSTATUS(status));
+        mputs(mtdout, "  ", 2);
+    } else {
+        mputs(mtdout, "] Signal ", 9);
+        mputi(mtdout, WTERMSIG(status));
+        mputs(mtdout, "  ", 2);
+    }
+    mputs(mtdout, bg->job.command, strlen(bg->job.command));
+    mputc(mtdout, '\n');
+
+    free_job(&bg->job);
+    memmove(bg, bg + 1, sizeof(struct BackgroundJob) * (background_count - index - 1));
+    background_count--;
 }
 
-void execute_program_with_redirection(char *program, char **arguments, char *filename) {
-    pid_t pid = fork(); // Create a new process
+void list_jobs() {
+    for (int j = 0; j < background_count; j++) {
+        struct BackgroundJob *bg = &background_jobs[j];
+        mputc(mtdout, '[');
+        mputi(mtdout, bg->id);
+        mputs(mtdout, "] Running  ", 11);
+        mputs(mtdout, bg->job.command, strlen(bg->job.command));
+        mputc(mtdout, '\n');
+    }
+}
+
+// Wait for one background job, or all of them when no job number is given
+void wait_jobs(char *argument) {
+    int id = (argument != NULL) ? atoi(argument) : 0;
+    int found = 0;
+
+    for (int j = 0; j < background_count;) {
+        struct BackgroundJob *bg = &background_jobs[j];
+        if (id != 0 && bg->id != id) {
+            j++;
+            continue;
+        }
+        found = 1;
+
+        int finished = 0;
+        for (int i = 0; i < bg->launched && !finished; i++) {
+            struct Stage *stage = &bg->job.stages[i];
+            if (stage->done) continue;
+            int status;
+            struct StageUsage usage;
+            if (stats_wait(stage->pid, &status, 0, &usage) == stage->pid) finished = background_child_done(stage->pid, status, &usage);
+        }
+        if (!finished) j++; // only reached if waitpid failed
+        if (id != 0) break;
+    }
+
+    if (id != 0 && !found) mputs(mtderr, "Error: No such job\n", 19);
+}
+
+// One command line of a Parallel run or batch file
+struct ParallelJob {
+    char *command;
+    pid_t pid;
+    int output;                // memfd holding the command's stdout and stderr
+    int status;
+    double start, end;
+    int done;
+};
+
+// Run one command line in a forked shell whose output goes to a memfd
+static void start_parallel_job(struct ParallelJob *pj) {
+    pj->start = now_seconds();
+    pj->output = memfd_create("myshell-job", MFD_CLOEXEC);
+    pj->pid = (pj->output != -1) ? fork() : -1;
 
-    if (pid == -1) {
-        // Fork failed
+    if (pj->pid == 0) {
+        int null_fd = open("/dev/null", O_RDONLY);
+        dup2(null_fd, STDIN_FILENO);
+        dup2(pj->output, STDOUT_FILENO);
+        dup2(pj->output, STDERR_FILENO);
+
+        // the parent's background jobs are not this shell's to wait for
+        background_count = 0;
+        quiet_jobs = 1;
+        parse_and_execute_command(pj->command);
+        wait_jobs(NULL);
+        _exit(last_status);
+    }
+    if (pj->pid < 0) {
         mputs(mtderr, "Error: Unable to fork process\n", 30);
-    } else if (pid == 0) {
-        // Child process
-        // Open the file for writing
-        int file_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        if (file_fd < 0) {
-            mputs(mtderr, "Error: Unable to open file for redirection\n", 44);
-            exit(1); // Exit with an error status
+        pj->status = 127 << 8;
+        pj->done = 1;
+        pj->end = pj->start;
+    }
+}
+
+// Copy a finished job's captured output to standard out in one piece
+static void flush_parallel_job(struct ParallelJob *pj) {
+    if (pj->output == -1) return;
+    off_t size = lseek(pj->output, 0, SEEK_END);
+    off_t offset = 0;
+    while (offset < size) {
+        if (sendfile(STDOUT_FILENO, pj->output, &offset, size - offset) <= 0) break;
+    }
+
+    // sendfile refuses some outputs (O_APPEND files), copy the rest instead
+    char buffer[BUILTIN_BLOCK];
+    while (offset < size) {
+        int n = pread(pj->output, buffer, sizeof(buffer), offset);
+        if (n <= 0 || write(STDOUT_FILENO, buffer, n) != n) break;
+        offset += n;
+    }
+    close(pj->output);
+    pj->output = -1;
+}
+
+// Run the command lines on at most 'workers' forked shells. Output is shown
+// per job, as each finishes or in submission order when 'ordered' is set,
+// followed by a summary on standard error. Returns the number of failed jobs.
+int run_parallel(char **commands, int count, int workers, int ordered) {
+    struct ParallelJob *jobs = (struct ParallelJob *)calloc(count, sizeof(struct ParallelJob));
+    if (jobs == NULL) return count;
+    if (workers < 1) workers = 1;
+
+    double start = now_seconds();
+    int next = 0, active = 0, next_flush = 0, finished = 0;
+    while (finished < count) {
+        while (active < workers && next < count) {
+            struct ParallelJob *pj = &jobs[next++];
+            pj->command = commands[next - 1];
+            start_parallel_job(pj);
+            if (pj->done) finished++;
+            else active++;
         }
 
-        // Redirect STDOUT to the file
-        dup2(file_fd, STDOUT_FILENO);
-        close(file_fd); // Close the file descriptor, as it's no longer needed
+        if (active > 0) {
+            int status;
+            struct StageUsage usage;
+            pid_t pid = stats_wait(-1, &status, 0, &usage);
+            if (pid == -1) break;
+
+            int j = 0;
+            while (j < next && jobs[j].pid != pid) j++;
+            if (j == next) {
+                background_child_done(pid, status, &usage); // a background job of this shell
+                continue;
+            }
+            jobs[j].status = status;
+            jobs[j].end = now_seconds();
+            jobs[j].done = 1;
+            active--;
+            finished++;
+            if (!ordered) flush_parallel_job(&jobs[j]);
+        }
+
+        while (ordered && next_flush < next && jobs[next_flush].done) flush_parallel_job(&jobs[next_flush++]);
+    }
+
+    // Summary: one line per job, then the totals
+    int failed = 0;
+    char line[128];
+    for (int j = 0; j < count; j++) {
+        struct ParallelJob *pj = &jobs[j];
+        int code = WIFEXITED(pj->status) ? WEXITSTATUS(pj->status) : 128 + WTERMSIG(pj->status);
+        if (code != 0) failed++;
+        snprintf(line, sizeof(line), "[%d] exit %3d %8.3fs  ", j + 1, code, pj->end - pj->start);
+        mputs(mtderr, line, strlen(line));
+        mputs(mtderr, pj->command, strlen(pj->command));
+        mputc(mtderr, '\n');
+    }
+    snprintf(line, sizeof(line), "%d jobs, %d failed, %d workers, %.3fs wall\n", count, failed, workers,
+             now_seconds() - start);
+    mputs(mtderr, line, strlen(line));
+
+    free(jobs);
+    return failed;
+}
+
+// Parallel [-j N] [-k] <command> ; <command> ; ...
+void handle_parallel_command(char *input_command) {
+    char *rest = input_command + 8; // Skips "Parallel"
+    int workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int ordered = 0;
+
+    while (1) {
+        while (*rest == ' ') rest++;
+        if (strncmp(rest, "-j ", 3) == 0) {
+            workers = atoi(rest + 3);
+            rest += 3;
+            while (*rest == ' ') rest++;
+            while (*rest != ' ' && *rest != '\0') rest++;
+        } else if (strncmp(rest, "-k ", 3) == 0) {
+            ordered = 1;
+            rest += 3;
+        } else {
+            break;
+        }
+    }
 
-        // Execute the program
-        execvp(program, arguments);
+    char **commands = NULL;
+    int count = 0;
+    for (char *command = strtok(rest, ";"); command != NULL; command = strtok(NULL, ";")) {
+        while (*command == ' ') command++;
+        int len = strlen(command);
+        while (len > 0 && command[len - 1] == ' ') command[--len] = '\0';
+        if (len == 0) continue;
+        commands = (char **)realloc(commands, sizeof(char *) * (count + 1));
+        commands[count++] = command;
+    }
 
-        // If execvp returns, it must have failed
-        mputs(mtderr, "Error: Execution failed\n", 24);
-        exit(1); // Exit with an error status
+    if (count == 0) {
+        mputs(mtderr, "Usage: Parallel [-j N] [-k] <command> ; <command> ...\n", 54);
     } else {
-        // Parent process
-        int status;
-        waitpid(pid, &status, 0); // Wait for the child process to finish
+        last_status = (run_parallel(commands, count, workers, ordered) > 0) ? 1 : 0;
+    }
+    free(commands);
+}
 
+// Batch mode: every non-empty line of the file that does not start with '#'
+// is a command; returns the exit code of the shell
+int run_batch_file(const char *filename, int workers, int ordered) {
+    MILE *file = mopen(filename, MODE_R, 0);
+    if (file == NULL) {
+        mputs(mtderr, "Error: Unable to open the batch file\n", 37);
+        return 1;
+    }
+
+    char *text = NULL;
+    int len = 0, cap = 0, n;
+    do {
+        if (cap - len < BUILTIN_BLOCK) {
+            cap = (cap > 0) ? cap * 2 : BUILTIN_BLOCK * 2;
+            text = (char *)realloc(text, cap + 1);
+        }
+        n = mread(file, text + len, cap - len);
+        if (n > 0) len += n;
+    } while (n > 0);
+    mclose(file);
+    if (text == NULL) return 0;
+    text[len] = '\0';
 
+    char **commands = NULL;
+    int count = 0;
+    for (char *line = strtok(text, "\n"); line != NULL; line = strtok(NULL, "\n")) {
+        int line_len = strlen(line);
+        if (line_len > 0 && line[line_len - 1] == '\r') line[--line_len] = '\0';
+        if (line_len == 0 || line[0] == '#') continue;
+        commands = (char **)realloc(commands, sizeof(char *) * (count + 1));
+        commands[count++] = line;
     }
+
+    int failed = (count > 0) ? run_parallel(commands, count, workers, ordered) : 0;
+    free(commands);
+    free(text);
+    return (failed > 0) ? 1 : 0;
 }
 
-void execute_program_with_input_redirection(char *program, char **arguments, char *filename) {
-    // Open the file for reading
-    int file_fd = open(filename, O_RDONLY);
+// Send <file> To /TCP/host/port [Keep]: the file is spliced to the socket
+void handle_send_command(char *input_command) {
+    strtok(input_command, " "); // Skips "Send"
+    char *filename = strtok(NULL, " ");
+    char *to = strtok(NULL, " ");
+    char *target = strtok(NULL, " ");
+    char *keep = strtok(NULL, " ");
+    if (filename == NULL || to == NULL || strcmp(to, "To") != 0 || target == NULL ||
+        strncmp(target, "/TCP/", 5) != 0 || (keep != NULL && strcmp(keep, "Keep") != 0)) {
+        mputs(mtderr, "Usage: Send <file> To /TCP/<host>/<port> [Keep]\n", 48);
+        last_status = 1;
+        return;
+    }
+    char *hostname, *port;
+    if (cmd_tcp_target(target, &hostname, &port) == -1) {
+        mputs(mtderr, "Error: use To /TCP/host/port\n", 29);
+        last_status = 1;
+        return;
+    }
+
+    int file_fd = open(filename, O_RDONLY | O_CLOEXEC);
     if (file_fd < 0) {
         mputs(mtderr, "Error: Unable to open file for input redirection\n", 50);
+        last_status = 1;
+        return;
+    }
+    int sock = net_pool_get(&net_pool, hostname, port, keep != NULL);
+    if (sock < 0) {
+        close(file_fd);
+        last_status = 1;
         return;
     }
 
-    pid_t pid = fork(); // Create a new process
+    // a peer that goes away must not kill the shell
+    void (*saved)(int) = signal(SIGPIPE, SIG_IGN);
+    long sent = net_send_file(sock, file_fd);
+    signal(SIGPIPE, saved);
+    close(sock);
+    close(file_fd);
 
-    if (pid == -1) {
-        // Fork failed
-        mputs(mtderr, "Error: Unable to fork process\n", 30);
-    } else if (pid == 0) {
-        // Child process
-        // Redirect STDIN to the file
-        dup2(file_fd, STDIN_FILENO);
-        close(file_fd); // Close the file descriptor, as it's no longer needed
-
-        // Execute the program
-        execvp(program, arguments);
-
-        // If execvp returns, it must have failed
-        mputs(mtderr, "Error: Execution failed\n", 24);
-        exit(1); // Exit with an error status
+    if (sent < 0) {
+        mputs(mtderr, "Error: Sending the file failed\n", 31);
+        last_status = 1;
     } else {
-        // Parent process
-        close(file_fd); // Close the file descriptor
+        last_status = 0;
+    }
+}
+
+// Serve <port> [Max N] [Prefork N] [Count N] Run <program> [<args>]
+void handle_serve_command(char *input_command) {
+    char *line_end = input_command + strlen(input_command);
+    strtok(input_command, " "); // Skips "Serve"
+    char *port = strtok(NULL, " ");
+    int max = SERVE_MAX, prefork = 0;
+    long count = 0;
+    int error = (port == NULL);
+
+    char *token = NULL;
+    while (!error && (token = strtok(NULL, " ")) != NULL && strcmp(token, "Run") != 0) {
+        char *value = strtok(NULL, " ");
+        if (value == NULL || atoi(value) <= 0) error = 1;
+        else if (strcmp(token, "Max") == 0) max = atoi(value);
+        else if (strcmp(token, "Prefork") == 0) prefork = atoi(value);
+        else if (strcmp(token, "Count") == 0) count = atol(value);
+        else error = 1;
+    }
+
+    // the program and its arguments are parsed like a one-stage Run
+    struct CmdLine cmd;
+    const char *parse_error = NULL;
+    if (!error && token != NULL) {
+        char *rest = (token + 3 < line_end) ? token + 4 : token + 3;
+        if (cmd_parse_run(&command_arena, rest, &cmd, &parse_error) == -1) {
+            mputs(mtderr, parse_error, strlen(parse_error));
+            error = 1;
+        } else if (cmd.count != 1 || cmd.input_file != NULL || cmd.in_host != NULL || cmd.in_mem != NULL || cmd.output_file != NULL ||
+                   cmd.out_host != NULL || cmd.out_mem != NULL || cmd.background ||
+                   cmd.stages[0].pin != NULL || cmd.stages[0].nice != NULL || cmd.stages[0].node != NULL) {
+            error = 1;
+        }
+    }
+    if (error || token == NULL) {
+        if (parse_error == NULL) mputs(mtderr, "Usage: Serve <port> [Max N] [Prefork N] [Count N] Run <program> [<args>]\n", 73);
+        arena_reset(&command_arena);
+        last_status = 1;
+        return;
+    }
+
+    struct Stage stage;
+    memset(&stage, 0, sizeof(stage));
+    stage.program = cmd.stages[0].program;
+    stage.arguments = cmd.stages[0].arguments;
+    stage.arg_count = cmd.stages[0].arg_count;
+
+    last_status = serve(port, &stage, max, prefork, count);
+    arena_reset(&command_arena);
+}
+
+// Connection totals, shared with the prefork workers
+struct ServeCounters {
+    long tickets;              // connections claimed by a worker
+    int started;               // set with the first connection
+    double start;
+    long served;
+    long failed;
+};
+
+// The rate is measured from the first connection, not from the Serve command
+static void serve_started(struct ServeCounters *counters) {
+    if (__atomic_exchange_n(&counters->started, 1, __ATOMIC_RELAXED) == 0) counters->start = now_seconds();
+}
+
+// Handle one connection in spawn mode: the program gets the socket as its
+// standard in and out. Returns the pid to reap, or -1.
+static pid_t serve_connection(struct Stage *stage, int conn, int listen_fd) {
+    if (!is_builtin_stage(stage->program)) return launch_program(stage->program, stage->arguments, conn, conn);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        close(listen_fd);
+        net_pool_close(&net_pool, NULL, NULL);
+        _exit(run_builtin_stage(stage, conn, NULL, conn));
+    }
+    return pid;
+}
+
+// A prefork worker takes connections one at a time until the Count is used
+// up. Builtins run in the worker itself, so a connection costs no fork at all.
+static void serve_worker(int listen_fd, struct Stage *stage, struct ServeCounters *counters, long count) {
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+    net_pool_close(&net_pool, NULL, NULL);
+    int builtin = is_builtin_stage(stage->program);
+    if (builtin) signal(SIGPIPE, SIG_IGN);
+
+    // EPOLLEXCLUSIVE wakes one idle worker per connection instead of all of them
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.fd = listen_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+
+    while (count == 0 || __atomic_fetch_add(&counters->tickets, 1, __ATOMIC_RELAXED) < count) {
+        int conn;
+        while ((conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC)) < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) _exit(1);
+            epoll_wait(epoll_fd, &ev, 1, -1);
+        }
+        serve_started(counters);
+
         int status;
-        waitpid(pid, &status, 0); // Wait for the child process to finish
+        if (builtin) {
+            status = run_builtin_stage(stage, conn, NULL, conn) << 8;
+        } else {
+            pid_t pid = launch_program(stage->program, stage->arguments, conn, conn);
+            status = 127 << 8;
+            if (pid > 0) waitpid(pid, &status, 0);
+        }
+        close(conn);
+        __atomic_add_fetch((status == 0) ? &counters->served : &counters->failed, 1, __ATOMIC_RELAXED);
+    }
+    _exit(0);
+}
+
+// Accept connections on port and run the stage on each, until Count
+// connections have been handled or the shell gets SIGINT. Without Prefork the
+// shell accepts from an epoll loop and starts one process per connection,
+// at most max at a time; further connections wait in the listen backlog.
+int serve(const char *port, struct Stage *stage, int max, int prefork, long count) {
+    int listen_fd = net_listen(port, SERVE_BACKLOG);
+    if (listen_fd < 0) return 1;
+
+    // SIGINT ends the server instead of the shell; both signals arrive through a signalfd
+    sigset_t mask, saved_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &saved_mask);
+    int sig_fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+    struct ServeCounters *counters = (struct ServeCounters *)mmap(NULL, sizeof(struct ServeCounters),
+                                                                  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    int slots = (prefork > 0) ? prefork : max;
+    pid_t *pids = (pid_t *)calloc(slots, sizeof(pid_t));
+    if (sig_fd < 0 || epoll_fd < 0 || counters == MAP_FAILED || pids == NULL) {
+        mputs(mtderr, "Error: Unable to set up the server\n", 35);
+        if (counters != MAP_FAILED) munmap(counters, sizeof(struct ServeCounters));
+        free(pids);
+        if (epoll_fd >= 0) close(epoll_fd);
+        if (sig_fd >= 0) close(sig_fd);
+        sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+        close(listen_fd);
+        return 1;
+    }
 
-        // Optionally, handle the exit status of the child process here
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = sig_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sig_fd, &ev);
+
+    int active = 0;
+    for (int i = 0; i < prefork; i++) {
+        pids[i] = fork();
+        if (pids[i] == 0) serve_worker(listen_fd, stage, counters, count);
+        if (pids[i] > 0) active++;
+    }
+
+    long accepted = 0;
+    int armed = 0, stopping = 0;
+    while (1) {
+        // the listener is watched only while another connection may be taken
+        int want = prefork == 0 && !stopping && active < max && (count == 0 || accepted < count);
+        if (want != armed) {
+            ev.events = EPOLLIN;
+            ev.data.fd = listen_fd;
+            epoll_ctl(epoll_fd, want ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, listen_fd, &ev);
+            armed = want;
+        }
+        if (!armed && active == 0) break;
+
+        struct epoll_event events[2];
+        int ready = epoll_wait(epoll_fd, events, 2, -1);
+        for (int e = 0; e < ready; e++) {
+            if (events[e].data.fd == sig_fd) {
+                struct signalfd_siginfo info;
+                while (read(sig_fd, &info, sizeof(info)) == sizeof(info)) {
+                    if (info.ssi_signo == SIGINT && !stopping) {
+                        stopping = 1;
+                        for (int i = 0; i < prefork; i++) {
+                            if (pids[i] > 0) kill(pids[i], SIGTERM);
+                        }
+                    }
+                }
+                for (int i = 0; i < slots; i++) {
+                    int status;
+                    if (pids[i] <= 0 || waitpid(pids[i], &status, WNOHANG) != pids[i]) continue;
+                    pids[i] = 0;
+                    active--;
+                    if (prefork == 0) {
+                        if (status == 0) counters->served++;
+                        else counters->failed++;
+                    }
+                }
+            } else {
+                while (active < max && (count == 0 || accepted < count)) {
+                    int conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+                    if (conn < 0) break;
+                    serve_started(counters);
+                    accepted++;
+                    pid_t pid = serve_connection(stage, conn, listen_fd);
+                    close(conn);
+                    if (pid < 0) {
+                        counters->failed++;
+                        continue;
+                    }
+                    int slot = 0;
+                    while (pids[slot] > 0) slot++;
+                    pids[slot] = pid;
+                    active++;
+                }
+            }
+        }
     }
+    double elapsed = counters->started ? now_seconds() - counters->start : 0;
+
+    char summary[128];
+    int length = snprintf(summary, sizeof(summary), "Served %ld connections (%ld failed) in %.2f s, %.0f per second\n",
+                          counters->served, counters->failed, elapsed,
+                          (elapsed > 0) ? (counters->served + counters->failed) / elapsed : 0.0);
+    mputs(mtderr, summary, length);
+    int result = (counters->failed > 0);
+
+    munmap(counters, sizeof(struct ServeCounters));
+    free(pids);
+    close(epoll_fd);
+    close(sig_fd);
+    close(listen_fd);
+    sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+    // SIGCHLDs of background jobs were taken by the signalfd above
+    reap_children();
+    return result;
 }
 
-void execute_program_with_tcp_redirection(char *program, char **arguments, char *hostname, char *port) {
-    
-    struct addrinfo hints, *res0;
-    int commsoc;
-    int error;
+// MemCap [<bytes>[K|M|G]]: show or set the cap on all /MEM/ buffers
+void handle_memcap_command(char *argument) {
+    if (argument != NULL) {
+        char *end;
+        long limit = strtol(argument, &end, 10);
+        if (*end == 'K' || *end == 'k') limit <<= 10, end++;
+        else if (*end == 'M' || *end == 'm') limit <<= 20, end++;
+        else if (*end == 'G' || *end == 'g') limit <<= 30, end++;
+        if (end == argument || *end != '\0' || limit <= 0) {
+            mputs(mtderr, "Usage: MemCap [<bytes>[K|M|G]]\n", 31);
+            return;
+        }
+        mem_buffers.limit = limit;
+    }
+    char line[80];
+    int length = snprintf(line, sizeof(line), "/MEM/ cap %ld bytes, %ld in use\n", mem_buffers.limit, membuf_total(&mem_buffers, NULL));
+    mputs(mtdout, line, length);
+}
 
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
+static void print_history_entry(long n) {
+    int length;
+    const char *line = history_entry(&history, n, &length);
+    if (line == NULL) return;
+    char number[16];
+    int width = snprintf(number, sizeof(number), "%6ld  ", n);
+    mputs(mtdout, number, width);
+    mputs(mtdout, line, length);
+    mputc(mtdout, '\n');
+}
 
-    error = getaddrinfo(hostname, port, &hints, &res0);
-    if (error) {
-        const char *errMsg = gai_strerror(error);
-        mputs(mtderr, errMsg, strlen(errMsg));
-        mputs(mtderr, "\n", 1);
+// History [-s] [<prefix>] | History Compact
+void handle_history_command(char *argument) {
+    if (!history_ready) {
+        mputs(mtderr, "Error: no history file\n", 23);
         return;
     }
-
-    commsoc = socket(res0->ai_family, res0->ai_socktype, res0->ai_protocol);
-    if (commsoc < 0) {
-        mputs(mtderr, "cannot get socket\n", 19);
-        freeaddrinfo(res0);
+    if (argument != NULL && strcmp(argument, "Compact") == 0) {
+        if (history_compact(&history, history.limit) == -1) mputs(mtderr, "Error compacting the history\n", 29);
         return;
     }
+    if (argument == NULL) {
+        history_refresh(&history);
+        long first = (history.count > HISTORY_SHOW) ? history.count - HISTORY_SHOW + 1 : 1;
+        for (long n = first; n <= history.count; n++) print_history_entry(n);
+        return;
+    }
+
+    int anywhere = (strncmp(argument, "-s ", 3) == 0);
+    long *found;
+    long count = history_search(&history, anywhere ? argument + 3 : argument, anywhere, &found);
+    // the newest matches, oldest first
+    for (long i = (count > HISTORY_SHOW) ? count - HISTORY_SHOW : 0; i < count; i++) print_history_entry(found[i]);
+    free(found);
+}
 
-    if (connect(commsoc, res0->ai_addr, res0->ai_addrlen) < 0) {
-        mputs(mtderr, "cannot connect\n", 16);
-        close(commsoc);
-        freeaddrinfo(res0);
+// Rerun [<n>|<prefix>]: run entry n, or the newest entry starting with prefix
+void handle_rerun_command(char *argument) {
+    if (!history_ready) {
+        mputs(mtderr, "Error: no history file\n", 23);
         return;
     }
+    history_refresh(&history);
+    long n = history.count;
+    if (argument != NULL && argument[0] >= '0' && argument[0] <= '9') {
+        n = atol(argument);
+    } else if (argument != NULL) {
+        long *found;
+        long count = history_search(&history, argument, 0, &found);
+        n = (count > 0) ? found[count - 1] : 0;
+        free(found);
+    }
 
-    pid_t pid = fork();
-    if (pid == -1) {
-        mputs(mtderr, "Error: Unable to fork process\n", 30);
-        close(commsoc);
-        freeaddrinfo(res0);
+    int length;
+    const char *line = history_entry(&history, n, &length);
+    if (line == NULL) {
+        mputs(mtderr, "Error: no such history entry\n", 29);
         return;
-    } else if (pid == 0) {
-        dup2(commsoc, STDOUT_FILENO);
-        close(commsoc);
-        freeaddrinfo(res0);
-        execvp(program, arguments);
-        mputs(mtderr, "Error: Execution failed\n", 24);
-        exit(1);
+    }
+    // the mapping may move as the log grows, and commands edit their line
+    char *command = strndup(line, length);
+    mputs(mtdout, command, length);
+    mputc(mtdout, '\n');
+    history_add(&history, command, length);
+    parse_and_execute_command(command);
+    free(command);
+}
+
+// Builtin stages run the word engines without exec: in the shell itself as
+// the last stage of a job, otherwise in a forked copy of the shell
+int is_builtin_stage(const char *program) {
+    return strcmp(program, "WordCount") == 0 || strcmp(program, "WordReplace") == 0 || strcmp(program, "Tee") == 0;
+}
+
+// WordCount [-w] [-b] [-c] [-l], the options of word_counter
+int builtin_word_count(char **arguments, MILE *in, MILE *out) {
+    int reports = 0;
+    for (int i = 1; arguments[i] != NULL; i++) {
+        if (strcmp(arguments[i], "-w") == 0) reports |= WC_WORDS;
+        else if (strcmp(arguments[i], "-b") == 0) reports |= WC_BIGRAMS;
+        else if (strcmp(arguments[i], "-c") == 0) reports |= WC_CHARS;
+        else if (strcmp(arguments[i], "-l") == 0) reports |= WC_LINES;
+        else {
+            mputs(mtderr, "Usage: WordCount [-w] [-b] [-c] [-l]\n", 37);
+            return 1;
+        }
+    }
+    if (reports == 0) reports = WC_LEGACY;
+
+    struct WordCounter counter;
+    char *buffer = (char *)malloc(BUILTIN_BLOCK);
+    if (buffer == NULL || wc_init(&counter, reports, WC_BUCKETS, WC_BUCKETS, out) == -1) {
+        mputs(mtderr, "Error allocating the word tables\n", 33);
+        free(buffer);
+        return 1;
+    }
+
+    int bytes_read;
+    while ((bytes_read = mread(in, buffer, BUILTIN_BLOCK)) > 0) {
+        wc_feed(&counter, buffer, bytes_read);
+        mflush(out);
+    }
+    wc_finish(&counter);
+    wc_report(&counter, out);
+
+    wc_free(&counter);
+    free(buffer);
+    return 0;
+}
+
+// WordReplace [-a [-s]] <rules>, the token and automaton modes of word_replacer
+int builtin_word_replace(char **arguments, MILE *in, MILE *out) {
+    int automaton = 0;
+    int word_bounds = 1;
+    int argi = 1;
+    for (; arguments[argi] != NULL && arguments[argi][0] == '-'; argi++) {
+        if (strcmp(arguments[argi], "-a") == 0) automaton = 1;
+        else if (strcmp(arguments[argi], "-s") == 0) word_bounds = 0;
+        else break;
+    }
+    if (arguments[argi] == NULL || arguments[argi + 1] != NULL) {
+        mputs(mtderr, "Usage: WordReplace [-a [-s]] <rules>\n", 37);
+        return 1;
+    }
+
+    struct RuleSet rules;
+    if (rules_load(&rules, arguments[argi]) == -1) {
+        mputs(mtderr, "Error opening the rules file\n", 29);
+        return 1;
+    }
+
+    struct AcMatcher matcher;
+    struct AcStream stream;
+    struct Replacer replacer;
+    char *buffer = (char *)malloc(BUILTIN_BLOCK);
+    int error = (buffer == NULL);
+    if (!error && automaton) {
+        error = (ac_build(&matcher, &rules) == -1);
+        if (!error) ac_stream_init(&stream, &matcher, &rules, word_bounds, out);
+    } else if (!error) {
+        error = (replacer_init(&replacer, &rules, out) == -1);
+    }
+    if (error) {
+        mputs(mtderr, "Error allocating the replacement buffers\n", 41);
+        free(buffer);
+        rules_free(&rules);
+        return 1;
+    }
+
+    int bytes_read;
+    while ((bytes_read = mread(in, buffer, BUILTIN_BLOCK)) > 0) {
+        if (automaton) ac_feed(&stream, buffer, bytes_read);
+        else replacer_feed(&replacer, buffer, bytes_read);
+        mflush(out);
+    }
+    if (automaton) {
+        ac_finish(&stream);
+        ac_stream_free(&stream);
+        ac_free(&matcher);
     } else {
-        close(commsoc);
-        freeaddrinfo(res0);
-        int status;
-        waitpid(pid, &status, 0);
+        replacer_finish(&replacer);
+        replacer_free(&replacer);
     }
+
+    free(buffer);
+    rules_free(&rules);
+    return 0;
 }
 
-void parse_arguments(char *input_command, char **program, char ***arguments, int *arg_count) {
-    *arg_count = 0; // Initialize the argument count to 0
-    *arguments = NULL; // Initialize the arguments array to NULL
+// Tee <file>|/TCP/<host>/<port> ...: pass the input on to the next stage (or
+// the To target) and copy it to every sink, see tee_stage.c
+int builtin_tee(char **arguments, int in_fd, const char *in_file, int out_fd) {
+    int count = 1;
+    while (arguments[count] != NULL) count++;
+    if (count == 1) {
+        mputs(mtderr, "Usage: Tee <file>|/TCP/<host>/<port> ...\n", 41);
+        return 1;
+    }
+    struct TeeSink *sinks = (struct TeeSink *)calloc(count, sizeof(struct TeeSink));
+    if (sinks == NULL) return 1;
 
-    // Tokenize the input command using space as a delimiter
-    char *token = strtok(input_command, " ");
+    // sink 0 is the stage's own output; tee_run closes every sink once it
+    // has all the data, and only a forked stage owns its output
+    mflush(mtdout);
+    if (out_fd == -1) out_fd = STDOUT_FILENO;
+    sinks[0].fd = stage_child ? out_fd : dup(out_fd);
+    sinks[0].name = "output";
+    int opened = 1, result = (sinks[0].fd < 0) ? 1 : 0;
+    for (; result == 0 && opened < count; opened++) {
+        char *target = arguments[opened];
+        sinks[opened].name = target;
+        if (strncmp(target, "/TCP/", 5) == 0) {
+            char *copy = strdup(target), *host, *port;
+            if (copy == NULL || cmd_tcp_target(copy, &host, &port) == -1) {
+                mputs(mtderr, "Error: use Tee /TCP/host/port\n", 30);
+                sinks[opened].fd = -1;
+            } else {
+                sinks[opened].fd = net_pool_get(&net_pool, host, port, 0);
+            }
+            free(copy);
+        } else {
+            sinks[opened].fd = open(target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (sinks[opened].fd < 0) mputs(mtderr, "Error: Unable to open file for redirection\n", 44);
+        }
+        if (sinks[opened].fd < 0) result = 1;
+    }
 
-    // The first token is the program name
-    *program = strdup(token);
+    int input = in_fd;
+    if (result == 0 && in_file != NULL) {
+        input = open(in_file, O_RDONLY | O_CLOEXEC);
+        if (input < 0) {
+            mputs(mtderr, "Error: Unable to open file for input redirection\n", 50);
+            result = 1;
+        }
+    }
+    if (result == 0) {
+        // a sink whose reader has gone is dropped, the others go on
+        void (*saved)(int) = signal(SIGPIPE, SIG_IGN);
+        result = (tee_run((input != -1) ? input : STDIN_FILENO, sinks, count, mtderr) == 0) ? 0 : 1;
+        signal(SIGPIPE, saved);
+    } else {
+        for (int i = 0; i < opened; i++) {
+            if (sinks[i].fd >= 0 && (i > 0 || !stage_child)) close(sinks[i].fd);
+        }
+    }
 
-    // Process the rest of the tokens as arguments
-    while ((token = strtok(NULL, " ")) != NULL) {
-        // Increase arg_count and reallocate memory for arguments array
-        (*arg_count)++;
-        *arguments = realloc(*arguments, sizeof(char *) * (*arg_count));
+    if (in_file != NULL && input >= 0) close(input);
+    free(sinks);
+    return result;
+}
+
+// Run a builtin stage reading in_file (through mio) or in_fd, -1 meaning the
+// shell's input, and writing to out_fd or standard out. Returns the exit code.
+int run_builtin_stage(struct Stage *stage, int in_fd, const char *in_file, int out_fd) {
+    // Tee moves the bytes between descriptors itself, without mio streams
+    if (strcmp(stage->program, "Tee") == 0) return builtin_tee(stage->arguments, in_fd, in_file, out_fd);
 
-        // Duplicate the token and store it in the arguments array
-        (*arguments)[*arg_count - 1] = strdup(token);
+    MILE *in;
+    if (in_file != NULL) in = mopen(in_file, MODE_R, 0);
+    else if (in_fd != -1) in = mdopen(dup(in_fd), MODE_R, 0);
+    else in = mtdin;
+    // the stream gets its own descriptor so closing it leaves the job's alone
+    MILE *out = mdopen(dup((out_fd != -1) ? out_fd : STDOUT_FILENO), MODE_WA, BUILTIN_BLOCK);
+    if (in == NULL || out == NULL) {
+        mputs(mtderr, "Error: Unable to open the builtin's input or output\n", 52);
+        return 1;
     }
 
-    // Null-terminate the arguments array
-    *arguments = realloc(*arguments, sizeof(char *) * (*arg_count + 1));
-    (*arguments)[*arg_count] = NULL;
+    int result;
+    if (strcmp(stage->program, "WordCount") == 0) result = builtin_word_count(stage->arguments, in, out);
+    else result = builtin_word_replace(stage->arguments, in, out);
+
+    mclose(out);
+    if (in != mtdin) mclose(in);
+    return result;
 }
 
-void free_arguments(char **arguments, int arg_count) {
-    // Free each argument string
-    for (int i = 0; i < arg_count; i++) {
-        free(arguments[i]);
+// Add the stages' usage to the session Stats, and print it for a Time job
+void account_job(struct Job *job, int launched) {
+    struct StageUsage total;
+    memset(&total, 0, sizeof(total));
+    double first = 0, last = 0;
+    for (int i = 0; i < launched; i++) {
+        struct Stage *stage = &job->stages[i];
+        if (stage->pid < 0) continue; // never started
+        struct StageUsage *u = &stage->usage;
+        stats_record(stage->program, u);
+        if (job->timed) stats_print_usage(mtderr, stage->program, u);
+
+        if (first == 0 || stage->start < first) first = stage->start;
+        if (stage->start + u->wall > last) last = stage->start + u->wall;
+        total.user += u->user;
+        total.sys += u->sys;
+        if (u->max_rss > total.max_rss) total.max_rss = u->max_rss;
+        total.voluntary += u->voluntary;
+        total.involuntary += u->involuntary;
+        total.rchar += u->rchar;
+        total.wchar += u->wchar;
+    }
+    if (job->timed && launched > 1) {
+        total.wall = last - first;
+        stats_print_usage(mtderr, "(job)", &total);
+    }
+}
+
+// Report how the stages ended; the last stage's status becomes last_status
+void report_job(struct Job *job, int launched) {
+    if (launched == 0) {
+        last_status = 1;
+        return;
+    }
+    struct Stage *last = &job->stages[launched - 1];
+    last_status = WIFEXITED(last->status) ? WEXITSTATUS(last->status) : 128 + WTERMSIG(last->status);
+    if (quiet_jobs) return;
+
+    // a single stage without redirection keeps the original message
+    if (job->count == 1 && job->input_file == NULL && job->in_mem == NULL && job->output_file == NULL &&
+        job->tcp_host == NULL && job->out_mem == NULL) {
+        mputs(mtdout, "Child process has finished.\n", 29);
+        return;
     }
+    if (job->count == 1 && last_status == 0) return;
 
-    // Free the array of pointers itself
-    free(arguments);
+    for (int i = 0; i < launched; i++) {
+        struct Stage *stage = &job->stages[i];
+        mputs(mtdout, "Stage ", 6);
+        mputi(mtdout, i + 1);
+        mputs(mtdout, " (", 2);
+        mputs(mtdout, stage->program, strlen(stage->program));
+        if (WIFEXITED(stage->status)) {
+            mputs(mtdout, "): exit ", 8);
+            mputi(mtdout, WEXITSTATUS(stage->status));
+        } else {
+            mputs(mtdout, "): signal ", 10);
+            mputi(mtdout, WTERMSIG(stage->status));
+        }
+        mputc(mtdout, '\n');
+    }
 }
 
-int main() {
+int main(int argc, char *argv[]) {
     
     minit();
+
+    // myshell -f jobs.txt [-j N] [-k] runs the file's commands in parallel and exits
+    const char *batch_file = NULL;
+    int workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int ordered = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) batch_file = argv[++i];
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) workers = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-k") == 0) ordered = 1;
+        else {
+            mputs(mtderr, "Usage: myshell [-f <file> [-j N] [-k]]\n", 39);
+            return 1;
+        }
+    }
+    if (batch_file != NULL) return run_batch_file(batch_file, workers, ordered);
+
     init_shell();
+    history_ready = (history_open(&history, NULL) == 0);
+
+    // SIGCHLD is only taken through a signalfd, so finished background jobs
+    // wake the loop below instead of interrupting a command
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    int sigfd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+
     print_prompt();
 
     char *input_command;
     int length;
+    struct pollfd fds[2] = { { STDIN_FILENO, POLLIN, 0 }, { sigfd, POLLIN, 0 } };
 
-    while ((input_command = mgetline(mtdin, &length))) {
-        parse_and_execute_command(input_command);
-        print_prompt();
+    while (1) {
+        if (poll(fds, (sigfd != -1) ? 2 : 1, -1) == -1) continue;
+
+        if (sigfd != -1 && (fds[1].revents & POLLIN)) {
+            struct signalfd_siginfo info;
+            while (read(sigfd, &info, sizeof(info)) == sizeof(info)) {
+            }
+            if (reap_children() > 0) print_prompt();
+        }
+
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            input_command = mgetline(mtdin, &length);
+            if (input_command == NULL) break;
+            // History and Rerun themselves are not recorded; Rerun records what it runs
+            if (history_ready && input_command[0] != '\0' && strncmp(input_command, "History", 7) != 0 &&
+                strncmp(input_command, "Rerun", 5) != 0) {
+                history_add(&history, input_command, strlen(input_command));
+            }
+            parse_and_execute_command(input_command);
+            free(input_command);
+            print_prompt();
+        }
     }
 
+    // end of input: let the background jobs finish and report them
+    wait_jobs(NULL);
     return 0;
 }
@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include "stats.h"
+
+// Session totals of one command name
+struct CommandStats {
+    unsigned int hash;
+    char *name;
+    long runs;
+    struct StageUsage total;   // max_rss holds the largest seen
+    long histogram[STATS_HISTOGRAM];
+    struct CommandStats *next;
+};
+
+static struct CommandStats *command_table[STATS_BUCKETS];
+
+static unsigned int name_hash(const char *s) {
+    unsigned int h = 2166136261u;  // FNV-1a
+    while (*s != '\0') {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void stats_write(MILE *out, const char *text) {
+    mputs(out, text, (int)strlen(text));
+}
+
+static void format_bytes(char *out, int size, long bytes) {
+    if (bytes >= (1L << 20)) snprintf(out, size, "%.1fMB", bytes / 1048576.0);
+    else if (bytes >= 1024) snprintf(out, size, "%.1fKB", bytes / 1024.0);
+    else snprintf(out, size, "%ldB", bytes);
+}
+
+void stats_read_io(pid_t pid, long *rchar, long *wchar) {
+    char path[64], buf[512];
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return;
+    int n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) return;
+    buf[n] = '\0';
+
+    char *p = strstr(buf, "rchar:");
+    if (p != NULL) *rchar = atol(p + 6);
+    p = strstr(buf, "wchar:");
+    if (p != NULL) *wchar = atol(p + 6);
+}
+
+void stats_from_rusage(struct StageUsage *u, const struct rusage *ru) {
+    u->user = ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6;
+    u->sys = ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+    u->max_rss = ru->ru_maxrss;
+    u->voluntary = ru->ru_nvcsw;
+    u->involuntary = ru->ru_nivcsw;
+}
+
+pid_t stats_wait(pid_t pid, int *status, int options, struct StageUsage *usage) {
+    siginfo_t info;
+    memset(&info, 0, sizeof(info));
+    if (waitid((pid == -1) ? P_ALL : P_PID, (pid == -1) ? 0 : (id_t)pid, &info, WEXITED | WNOWAIT | options) == -1) return -1;
+    if (info.si_pid == 0) return 0;
+
+    // /proc/<pid>/io is gone once the zombie is reaped
+    usage->rchar = usage->wchar = 0;
+    stats_read_io(info.si_pid, &usage->rchar, &usage->wchar);
+
+    struct rusage ru;
+    pid_t reaped = wait4(info.si_pid, status, 0, &ru);
+    if (reaped > 0) stats_from_rusage(usage, &ru);
+    return reaped;
+}
+
+void stats_snapshot(struct StatsSnapshot *s) {
+    getrusage(RUSAGE_SELF, &s->usage);
+    s->rchar = s->wchar = 0;
+    stats_read_io(getpid(), &s->rchar, &s->wchar);
+}
+
+void stats_since(const struct StatsSnapshot *s, struct StageUsage *u) {
+    struct StatsSnapshot now;
+    stats_snapshot(&now);
+    struct StageUsage before;
+    stats_from_rusage(&before, &s->usage);
+    stats_from_rusage(u, &now.usage);
+    u->user -= before.user;
+    u->sys -= before.sys;
+    u->voluntary -= before.voluntary;
+    u->involuntary -= before.involuntary;
+    u->rchar = now.rchar - s->rchar;
+    u->wchar = now.wchar - s->wchar;
+}
+
+static int histogram_bucket(double wall) {
+    long us = (long)(wall * 1e6);
+    int b = 0;
+    while (us > 1 && b < STATS_HISTOGRAM - 1) {
+        us >>= 1;
+        b++;
+    }
+    return b;
+}
+
+// Upper bound of the bucket holding the given fraction of the runs, in ms
+static double histogram_percentile(const struct CommandStats *c, double fraction) {
+    long rank = (long)(c->runs * fraction);
+    long seen = 0;
+    for (int b = 0; b < STATS_HISTOGRAM; b++) {
+        seen += c->histogram[b];
+        if (seen > rank) return (double)(2L << b) / 1000;
+    }
+    return (double)(2L << (STATS_HISTOGRAM - 1)) / 1000;
+}
+
+void stats_record(const char *name, const struct StageUsage *u) {
+    unsigned int h = name_hash(name);
+    struct CommandStats *c = command_table[h % STATS_BUCKETS];
+    while (c != NULL && (c->hash != h || strcmp(c->name, name) != 0)) c = c->next;
+    if (c == NULL) {
+        c = (struct CommandStats *)calloc(1, sizeof(struct CommandStats));
+        if (c == NULL) return;
+        c->hash = h;
+        c->name = strdup(name);
+        c->next = command_table[h % STATS_BUCKETS];
+        command_table[h % STATS_BUCKETS] = c;
+    }
+
+    c->runs++;
+    c->total.wall += u->wall;
+    c->total.user += u->user;
+    c->total.sys += u->sys;
+    if (u->max_rss > c->total.max_rss) c->total.max_rss = u->max_rss;
+    c->total.voluntary += u->voluntary;
+    c->total.involuntary += u->involuntary;
+    c->total.rchar += u->rchar;
+    c->total.wchar += u->wchar;
+    c->histogram[histogram_bucket(u->wall)]++;
+}
+
+void stats_print_usage(MILE *out, const char *name, const struct StageUsage *u) {
+    char line[256], in[24], written[24];
+    format_bytes(in, sizeof(in), u->rchar);
+    format_bytes(written, sizeof(written), u->wchar);
+    snprintf(line, sizeof(line), "%-16s real %8.3fs  user %7.3fs  sys %7.3fs  maxrss %7ldKB  ctxsw %ld/%ld  read %s  written %s\n",
+             name, u->wall, u->user, u->sys, u->max_rss, u->voluntary, u->involuntary, in, written);
+    stats_write(out, line);
+}
+
+static void print_histogram(MILE *out, const struct CommandStats *c) {
+    long most = 0;
+    for (int b = 0; b < STATS_HISTOGRAM; b++) {
+        if (c->histogram[b] > most) most = c->histogram[b];
+    }
+    for (int b = 0; b < STATS_HISTOGRAM; b++) {
+        if (c->histogram[b] == 0) continue;
+        char line[160], bar[41];
+        int width = (int)(c->histogram[b] * 40 / most);
+        memset(bar, '#', width);
+        bar[width] = '\0';
+        snprintf(line, sizeof(line), "  < %10.3f ms %8ld %s\n", (double)(2L << b) / 1000, c->histogram[b], bar);
+        stats_write(out, line);
+    }
+}
+
+void stats_print(MILE *out, const char *name) {
+    char line[256];
+    stats_write(out, "command           runs   mean ms  p50 ms<  p99 ms<   user s    sys s  maxrss KB   ctxsw      read   written\n");
+
+    int found = 0;
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+        for (struct CommandStats *c = command_table[i]; c != NULL; c = c->next) {
+            if (name != NULL && strcmp(c->name, name) != 0) continue;
+            found = 1;
+
+            char in[24], written[24];
+            format_bytes(in, sizeof(in), c->total.rchar);
+            format_bytes(written, sizeof(written), c->total.wchar);
+            snprintf(line, sizeof(line), "%-16s %5ld %9.3f %8.3f %8.3f %8.3f %8.3f %10ld %7ld %9s %9s\n",
+                     c->name, c->runs, c->total.wall / c->runs * 1000, histogram_percentile(c, 0.5),
+                     histogram_percentile(c, 0.99), c->total.user, c->total.sys, c->total.max_rss,
+                     c->total.voluntary + c->total.involuntary, in, written);
+            stats_write(out, line);
+            if (name != NULL) print_histogram(out, c);
+        }
+    }
+    if (name != NULL && !found) stats_write(out, "No runs recorded for that command\n");
+}
+
+void stats_reset(void) {
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+        struct CommandStats *c = command_table[i];
+        while (c != NULL) {
+            struct CommandStats *next = c->next;
+            free(c->name);
+            free(c);
+            c = next;
+        }
+        command_table[i] = NULL;
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef STATS_H_
+#define STATS_H_
+#include <sys/types.h>
+#include <sys/resource.h>
+#include "mio.h"
+
+#define STATS_BUCKETS 64       // buckets of the command name table
+#define STATS_HISTOGRAM 32     // log2 buckets of wall time, bucket b holds [2^b, 2^(b+1)) us
+
+// Resources used by one stage
+struct StageUsage {
+    double wall;               // seconds from launch to reap
+    double user, sys;          // CPU seconds
+    long max_rss;              // KB
+    long voluntary, involuntary;  // context switches
+    long rchar, wchar;         // bytes read and written, from /proc/<pid>/io
+};
+
+// Usage of the calling process at one point, for stages run inside the shell
+struct StatsSnapshot {
+    struct rusage usage;
+    long rchar, wchar;
+};
+
+// Reap pid (-1 for any child) like waitpid, reading its I/O counters while it
+// is still a zombie and its rusage through wait4. Returns the pid, 0 when
+// WNOHANG is given and no child is ready, -1 on error. wall is left to the caller.
+pid_t stats_wait(pid_t pid, int *status, int options, struct StageUsage *usage);
+void stats_from_rusage(struct StageUsage *u, const struct rusage *ru);
+void stats_read_io(pid_t pid, long *rchar, long *wchar);
+void stats_snapshot(struct StatsSnapshot *s);
+void stats_since(const struct StatsSnapshot *s, struct StageUsage *u);
+
+// Session totals and latency histograms per command name
+void stats_record(const char *name, const struct StageUsage *u);
+void stats_print_usage(MILE *out, const char *name, const struct StageUsage *u);  // one line, for Time
+void stats_print(MILE *out, const char *name);   // table of all commands, or one command's histogram
+void stats_reset(void);
+
+#endif
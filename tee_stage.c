@@ -0,0 +1,271 @@
+#define _GNU_SOURCE  // splice, tee, memfd_create
+#include <stdio.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include "tee_stage.h"
+
+// Close a sink that has everything, or has failed; its reader sees the end
+// of the data now rather than when the slowest sink is done
+static void finish_sink(struct TeeSink *s) {
+    if (s->fd >= 0) {
+        fcntl(s->fd, F_SETFL, s->flags);
+        close(s->fd);
+        s->fd = -1;
+    }
+    if (s->spill != -1) {
+        close(s->spill);
+        s->spill = -1;
+    }
+    s->closed = 1;
+}
+
+static int sink_failed(struct TeeSink *s, MILE *err) {
+    int error = errno;
+    finish_sink(s);
+    if (error == EPIPE || error == ECONNRESET) return 0; // the reader is done, as for any pipe
+    char line[256];
+    int length = snprintf(line, sizeof(line), "Tee: %s: %s\n", s->name, strerror(error));
+    mputs(err, line, length);
+    return -1;
+}
+
+static long backlog(const struct TeeSink *s) {
+    return s->spill_end - s->spill_sent;
+}
+
+// Throw away n bytes of a pipe
+static void discard(int pipe_rd, int null_fd, long n) {
+    while (n > 0) {
+        ssize_t k = splice(pipe_rd, NULL, null_fd, NULL, n, SPLICE_F_MOVE);
+        if (k <= 0) return;
+        n -= k;
+    }
+}
+
+static int open_spill(struct TeeSink *s) {
+    if (s->spill == -1) s->spill = memfd_create("myshell-tee", MFD_CLOEXEC);
+    return (s->spill == -1) ? -1 : 0;
+}
+
+static char copy_buffer[TEE_CHUNK];
+
+// Pass up to a chunk of pipe_rd through user space to a sink the kernel can
+// not splice into; what the sink does not take now goes to its spill file.
+// *n counts down what has been taken from the pipe.
+static int copy_chunk(struct TeeSink *s, int pipe_rd, long *n) {
+    ssize_t got;
+    do {
+        got = read(pipe_rd, copy_buffer, (*n < TEE_CHUNK) ? *n : TEE_CHUNK);
+    } while (got == -1 && errno == EINTR);
+    if (got <= 0) return -1;
+    *n -= got;
+    ssize_t sent = 0;
+    while (sent < got) {
+        ssize_t k = write(s->fd, copy_buffer + sent, got - sent);
+        if (k > 0) sent += k;
+        else if (k == -1 && errno == EAGAIN) break;
+        else if (k != -1 || errno != EINTR) return -1;
+    }
+    if (sent == got) return 0;
+    if (open_spill(s) == -1 || pwrite(s->spill, copy_buffer + sent, got - sent, s->spill_end) != got - sent) return -1;
+    s->spill_end += got - sent;
+    return 0;
+}
+
+// Move n bytes at the head of pipe_rd to the sink, or to its spill file for
+// what the sink does not take now
+static int deliver(struct TeeSink *s, int pipe_rd, long n, int null_fd, MILE *err) {
+    int result = 0;
+    if (s->closed) {
+        discard(pipe_rd, null_fd, n);
+        return 0;
+    }
+    while (n > 0 && backlog(s) == 0) {
+        if (s->copy) {
+            if (copy_chunk(s, pipe_rd, &n) == 0) continue;
+            result = sink_failed(s, err);
+            discard(pipe_rd, null_fd, n);
+            return result;
+        }
+        ssize_t k = splice(pipe_rd, NULL, s->fd, NULL, n, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (k > 0) {
+            n -= k;
+        } else if (k == -1 && errno == EINTR) {
+            continue;
+        } else if (k == -1 && errno == EAGAIN) {
+            break;
+        } else if (k == -1 && errno == EINVAL) {
+            s->copy = 1; // a file opened for append
+        } else {
+            result = sink_failed(s, err);
+            discard(pipe_rd, null_fd, n);
+            return result;
+        }
+    }
+    if (n == 0) return 0;
+
+    if (open_spill(s) == -1) {
+        result = sink_failed(s, err);
+        discard(pipe_rd, null_fd, n);
+        return result;
+    }
+    while (n > 0) {
+        loff_t offset = s->spill_end;
+        ssize_t k = splice(pipe_rd, NULL, s->spill, &offset, n, SPLICE_F_MOVE);
+        if (k == -1 && errno == EINTR) continue;
+        if (k <= 0) {
+            result = sink_failed(s, err);
+            discard(pipe_rd, null_fd, n);
+            return result;
+        }
+        s->spill_end += k;
+        n -= k;
+    }
+    return 0;
+}
+
+// Send what the sink can take now from its spill file
+static int drain(struct TeeSink *s, MILE *err) {
+    while (!s->closed && backlog(s) > 0) {
+        ssize_t k;
+        if (!s->copy) {
+            off_t offset = s->spill_sent;
+            k = sendfile(s->fd, s->spill, &offset, backlog(s));
+            if (k == -1 && errno == EINVAL) {
+                s->copy = 1; // a file opened for append
+                continue;
+            }
+        } else {
+            k = pread(s->spill, copy_buffer, (backlog(s) < TEE_CHUNK) ? backlog(s) : TEE_CHUNK, s->spill_sent);
+            if (k > 0) k = write(s->fd, copy_buffer, k);
+        }
+        if (k > 0) {
+            s->spill_sent += k;
+        } else if (k == -1 && errno == EINTR) {
+            continue;
+        } else if (k == -1 && errno == EAGAIN) {
+            return 0;
+        } else {
+            return sink_failed(s, err);
+        }
+    }
+    if (!s->closed && s->spill_end > 0 && backlog(s) == 0) {
+        // caught up: start the spill file over
+        if (ftruncate(s->spill, 0) == -1) return sink_failed(s, err);
+        s->spill_sent = s->spill_end = 0;
+    }
+    return 0;
+}
+
+// Fill the empty staging pipe with the next chunk; 0 at the end of the input
+static long take_input(int in_fd, int stage_wr, int *can_splice) {
+    while (*can_splice) {
+        ssize_t n = splice(in_fd, NULL, stage_wr, NULL, TEE_CHUNK, SPLICE_F_MOVE);
+        if (n >= 0) return n;
+        if (errno == EINTR) continue;
+        if (errno != EINVAL) return -1;
+        *can_splice = 0;
+    }
+    static char buffer[TEE_CHUNK];
+    ssize_t n;
+    do {
+        n = read(in_fd, buffer, TEE_CHUNK);
+    } while (n == -1 && errno == EINTR);
+    if (n > 0 && write(stage_wr, buffer, n) != n) return -1;
+    return n;
+}
+
+int tee_run(int in_fd, struct TeeSink *sinks, int count, MILE *err) {
+    int stage[2], scratch[2];
+    if (pipe2(stage, O_CLOEXEC) == -1) return -1;
+    if (pipe2(scratch, O_CLOEXEC) == -1) {
+        close(stage[0]);
+        close(stage[1]);
+        return -1;
+    }
+    // a tee into the empty scratch pipe always takes the whole chunk
+    fcntl(stage[1], F_SETPIPE_SZ, TEE_CHUNK);
+    fcntl(scratch[1], F_SETPIPE_SZ, fcntl(stage[1], F_GETPIPE_SZ));
+    int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+
+    // sinks are polled for room; a terminal is left blocking, its flags
+    // are shared with every other process using it
+    for (int i = 0; i < count; i++) {
+        sinks[i].spill = -1;
+        sinks[i].spill_sent = sinks[i].spill_end = 0;
+        sinks[i].closed = 0;
+        sinks[i].copy = 0;
+        sinks[i].flags = fcntl(sinks[i].fd, F_GETFL);
+        if (!isatty(sinks[i].fd)) fcntl(sinks[i].fd, F_SETFL, sinks[i].flags | O_NONBLOCK);
+    }
+
+    struct pollfd *fds = (struct pollfd *)malloc(sizeof(struct pollfd) * (count + 1));
+    int result = (fds != NULL && null_fd != -1) ? 0 : -1;
+    int input_open = 1, can_splice = 1, failed = 0;
+    while (result == 0) {
+        int nfds = 0, open_sinks = 0, waiting = 0;
+        for (int i = 0; i < count; i++) {
+            if (!input_open && backlog(&sinks[i]) == 0) finish_sink(&sinks[i]);
+            if (sinks[i].closed) continue;
+            open_sinks++;
+            if (backlog(&sinks[i]) >= TEE_SPILL_LIMIT) waiting = 1;
+            if (backlog(&sinks[i]) > 0) {
+                fds[nfds].fd = sinks[i].fd;
+                fds[nfds].events = POLLOUT;
+                nfds++;
+            }
+        }
+        if (open_sinks == 0 || (!input_open && nfds == 0)) break;
+        // a sink at the spill limit holds the input back until it catches up
+        int input_slot = -1;
+        if (input_open && !waiting) {
+            input_slot = nfds;
+            fds[nfds].fd = in_fd;
+            fds[nfds].events = POLLIN;
+            nfds++;
+        }
+        if (poll(fds, nfds, -1) == -1) {
+            if (errno == EINTR) continue;
+            result = -1;
+            break;
+        }
+
+        for (int i = 0; i < count; i++) {
+            if (!sinks[i].closed && backlog(&sinks[i]) > 0 && drain(&sinks[i], err) == -1) failed = 1;
+        }
+        if (input_slot == -1 || fds[input_slot].revents == 0) continue;
+
+        long n = take_input(in_fd, stage[1], &can_splice);
+        if (n <= 0) {
+            if (n < 0) result = -1;
+            input_open = 0;
+            continue;
+        }
+        int last = -1;
+        for (int i = 0; i < count; i++) {
+            if (!sinks[i].closed) last = i;
+        }
+        for (int i = 0; i < count; i++) {
+            if (sinks[i].closed) continue;
+            if (i == last) {
+                if (deliver(&sinks[i], stage[0], n, null_fd, err) == -1) failed = 1;
+            } else if (tee(stage[0], scratch[1], n, 0) != n) {
+                result = -1;
+            } else if (deliver(&sinks[i], scratch[0], n, null_fd, err) == -1) {
+                failed = 1;
+            }
+        }
+        if (last == -1) discard(stage[0], null_fd, n);
+    }
+
+    for (int i = 0; i < count; i++) finish_sink(&sinks[i]);
+    free(fds);
+    if (null_fd != -1) close(null_fd);
+    close(stage[0]);
+    close(stage[1]);
+    close(scratch[0]);
+    close(scratch[1]);
+    return (result == -1 || failed) ? -1 : 0;
+}
@@ -0,0 +1,32 @@
+#ifndef TEE_STAGE_H_
+#define TEE_STAGE_H_
+#include "mio.h"
+
+#define TEE_CHUNK (1 << 16)          // bytes taken from the input per round
+#define TEE_SPILL_LIMIT (64L << 20)  // backlog a sink may build before Tee waits for it
+
+// One output of the Tee stage: the next stage (or To target), a file or a
+// connection. A sink that can not keep up gets a memfd spill file; what it
+// has not taken yet is appended there and sent from there once the sink is
+// writable again, so the other sinks are fed at their own pace.
+struct TeeSink {
+    int fd;
+    const char *name;          // for error messages
+    int spill;                 // memfd of the backlog, -1 until the first one
+    long spill_sent, spill_end;
+    int closed;                // finished, failed, or the reader went away
+    int flags;                 // file status flags to restore
+    int copy;                  // takes neither splice nor sendfile, so written from a buffer
+};
+
+// Copy everything in_fd delivers to every sink, without copying it through
+// user space: each chunk is spliced into a staging pipe, duplicated with
+// tee(2) for all sinks but the last and spliced out to each. Input the kernel
+// can not splice (a terminal), and sinks it can not splice into (a file opened
+// for append), are read and written instead. Each sink's fd is
+// closed as soon as it has everything, so a fast reader sees the end of the
+// data without waiting for a slow one. Returns 0, or -1 if a sink failed for
+// any reason other than its reader closing.
+int tee_run(int in_fd, struct TeeSink *sinks, int count, MILE *err);
+
+#endif
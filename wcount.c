@@ -0,0 +1,284 @@
+#include "wcount.h"
+
+// FNV-1a hash of a string of known length
+unsigned int wc_hash(const char *s, int len) {
+    unsigned int h = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Round a requested bucket count up to a power of two
+static int wc_round_buckets(int n) {
+    int size = 16;
+    while (size < n) size <<= 1;
+    return size;
+}
+
+static int wc_table_init(struct WordTable *t, int nbuckets) {
+    t->nbuckets = wc_round_buckets(nbuckets > 0 ? nbuckets : WC_BUCKETS);
+    t->buckets = (struct WordNode **)calloc(t->nbuckets, sizeof(struct WordNode *));
+    t->size = 0;
+    t->head = NULL;
+    return (t->buckets == NULL) ? -1 : 0;
+}
+
+// Double the bucket array once the chains get long, nodes are relinked in place
+static void wc_table_grow(struct WordTable *t) {
+    int nbuckets = t->nbuckets * 2;
+    struct WordNode **buckets = (struct WordNode **)calloc(nbuckets, sizeof(struct WordNode *));
+    if (buckets == NULL) return; // keep the old (slower) table
+
+    for (struct WordNode *n = t->head; n != NULL; n = n->next) {
+        int b = n->hash & (nbuckets - 1);
+        n->chain = buckets[b];
+        buckets[b] = n;
+    }
+    free(t->buckets);
+    t->buckets = buckets;
+    t->nbuckets = nbuckets;
+}
+
+// Find a key in the table and bump its count, inserting it if it is new
+struct WordNode *wc_table_add(struct WordTable *t, const char *word, int len, unsigned int hash) {
+    int b = hash & (t->nbuckets - 1);
+    for (struct WordNode *n = t->buckets[b]; n != NULL; n = n->chain) {
+        if (n->hash == hash && n->len == len && memcmp(n->word, word, len) == 0) {
+            n->count++;
+            return n;
+        }
+    }
+
+    struct WordNode *n = (struct WordNode *)malloc(sizeof(struct WordNode) + len + 1);
+    if (n == NULL) return NULL;
+    n->hash = hash;
+    n->len = len;
+    n->count = 1;
+    memcpy(n->word, word, len);
+    n->word[len] = '\0';
+
+    n->chain = t->buckets[b];
+    t->buckets[b] = n;
+    n->next = t->head;     // newest first, like the original linked list
+    t->head = n;
+
+    t->size++;
+    if (t->size > t->nbuckets * 2) wc_table_grow(t);
+    return n;
+}
+
+static void wc_table_free(struct WordTable *t) {
+    struct WordNode *current = t->head;
+    while (current != NULL) {
+        struct WordNode *temp = current;
+        current = current->next;
+        free(temp);
+    }
+    free(t->buckets);
+    t->buckets = NULL;
+    t->head = NULL;
+}
+
+// Make sure a growable buffer can hold 'need' bytes
+static int wc_reserve(char **buf, int *cap, int need) {
+    if (need <= *cap) return 0;
+    int size = (*cap > 0) ? *cap : 64;
+    while (size < need) size *= 2;
+    char *p = (char *)realloc(*buf, size);
+    if (p == NULL) return -1;
+    *buf = p;
+    *cap = size;
+    return 0;
+}
+
+int wc_init(struct WordCounter *wc, int reports, int word_buckets, int bigram_buckets, MILE *out) {
+    memset(wc, 0, sizeof(*wc));
+    wc->reports = reports;
+    wc->out = out;
+
+    // WC_RUNNING needs the word table for its counts
+    if (reports & (WC_WORDS | WC_RUNNING)) {
+        if (wc_table_init(&wc->words, word_buckets) == -1) return -1;
+    }
+    if (reports & WC_BIGRAMS) {
+        if (wc_table_init(&wc->bigrams, bigram_buckets) == -1) return -1;
+    }
+    return 0;
+}
+
+void wc_free(struct WordCounter *wc) {
+    wc_table_free(&wc->words);
+    wc_table_free(&wc->bigrams);
+    free(wc->tok);
+    free(wc->prev);
+    wc->tok = NULL;
+    wc->prev = NULL;
+}
+
+// Count one word whose hash is already known
+static void wc_word_hashed(struct WordCounter *wc, const char *word, int len, unsigned int hash) {
+    wc->total_words++;
+
+    if (wc->words.buckets != NULL) {
+        struct WordNode *n = wc_table_add(&wc->words, word, len, hash);
+        if (n != NULL && (wc->reports & WC_RUNNING)) {
+            mputi(wc->out, n->count);
+            mputc(wc->out, ',');
+            mputc(wc->out, ' ');
+            mputs(wc->out, word, len);
+            mputc(wc->out, '\n');
+        }
+    }
+
+    if (wc->reports & WC_BIGRAMS) {
+        // Build "prev word" behind the saved previous word, then keep this word as prev
+        if (wc_reserve(&wc->prev, &wc->prevcap, wc->prevlen + 1 + len) == -1) return;
+        if (wc->has_prev) {
+            wc->prev[wc->prevlen] = ' ';
+            memcpy(wc->prev + wc->prevlen + 1, word, len);
+            wc_table_add(&wc->bigrams, wc->prev, wc->prevlen + 1 + len, wc->prevhash * 31u + hash);
+        }
+        memcpy(wc->prev, word, len);
+        wc->prevlen = len;
+        wc->prevhash = hash;
+        wc->has_prev = 1;
+    }
+}
+
+void wc_word(struct WordCounter *wc, const char *word, int len) {
+    if (len <= 0) return;
+    wc_word_hashed(wc, word, len, wc_hash(word, len));
+}
+
+// Tokenize a block of raw input, words may span consecutive blocks
+void wc_feed(struct WordCounter *wc, const char *buf, int len) {
+    int stats = wc->reports & (WC_CHARS | WC_LINES);
+    int start = -1;             // start of the current token within buf, -1 if none
+    unsigned int h = wc->tokhash;
+
+    wc->bytes += len;
+
+    for (int i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)buf[i];
+        if (stats) {
+            wc->chars[c]++;
+            if (c == MNLINE) wc->lines++;
+        }
+
+        if (M_ISWS(c)) {
+            if (start >= 0 || wc->toklen > 0) {
+                if (wc->toklen > 0) {
+                    // token began in an earlier block
+                    if (start >= 0) {
+                        if (wc_reserve(&wc->tok, &wc->tokcap, wc->toklen + (i - start)) == -1) return;
+                        memcpy(wc->tok + wc->toklen, buf + start, i - start);
+                        wc->toklen += i - start;
+                    }
+                    wc_word_hashed(wc, wc->tok, wc->toklen, h);
+                    wc->toklen = 0;
+                } else {
+                    wc_word_hashed(wc, buf + start, i - start, h);
+                }
+                start = -1;
+            }
+            h = 2166136261u;
+            continue;
+        }
+
+        if (start < 0) {
+            start = i;
+            if (wc->toklen == 0) h = 2166136261u;
+        }
+        h ^= c;
+        h *= 16777619u;
+    }
+
+    // carry the unfinished token over to the next block
+    if (start >= 0) {
+        if (wc_reserve(&wc->tok, &wc->tokcap, wc->toklen + (len - start)) == -1) return;
+        memcpy(wc->tok + wc->toklen, buf + start, len - start);
+        wc->toklen += len - start;
+    }
+    wc->tokhash = (wc->toklen > 0) ? h : 2166136261u;
+}
+
+// Flush the token left over at end of input
+void wc_finish(struct WordCounter *wc) {
+    if (wc->toklen > 0) {
+        wc_word_hashed(wc, wc->tok, wc->toklen, wc->tokhash);
+        wc->toklen = 0;
+    }
+    wc->tokhash = 2166136261u;
+}
+
+static void wc_print_table(const struct WordTable *t, MILE *out) {
+    for (struct WordNode *n = t->head; n != NULL; n = n->next) {
+        mputs(out, n->word, n->len);
+        mputc(out, ':');
+        mputc(out, ' ');
+        mputi(out, n->count);
+        mputc(out, '\n');
+    }
+}
+
+static void wc_print_label(MILE *out, const char *label, long val) {
+    mputs(out, label, (int)strlen(label));
+    mputl(out, val);
+    mputc(out, '\n');
+}
+
+static void wc_print_chars(const struct WordCounter *wc, MILE *out) {
+    static const char hex[] = "0123456789abcdef";
+    for (int c = 0; c < 256; c++) {
+        if (wc->chars[c] == 0) continue;
+        mputc(out, '\'');
+        if (c == MNLINE) {
+            mputs(out, "\\n", 2);
+        } else if (c == MTAB) {
+            mputs(out, "\\t", 2);
+        } else if (c == MCRET) {
+            mputs(out, "\\r", 2);
+        } else if (c < 32 || c > 126) {
+            mputs(out, "\\x", 2);
+            mputc(out, hex[c >> 4]);
+            mputc(out, hex[c & 15]);
+        } else {
+            mputc(out, (char)c);
+        }
+        mputs(out, "': ", 3);
+        mputl(out, wc->chars[c]);
+        mputc(out, '\n');
+    }
+}
+
+void wc_report(struct WordCounter *wc, MILE *out) {
+    if (wc->reports & WC_RUNNING) mputc(out, '\n');
+
+    if (wc->reports & WC_LINES) {
+        wc_print_label(out, "Lines = ", wc->lines);
+        wc_print_label(out, "Bytes = ", wc->bytes);
+        wc_print_label(out, "Words = ", wc->total_words);
+        mputc(out, '\n');
+    }
+
+    if (wc->reports & WC_WORDS) {
+        wc_print_table(&wc->words, out);
+        mputc(out, '\n');
+    }
+
+    if (wc->reports & WC_BIGRAMS) {
+        wc_print_table(&wc->bigrams, out);
+        mputc(out, '\n');
+    }
+
+    if (wc->reports & WC_CHARS) {
+        wc_print_chars(wc, out);
+        mputc(out, '\n');
+    }
+
+    if (wc->reports & WC_TOTAL) {
+        wc_print_label(out, "Total WordCount = ", wc->total_words);
+    }
+}
@@ -0,0 +1,69 @@
+#ifndef WCOUNT_H_
+#define WCOUNT_H_
+#include "mio.h"
+
+// Report selection flags for a WordCounter
+#define WC_RUNNING 0x01    // running "count, word" line for every word
+#define WC_WORDS   0x02    // word frequency table
+#define WC_BIGRAMS 0x04    // bigram frequency table
+#define WC_CHARS   0x08    // byte value histogram
+#define WC_LINES   0x10    // line/byte/word totals
+#define WC_TOTAL   0x20    // "Total WordCount = N" trailer
+
+// Default report set, matches the original word_counter output
+#define WC_LEGACY (WC_RUNNING | WC_WORDS | WC_TOTAL)
+
+#define WC_BUCKETS 1024    // default bucket count for a frequency table
+
+// One entry of a frequency table, the key is stored inline after the node
+struct WordNode {
+    unsigned int hash;
+    int len;
+    int count;
+    struct WordNode *next;     // insertion order list (newest first)
+    struct WordNode *chain;    // hash bucket chain
+    char word[];
+};
+
+struct WordTable {
+    struct WordNode **buckets;
+    int nbuckets;              // always a power of two
+    int size;
+    struct WordNode *head;
+};
+
+struct WordCounter {
+    int reports;
+    struct WordTable words, bigrams;
+    long chars[256];
+    long lines, bytes, total_words;
+
+    char *tok;                 // partial token carried across feeds
+    int toklen, tokcap;
+    unsigned int tokhash;
+
+    char *prev;                // previous word, for bigrams
+    int prevlen, prevcap;
+    unsigned int prevhash;
+    int has_prev;
+
+    MILE *out;                 // destination of WC_RUNNING lines
+};
+
+// init/free
+int wc_init(struct WordCounter *wc, int reports, int word_buckets, int bigram_buckets, MILE *out);
+void wc_free(struct WordCounter *wc);
+
+// input, either raw bytes or already split words
+void wc_feed(struct WordCounter *wc, const char *buf, int len);
+void wc_word(struct WordCounter *wc, const char *word, int len);
+void wc_finish(struct WordCounter *wc);
+
+// output of every selected summary report
+void wc_report(struct WordCounter *wc, MILE *out);
+
+// table helpers
+unsigned int wc_hash(const char *s, int len);
+struct WordNode *wc_table_add(struct WordTable *t, const char *word, int len, unsigned int hash);
+
+#endif
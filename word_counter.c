@@ -1,99 +1,84 @@
 #include "mio.h"
+#include "wcount.h"
+
+#define WC_READSIZE 65536    // bytes read from standard in per block
+
+// Print the accepted options to standard error
+void print_usage() {
+    const char* usage = "Usage: word_counter [-w] [-b] [-c] [-l] [-W buckets] [-B buckets]\n"
+                        "  -w  word frequencies\n"
+                        "  -b  bigram frequencies\n"
+                        "  -c  character histogram\n"
+                        "  -l  line, byte and word totals\n"
+                        "  -W  initial bucket count of the word table\n"
+                        "  -B  initial bucket count of the bigram table\n"
+                        "With no report selected the running word count is printed.\n";
+    mputs(mtderr, usage, (int)strlen(usage));
+}
 
-struct WordNode {
-    char* word;
-    int count;
-    struct WordNode* next;
-};
-
-struct WordList {
-    struct WordNode* head;
-};
+int main(int argc, char* argv[]) {
+    minit(); // Initialize MIO
 
-// Function to find a word in the word list and return its node
-struct WordNode* findWord(struct WordList* list, const char* word) {
-    struct WordNode* current = list->head;
-    while (current != NULL) {
-        if (strcmp(current->word, word) == 0) {
-            return current;
+    int reports = 0;
+    int word_buckets = WC_BUCKETS;
+    int bigram_buckets = WC_BUCKETS;
+
+    // Every selected report is computed in the same pass over the input
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-w") == 0) {
+            reports |= WC_WORDS;
+        } else if (strcmp(argv[i], "-b") == 0) {
+            reports |= WC_BIGRAMS;
+        } else if (strcmp(argv[i], "-c") == 0) {
+            reports |= WC_CHARS;
+        } else if (strcmp(argv[i], "-l") == 0) {
+            reports |= WC_LINES;
+        } else if (strcmp(argv[i], "-W") == 0 && i + 1 < argc) {
+            word_buckets = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-B") == 0 && i + 1 < argc) {
+            bigram_buckets = atoi(argv[++i]);
+        } else {
+            print_usage();
+            return 1;
         }
-        current = current->next;
     }
-    return NULL;
-}
-
-void insertWord(struct WordList* list, const char* word) {
-    struct WordNode* existingNode = findWord(list, word);
-    if (existingNode != NULL) {
-        existingNode->count++;
-    } else {
-        struct WordNode* newNode = (struct WordNode*)malloc(sizeof(struct WordNode));
-        newNode->word = strdup(word);
-        newNode->count = 1;
-        newNode->next = list->head;
-        list->head = newNode;
+    if (reports == 0) reports = WC_LEGACY;
+
+    // Buffered standard out, flushed after every input block
+    MILE* out = mdopen(STDOUT_FILENO, MODE_WA, WC_READSIZE);
+    if (out == NULL) {
+        const char* err_message = "Error opening standard out.\n";
+        mwrite(mtderr, err_message, (int)strlen(err_message));
+        return -1;
     }
-}
 
-void freeWordList(struct WordList* list) {
-    struct WordNode* current = list->head;
-    while (current != NULL) {
-        struct WordNode* temp = current;
-        current = current->next;
-        free(temp->word);
-        free(temp);
+    struct WordCounter counter;
+    if (wc_init(&counter, reports, word_buckets, bigram_buckets, out) == -1) {
+        const char* err_message = "Error allocating the word tables.\n";
+        mwrite(mtderr, err_message, (int)strlen(err_message));
+        return -1;
     }
-}
-
-int main(int argc, char* argv[]) {
-    minit(); // Initialize MIO
 
-    struct WordList wordList = { .head = NULL };
-    int totalWords = 0;
+    char* buffer = (char*)malloc(WC_READSIZE);
+    if (buffer == NULL) return -1;
 
     while (1) {
-        int length;
-        char* word = mgets(mtdin, &length);
-        if (word == NULL)
+        int bytes_read = mread(mtdin, buffer, WC_READSIZE);
+        if (bytes_read <= 0)
             break;
 
-        insertWord(&wordList, word);
-        totalWords++;
-
-        struct WordNode* current = findWord(&wordList, word);
-        mputi(mtdout, current->count);
-        mputc(mtdout, ',');
-        mputc(mtdout, ' ');
-        mputs(mtdout, word, length);
-        mputc(mtdout, '\n');
+        wc_feed(&counter, buffer, bytes_read);
 
         // Flush the output buffer to ensure immediate display
-        mflush(mtdout);
+        mflush(out);
     }
+    wc_finish(&counter);
 
-    mputc(mtdout, '\n');
-
-    struct WordNode* current = wordList.head;
-    while (current != NULL) {
-        mputs(mtdout, current->word, strlen(current->word));
-        mputc(mtdout, ':');
-        mputc(mtdout, ' ');
-        mputi(mtdout, current->count);
-        mputc(mtdout, '\n');
-        current = current->next;
-
-        // Flush the output buffer to ensure immediate display
-        mflush(mtdout);
-    }
-
-    mputc(mtdout, '\n');
-
-    const char* message = "Total WordCount = ";
-    mputs(mtdout, message, strlen(message));
-    mputi(mtdout, totalWords);
-    mputc(mtdout, '\n');
+    wc_report(&counter, out);
+    mflush(out);
 
-    freeWordList(&wordList);
+    wc_free(&counter);
+    free(buffer);
 
     return 0;
 }
@@ -1,125 +1,374 @@
 #include "mio.h"
+#include "wreplace.h"
+#include "acmatch.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
 
-// Function to compare two strings case-insensitively
-int strcasecmp(const char* str1, const char* str2) {
-    while (*str1 != '\0' && *str2 != '\0') {
-        if (tolower(*str1) != tolower(*str2)) {
-            return 0; // Strings are different
+#define WR_READSIZE 65536    // bytes read from standard in per block
+
+// Everything built from one version of the rules file
+struct RuleContext {
+    struct RuleSet rules;
+    struct AcMatcher matcher;   // only built in automaton mode
+    int has_matcher;
+};
+
+// Rules in use, swapped by the reload thread in daemon mode. The reader bumps
+// reader_seq to odd while it holds a context and back to even between blocks,
+// so a retired context can be freed once the count has moved on or is even.
+static _Atomic(struct RuleContext*) current_context;
+static atomic_ulong reader_seq;
+
+// Settings shared with the reload thread
+static const char* rules_path;
+static int use_automaton;
+
+void write_error(const char* message) {
+    mwrite(mtderr, message, (int)strlen(message));
+}
+
+struct RuleContext* context_load(const char* filename, int automaton) {
+    struct RuleContext* ctx = (struct RuleContext*)calloc(1, sizeof(struct RuleContext));
+    if (ctx == NULL) return NULL;
+
+    if (rules_load(&ctx->rules, filename) == -1) {
+        free(ctx);
+        return NULL;
+    }
+    if (automaton) {
+        if (ac_build(&ctx->matcher, &ctx->rules) == -1) {
+            rules_free(&ctx->rules);
+            free(ctx);
+            return NULL;
         }
-        str1++;
-        str2++;
+        ctx->has_matcher = 1;
     }
-    return (*str1 == '\0' && *str2 == '\0'); // Strings are equal if both are null-terminated
+    return ctx;
 }
 
-// Function to search for a word in an array of words and return its index
-int find_word_index(const char* word, const char* word_array[], int word_count) {
-    for (int i = 0; i < word_count; i++) {
-        if (strcasecmp(word, word_array[i])) {
-            return i; // Word found, return its index
-        }
+void context_free(struct RuleContext* ctx) {
+    if (ctx->has_matcher) ac_free(&ctx->matcher);
+    rules_free(&ctx->rules);
+    free(ctx);
+}
+
+// Wait until the reader can no longer hold a context retired before this call
+void synchronize_reader() {
+    unsigned long seq = atomic_load(&reader_seq);
+    if ((seq & 1) == 0) return;
+
+    struct timespec pause = { 0, 1000000 };
+    while (atomic_load(&reader_seq) == seq) nanosleep(&pause, NULL);
+}
+
+// Build the new rules off the stream's path, publish them and free the old ones
+void reload_rules() {
+    struct RuleContext* fresh = context_load(rules_path, use_automaton);
+    if (fresh == NULL) {
+        write_error("Error reloading the rules, keeping the previous ones.\n");
+        return;
     }
-    return -1; // Word not found
+
+    struct RuleContext* old = atomic_exchange(&current_context, fresh);
+    synchronize_reader();
+    context_free(old);
 }
 
-int main(int argc, char* argv[]) {
-    // Initialize custom I/O streams
-    minit();
+// Reload thread: waits for SIGHUP or for the rules file to be rewritten
+void* reload_thread(void* arg) {
+    int sigfd = *(int*)arg;
 
-    // Check if the correct number of arguments is provided
-    if (argc != 2) {
-        const char* error_message = "Provide a single filename as an argument.\n";
-        mwrite(mtderr, error_message, (int)strlen(error_message));
-        return 1;
+    // watch the directory, editors and --compile replace the file by renaming
+    int len = (int)strlen(rules_path);
+    char* dir = strdup(rules_path);
+    const char* base = rules_path;
+    for (int i = len - 1; i >= 0; i--) {
+        if (rules_path[i] == '/') {
+            base = rules_path + i + 1;
+            dir[i > 0 ? i : 1] = '\0';
+            break;
+        }
     }
+    if (base == rules_path) strcpy(dir, ".");
 
-    // open the word replacement file given in the argument
-    MILE* my_file = mopen(argv[1], MODE_R, MBSIZE);
-    if (my_file == NULL) {
-        const char* err_message = "Error opening the provided file.\n";
-        mwrite(mtderr, err_message, (int)strlen(err_message));
-        return -1;
+    int infd = inotify_init1(IN_CLOEXEC);
+    if (infd != -1 && inotify_add_watch(infd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+        write_error("Error watching the rules file, reloading on SIGHUP only.\n");
+        close(infd);
+        infd = -1;
     }
+    free(dir);
 
-    char** targets = NULL;       // initialize arrays of strings
-    char** replacements = NULL;
-    int target_count = 0;        // counters to keep track of # of elements in the array
-    int replacement_count = 0;
-    int pairs_count = 0;
+    struct pollfd fds[2] = { { sigfd, POLLIN, 0 }, { infd, POLLIN, 0 } };
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
 
-    // loop to read replacements text file into two arrays
     while (1) {
-        char* target_str;
-        int length;
-        int new_size;
+        if (poll(fds, (infd != -1) ? 2 : 1, -1) == -1) continue;
+        int reload = 0;
+
+        if (fds[0].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            if (read(sigfd, &info, sizeof(info)) == sizeof(info)) reload = 1;
+        }
+
+        if (infd != -1 && (fds[1].revents & POLLIN)) {
+            int n = read(infd, events, sizeof(events));
+            for (int off = 0; off < n;) {
+                struct inotify_event* ev = (struct inotify_event*)(events + off);
+                if (ev->len > 0 && strcmp(ev->name, base) == 0) reload = 1;
+                off += sizeof(struct inotify_event) + ev->len;
+            }
+        }
 
-        target_str = mgets(my_file, &length);              // read in the target string
-        if (target_str == NULL) break;                    // if EOF, break
-        new_size = sizeof(char*) * (target_count + 1);    // calculate new size of array to accommodate string
-        targets = (char**)realloc((void*)targets, new_size);       // expand the array
-        targets[target_count] = target_str;                 // add the new string to the end of the array
-        target_count++;                                  // increment # of elements in array
+        if (reload) reload_rules();
+    }
+    return NULL;
+}
 
-        char* replacement_str = mgets(my_file, &length);              // repeat for the replacement string
-        if (replacement_str == NULL) break;
-        new_size = sizeof(char*) * (replacement_count + 1);
-        replacements = (char**)realloc((void*)replacements, new_size);
-        replacements[replacement_count] = replacement_str;
-        replacement_count++;
+// Replace standard in to standard out. Every block is processed with the
+// context that is current when the block starts.
+int replace_input(int word_bounds) {
+    MILE* out = mdopen(STDOUT_FILENO, MODE_WA, WR_READSIZE);
+    char* buffer = (char*)malloc(WR_READSIZE);
+    if (out == NULL || buffer == NULL) {
+        write_error("Error allocating the replacement buffers.\n");
+        return -1;
+    }
 
-        pairs_count++;                                    // increment # of target/replacement pairs
+    struct RuleContext* used = atomic_load(&current_context);
+    struct Replacer replacer;
+    struct AcStream stream;
+    if (use_automaton) {
+        ac_stream_init(&stream, &used->matcher, &used->rules, word_bounds, out);
+    } else if (replacer_init(&replacer, &used->rules, out) == -1) {
+        write_error("Error allocating the replacement buffers.\n");
+        return -1;
     }
 
-    mclose(my_file);
+    int done = 0;
+    while (!done) {
+        int bytes_read = mread(mtdin, buffer, WR_READSIZE); // blocking here holds no rules
+        if (bytes_read <= 0) done = 1;
 
-    int length = 0;
-    char* input_str;
+        atomic_fetch_add(&reader_seq, 1);
+        struct RuleContext* ctx = atomic_load(&current_context);
+        if (ctx != used) {
+            if (use_automaton) ac_stream_rebind(&stream, &ctx->matcher, &ctx->rules);
+            else replacer.rs = &ctx->rules;
+            used = ctx;
+        }
 
-    while (1) {
-        input_str = mgets(mtdin, &length);   // get a string from standard in
-        if (input_str == NULL) break;        // loop repeats until EOF (mgets returns NULL on EOF)
+        int result = 0;
+        if (done) {
+            if (use_automaton) ac_finish(&stream);
+            else replacer_finish(&replacer);
+        } else if (use_automaton) {
+            result = ac_feed(&stream, buffer, bytes_read);
+        } else {
+            result = replacer_feed(&replacer, buffer, bytes_read);
+        }
+        mflush(out);
+        atomic_fetch_add(&reader_seq, 1);
+
+        if (result == -1) break;
+    }
+
+    if (use_automaton) ac_stream_free(&stream);
+    else replacer_free(&replacer);
+    free(buffer);
+    return 0;
+}
+
+// Read exactly 'size' bytes unless the input ends first
+int read_full(int fd, char* buf, int size) {
+    int total = 0;
+    while (total < size) {
+        int n = read(fd, buf + total, size - total);
+        if (n <= 0) break;
+        total += n;
+    }
+    return total;
+}
+
+int write_full(int fd, const char* buf, int size) {
+    int total = 0;
+    while (total < size) {
+        int n = write(fd, buf + total, size - total);
+        if (n <= 0) return -1;
+        total += n;
+    }
+    return total;
+}
+
+// Growable output of one frame
+struct FrameOutput {
+    char* data;
+    int len, cap;
+    int failed;   // a word could not be stored, the frame is incomplete
+};
 
-        for (int i = 0; i < length; i++) {  // make every character in the string lowercase
-            char* ch = &(input_str[i]);
-            if ((*ch >= 'A') && (*ch <= 'Z'))
-                *ch = *ch - 'A' + 'a';
+// Token sink of framed mode: the word plus the separating space
+void frame_emit(void* arg, const char* word, int len) {
+    struct FrameOutput* out = (struct FrameOutput*)arg;
+    if (out->len + len + 1 > out->cap) {
+        int cap = (out->cap > 0) ? out->cap : WR_READSIZE;
+        while (cap < out->len + len + 1) cap *= 2;
+        char* data = (char*)realloc(out->data, cap);
+        if (data == NULL) {
+            out->failed = 1;
+            return;
         }
+        out->data = data;
+        out->cap = cap;
+    }
+    memcpy(out->data + out->len, word, len);
+    out->data[out->len + len] = MSPACE;
+    out->len += len + 1;
+}
 
-        // remove punctuation
-        char* new_str = (char*)malloc(strlen(input_str));
-        int stripped_length = 0;
-        for (int i = 0; i < length; i++) {
-            char input_char = input_str[i];
-            if ((input_char >= 33 && input_char <= 47) || (input_char >= 58 && input_char <= 64) || (input_char >= 123 && input_char <= 126)) {
-                continue;
+// Framed mode for proc_starter's sharded workers: every input frame is
+// replaced on its own and answered with a frame carrying the same sequence.
+// Returns -1 if a frame could not be answered in full, so the worker exits
+// nonzero rather than leave proc_starter waiting for its output.
+int replace_frames() {
+    struct RuleContext* ctx = atomic_load(&current_context);
+    struct FrameOutput out = { NULL, 0, 0, 0 };
+    struct Replacer replacer;
+    if (replacer_init(&replacer, &ctx->rules, NULL) == -1) {
+        write_error("Error allocating the replacement buffers.\n");
+        return -1;
+    }
+    replacer.emit = frame_emit;
+    replacer.emit_arg = &out;
+
+    char* chunk = NULL;
+    int chunk_cap = 0;
+    int result = 0;
+    struct FrameHeader header;
+    while (1) {
+        int got = read_full(STDIN_FILENO, (char*)&header, sizeof(header));
+        if (got == 0) break; // the end of the input, between frames
+        if (got != sizeof(header)) {
+            write_error("Error reading a frame.\n");
+            result = -1;
+            break;
+        }
+        if ((int)header.len > chunk_cap) {
+            char* p = (char*)realloc(chunk, header.len);
+            if (p == NULL) {
+                write_error("Error allocating a frame.\n");
+                result = -1;
+                break;
             }
-            new_str[stripped_length] = input_char;
-            stripped_length++;
+            chunk = p;
+            chunk_cap = header.len;
+        }
+        if (read_full(STDIN_FILENO, chunk, header.len) != (int)header.len) {
+            write_error("Error reading a frame.\n");
+            result = -1;
+            break;
         }
 
-        new_str = (char*)realloc(new_str, stripped_length * sizeof(char));
+        out.len = 0;
+        if (replacer_feed(&replacer, chunk, header.len) == -1) out.failed = 1;
+        replacer_finish(&replacer);
+        if (out.failed) {
+            write_error("Error allocating the frame output.\n");
+            result = -1;
+            break;
+        }
 
-        int i = find_word_index(new_str, targets, target_count);
-        if (i != -1) {
-            mputs(mtdout, replacements[i], (int)strlen(replacements[i]));
-        } else {
-            mputs(mtdout, new_str, stripped_length);
+        header.len = out.len;
+        if (write_full(STDOUT_FILENO, (const char*)&header, sizeof(header)) == -1 ||
+            write_full(STDOUT_FILENO, out.data, out.len) == -1) {
+            result = -1;
+            break;
+        }
+    }
+
+    replacer_free(&replacer);
+    free(chunk);
+    free(out.data);
+    return result;
+}
+
+int main(int argc, char* argv[]) {
+    // Initialize custom I/O streams
+    minit();
+
+    // --compile turns a rules file into a dictionary that later runs map directly
+    if (argc == 4 && strcmp(argv[1], "--compile") == 0) {
+        struct RuleSet rules;
+        if (rules_load(&rules, argv[2]) == -1) {
+            write_error("Error opening the provided file.\n");
+            return -1;
         }
-        mputc(mtdout, ' ');
+        int result = rules_compile(&rules, argv[3]);
+        rules_free(&rules);
+        if (result == -1) write_error("Error writing the compiled dictionary.\n");
+        return result;
+    }
+
+    // -a replaces targets (including phrases) in the raw stream, -s also inside words,
+    // -d keeps running and reloads the rules on SIGHUP or when the file changes,
+    // -F reads and writes sequence numbered frames (token mode only)
+    int word_bounds = 1;
+    int daemon = 0;
+    int framed = 0;
+    int argi = 1;
+    for (; argi < argc && argv[argi][0] == '-'; argi++) {
+        if (strcmp(argv[argi], "-a") == 0) use_automaton = 1;
+        else if (strcmp(argv[argi], "-s") == 0) word_bounds = 0;
+        else if (strcmp(argv[argi], "-d") == 0) daemon = 1;
+        else if (strcmp(argv[argi], "-F") == 0) framed = 1;
+        else break;
+    }
 
-        free(new_str);
+    // Check if the correct number of arguments is provided
+    if (argc - argi != 1) {
+        write_error("Provide a single filename as an argument.\n");
+        return 1;
     }
+    rules_path = argv[argi];
 
-    // Free all strings in both arrays before ending program
-    for (int i = 0; i < target_count; i++) {
-        free(targets[i]);
+    if (framed && (use_automaton || daemon)) {
+        write_error("-F can not be combined with -a or -d.\n");
+        return 1;
     }
-    free(targets);
 
-    for (int i = 0; i < replacement_count; i++) {
-        free(replacements[i]);
+    // load the word replacement file given in the argument
+    struct RuleContext* ctx = context_load(rules_path, use_automaton);
+    if (ctx == NULL) {
+        write_error("Error opening the provided file.\n");
+        return -1;
     }
-    free(replacements);
+    atomic_store(&current_context, ctx);
 
-    return 0;
+    if (daemon) {
+        // SIGHUP is only taken through the reload thread's signalfd
+        static int sigfd;
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGHUP);
+        pthread_sigmask(SIG_BLOCK, &mask, NULL);
+        sigfd = signalfd(-1, &mask, SFD_CLOEXEC);
+
+        pthread_t thread;
+        if (sigfd == -1 || pthread_create(&thread, NULL, reload_thread, &sigfd) != 0) {
+            write_error("Error starting the reload thread.\n");
+            return -1;
+        }
+        pthread_detach(thread);
+    }
+
+    int result = framed ? replace_frames() : replace_input(word_bounds);
+
+    // the reload thread may still be running, leave the last rules to the exit
+    if (!daemon) context_free(atomic_load(&current_context));
+    return result;
 }
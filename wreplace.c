@@ -0,0 +1,420 @@
+#include <stdio.h>
+#include <sys/mman.h>
+#include "wreplace.h"
+
+#define RULES_FILE_BSIZE 4096    // read buffer used while loading a rules file
+
+// FNV-1a hash of a string of known length
+uint32_t rules_hash(const char *s, int len) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+int rules_init(struct RuleSet *rs) {
+    memset(rs, 0, sizeof(*rs));
+    rs->nslots = 16;
+    rs->slots = (uint32_t *)calloc(rs->nslots, sizeof(uint32_t));
+    return (rs->slots == NULL) ? -1 : 0;
+}
+
+void rules_free(struct RuleSet *rs) {
+    if (rs->map != NULL) {
+        munmap(rs->map, rs->map_len); // rules, slots and pool all live in the mapping
+    } else {
+        free(rs->rules);
+        free(rs->pool);
+        free(rs->slots);
+    }
+    memset(rs, 0, sizeof(*rs));
+}
+
+// Copy a string into the pool, returning its offset or -1
+static int rules_intern(struct RuleSet *rs, const char *s, int len, int lower) {
+    if (rs->pool_len + len + 1 > rs->pool_cap) {
+        int cap = (rs->pool_cap > 0) ? rs->pool_cap : 1024;
+        while (cap < rs->pool_len + len + 1) cap *= 2;
+        char *pool = (char *)realloc(rs->pool, cap);
+        if (pool == NULL) return -1;
+        rs->pool = pool;
+        rs->pool_cap = cap;
+    }
+
+    int offset = rs->pool_len;
+    for (int i = 0; i < len; i++) {
+        char c = s[i];
+        if (lower && c >= 'A' && c <= 'Z') c = c - 'A' + 'a';
+        rs->pool[offset + i] = c;
+    }
+    rs->pool[offset + len] = '\0';
+    rs->pool_len += len + 1;
+    return offset;
+}
+
+int rules_rule_valid(const struct RuleSet *rs, const struct ReplaceRule *r) {
+    uint64_t pool_len = (uint64_t)rs->pool_len;
+    return (uint64_t)r->target + r->target_len < pool_len && rs->pool[r->target + r->target_len] == '\0' &&
+           (uint64_t)r->replacement + r->replacement_len < pool_len && rs->pool[r->replacement + r->replacement_len] == '\0';
+}
+
+// Slot holding 'word', or the empty slot where it would be inserted. NULL if
+// there is neither: a mapped dictionary whose slots are all taken, or one
+// with a slot or rule pointing outside the file.
+static uint32_t *rules_slot(const struct RuleSet *rs, const char *word, int len, uint32_t hash) {
+    uint32_t mask = rs->nslots - 1;
+    uint32_t i = hash & mask;
+    for (int probes = 0; probes < rs->nslots; probes++, i = (i + 1) & mask) {
+        uint32_t *slot = &rs->slots[i];
+        if (*slot == 0) return slot;
+        if (*slot > (uint32_t)rs->count) return NULL;
+
+        const struct ReplaceRule *r = &rs->rules[*slot - 1];
+        if (r->hash == hash && r->target_len == (uint32_t)len) {
+            if (!rules_rule_valid(rs, r)) return NULL;
+            if (memcmp(rs->pool + r->target, word, len) == 0) return slot;
+        }
+    }
+    return NULL;
+}
+
+// Rebuild the index with twice as many slots
+static int rules_grow(struct RuleSet *rs) {
+    int nslots = rs->nslots * 2;
+    uint32_t *slots = (uint32_t *)calloc(nslots, sizeof(uint32_t));
+    if (slots == NULL) return -1;
+
+    for (int i = 0; i < rs->count; i++) {
+        uint32_t j = rs->rules[i].hash & (nslots - 1);
+        while (slots[j] != 0) j = (j + 1) & (nslots - 1);
+        slots[j] = i + 1;
+    }
+    free(rs->slots);
+    rs->slots = slots;
+    rs->nslots = nslots;
+    return 0;
+}
+
+// Add a pair, the first rule for a target wins like the original linear search
+int rules_add(struct RuleSet *rs, const char *target, int target_len, const char *replacement, int replacement_len) {
+    // keep the index at most half full
+    if ((rs->count + 1) * 2 > rs->nslots && rules_grow(rs) == -1) return -1;
+
+    if (rs->count == rs->cap) {
+        int cap = (rs->cap > 0) ? rs->cap * 2 : 64;
+        struct ReplaceRule *rules = (struct ReplaceRule *)realloc(rs->rules, sizeof(struct ReplaceRule) * cap);
+        if (rules == NULL) return -1;
+        rs->rules = rules;
+        rs->cap = cap;
+    }
+
+    int t = rules_intern(rs, target, target_len, 1);
+    if (t == -1) return -1;
+    uint32_t hash = rules_hash(rs->pool + t, target_len);
+
+    uint32_t *slot = rules_slot(rs, rs->pool + t, target_len, hash);
+    if (slot == NULL) return -1;
+    if (*slot != 0) {
+        rs->pool_len = t; // duplicate target, drop the copy
+        return 0;
+    }
+
+    int r = rules_intern(rs, replacement, replacement_len, 0);
+    if (r == -1) return -1;
+
+    struct ReplaceRule *rule = &rs->rules[rs->count];
+    rule->target = t;
+    rule->target_len = target_len;
+    rule->replacement = r;
+    rule->replacement_len = replacement_len;
+    rule->hash = hash;
+    rs->count++;
+    *slot = rs->count;
+    return 0;
+}
+
+const struct ReplaceRule *rules_find(const struct RuleSet *rs, const char *word, int len) {
+    uint32_t *slot = rules_slot(rs, word, len, rules_hash(word, len));
+    return (slot != NULL && *slot != 0) ? &rs->rules[*slot - 1] : NULL;
+}
+
+// Read a whole file into a NUL terminated buffer
+static char *rules_read_file(const char *filename, int *length) {
+    MILE *file = mopen(filename, MODE_R, 0);
+    if (file == NULL) return NULL;
+
+    char *data = NULL;
+    int len = 0, cap = 0;
+    while (1) {
+        if (cap - len < RULES_FILE_BSIZE) {
+            cap = (cap > 0) ? cap * 2 : RULES_FILE_BSIZE * 2;
+            char *p = (char *)realloc(data, cap + 1);
+            if (p == NULL) {
+                free(data);
+                mclose(file);
+                return NULL;
+            }
+            data = p;
+        }
+        int bytes_read = mread(file, data + len, cap - len);
+        if (bytes_read <= 0) break;
+        len += bytes_read;
+    }
+    mclose(file);
+
+    if (data == NULL) data = (char *)malloc(1);
+    if (data == NULL) return NULL;
+    data[len] = '\0';
+    *length = len;
+    return data;
+}
+
+// Add a '"phrase" replacement' line; quote is the offset of the closing quote.
+// Runs of whitespace in the phrase become one space.
+static int rules_add_phrase(struct RuleSet *rs, char *line, int quote, int len) {
+    int target_len = 0;
+    for (int i = 1; i < quote; i++) {
+        if (M_ISWS(line[i])) {
+            if (target_len > 0 && line[target_len - 1] != MSPACE) line[target_len++] = MSPACE;
+        } else {
+            line[target_len++] = line[i];
+        }
+    }
+    if (target_len > 0 && line[target_len - 1] == MSPACE) target_len--;
+
+    int start = quote + 1, end = len;
+    while (start < end && M_ISWS(line[start])) start++;
+    while (end > start && M_ISWS(line[end - 1])) end--;
+
+    if (target_len == 0) return 0;
+    return rules_add(rs, line, target_len, line + start, end - start);
+}
+
+// Map a compiled dictionary, only the header is checked so the cost does not
+// depend on the number of rules; rules and slots are checked as lookups reach
+// them (rules_rule_valid)
+static int rules_map(struct RuleSet *rs, int fd) {
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(struct RulesHeader)) return -1;
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) return -1;
+
+    const struct RulesHeader *h = (const struct RulesHeader *)map;
+    uint64_t size = st.st_size;
+    if (h->version != RULES_VERSION || h->file_size != size ||
+        (h->nslots & (h->nslots - 1)) != 0 || h->nslots == 0 ||
+        h->rules_off + (uint64_t)h->count * sizeof(struct ReplaceRule) > size ||
+        h->slots_off + (uint64_t)h->nslots * sizeof(uint32_t) > size ||
+        h->pool_off + (uint64_t)h->pool_len > size ||
+        (uint64_t)h->count * 2 > h->nslots ||
+        h->rules_off % sizeof(uint32_t) != 0 || h->slots_off % sizeof(uint32_t) != 0) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    memset(rs, 0, sizeof(*rs));
+    rs->map = map;
+    rs->map_len = st.st_size;
+    rs->rules = (struct ReplaceRule *)((char *)map + h->rules_off);
+    rs->count = rs->cap = h->count;
+    rs->slots = (uint32_t *)((char *)map + h->slots_off);
+    rs->nslots = h->nslots;
+    rs->pool = (char *)map + h->pool_off;
+    rs->pool_len = rs->pool_cap = h->pool_len;
+    return 0;
+}
+
+// Write a rule set out as a compiled dictionary
+int rules_compile(const struct RuleSet *rs, const char *filename) {
+    struct RulesHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, RULES_MAGIC, sizeof(h.magic));
+    h.version = RULES_VERSION;
+    h.count = rs->count;
+    h.nslots = rs->nslots;
+    h.pool_len = rs->pool_len;
+    h.rules_off = sizeof(h);
+    h.slots_off = h.rules_off + sizeof(struct ReplaceRule) * rs->count;
+    h.pool_off = h.slots_off + sizeof(uint32_t) * rs->nslots;
+    h.file_size = h.pool_off + rs->pool_len;
+
+    // write to a temporary name first so running readers never map a partial file
+    int name_len = (int)strlen(filename);
+    char *tmp = (char *)malloc(name_len + 5);
+    if (tmp == NULL) return -1;
+    memcpy(tmp, filename, name_len);
+    memcpy(tmp + name_len, ".tmp", 5);
+
+    MILE *file = mopen(tmp, MODE_WT, RULES_FILE_BSIZE);
+    if (file == NULL) {
+        free(tmp);
+        return -1;
+    }
+    int error = 0;
+    if (mwrite(file, (const char *)&h, sizeof(h)) < 0 ||
+        mwrite(file, (const char *)rs->rules, sizeof(struct ReplaceRule) * rs->count) < 0 ||
+        mwrite(file, (const char *)rs->slots, sizeof(uint32_t) * rs->nslots) < 0 ||
+        mwrite(file, rs->pool, rs->pool_len) < 0) {
+        error = -1;
+    }
+    if (mclose(file) != 0) error = -1;
+
+    if (error == 0 && rename(tmp, filename) == -1) error = -1;
+    if (error == -1) unlink(tmp);
+    free(tmp);
+    return error;
+}
+
+// Is the file a compiled dictionary? Returns its open descriptor if so, else -1
+static int rules_open_compiled(const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) return -1;
+
+    char magic[8];
+    if (read(fd, magic, sizeof(magic)) != sizeof(magic) || memcmp(magic, RULES_MAGIC, sizeof(magic)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Read target/replacement pairs from a file. Pairs are whitespace separated;
+// a line starting with a double quote holds a (possibly multi-word) target
+// phrase up to the closing quote and its replacement after it. A compiled
+// dictionary is mapped instead of parsed.
+int rules_load(struct RuleSet *rs, const char *filename) {
+    int fd = rules_open_compiled(filename);
+    if (fd != -1) {
+        int result = rules_map(rs, fd);
+        close(fd);
+        return result;
+    }
+
+    int len;
+    char *data = rules_read_file(filename, &len);
+    if (data == NULL) return -1;
+
+    if (rules_init(rs) == -1) {
+        free(data);
+        return -1;
+    }
+
+    char *target = NULL;      // word waiting for its replacement
+    int target_len = 0;
+    int error = 0;
+
+    for (int line = 0; line < len && error == 0;) {
+        int end = line, quote = -1;
+        while (end < len && data[end] != MNLINE) {
+            if (data[end] == '"' && data[line] == '"' && quote == -1 && end > line) quote = end - line;
+            end++;
+        }
+
+        // a quoted word can never match a token (quotes are stripped), so
+        // this does not change the meaning of older rule files
+        if (target == NULL && quote != -1) {
+            error = rules_add_phrase(rs, data + line, quote, end - line);
+        } else {
+            for (int i = line; i < end && error == 0;) {
+                while (i < end && M_ISWS(data[i])) i++;
+                int start = i;
+                while (i < end && !M_ISWS(data[i])) i++;
+                if (i == start) break;
+
+                if (target == NULL) {
+                    target = data + start;
+                    target_len = i - start;
+                } else {
+                    error = rules_add(rs, target, target_len, data + start, i - start);
+                    target = NULL;
+                }
+            }
+        }
+        line = end + 1;
+    }
+
+    // a target without replacement is ignored
+    free(data);
+    if (error == -1) {
+        rules_free(rs);
+        return -1;
+    }
+    return 0;
+}
+
+int replacer_init(struct Replacer *r, const struct RuleSet *rs, MILE *out) {
+    memset(r, 0, sizeof(*r));
+    r->rs = rs;
+    r->out = out;
+
+    // Same classes as the original per token loops: ASCII punctuation other
+    // than [\]^_` is dropped, A-Z is lowercased, every other byte is kept
+    for (int c = 0; c < 256; c++) {
+        if (M_ISWS(c)) r->norm[c] = WR_SPACE;
+        else if ((c >= 33 && c <= 47) || (c >= 58 && c <= 64) || (c >= 123 && c <= 126)) r->norm[c] = WR_DROP;
+        else if (c >= 'A' && c <= 'Z') r->norm[c] = c - 'A' + 'a';
+        else r->norm[c] = c;
+    }
+
+    r->tokcap = 256;
+    r->tok = (char *)malloc(r->tokcap);
+    return (r->tok == NULL) ? -1 : 0;
+}
+
+void replacer_free(struct Replacer *r) {
+    free(r->tok);
+    r->tok = NULL;
+}
+
+// Look up the normalized token and write it or its replacement
+static void replacer_emit(struct Replacer *r) {
+    const struct ReplaceRule *rule = rules_find(r->rs, r->tok, r->toklen);
+    if (r->emit != NULL) {
+        if (rule != NULL) r->emit(r->emit_arg, RULE_REPLACEMENT(r->rs, rule), (int)rule->replacement_len);
+        else r->emit(r->emit_arg, r->tok, r->toklen);
+        r->toklen = 0;
+        r->in_token = 0;
+        return;
+    }
+
+    if (rule != NULL) {
+        mputs(r->out, RULE_REPLACEMENT(r->rs, rule), (int)rule->replacement_len);
+    } else {
+        mputs(r->out, r->tok, r->toklen);
+    }
+    mputc(r->out, MSPACE);
+    r->toklen = 0;
+    r->in_token = 0;
+}
+
+// Normalize a block of raw input in one pass, tokens may span blocks
+int replacer_feed(struct Replacer *r, const char *buf, int len) {
+    const uint16_t *norm = r->norm;
+
+    for (int i = 0; i < len; i++) {
+        uint16_t v = norm[(unsigned char)buf[i]];
+        if (v == WR_SPACE) {
+            if (r->in_token) replacer_emit(r);
+            continue;
+        }
+        r->in_token = 1;
+        if (v == WR_DROP) continue;
+
+        // the scratch buffer only grows for a token longer than any before
+        if (r->toklen == r->tokcap) {
+            char *tok = (char *)realloc(r->tok, r->tokcap * 2);
+            if (tok == NULL) return -1;
+            r->tok = tok;
+            r->tokcap *= 2;
+        }
+        r->tok[r->toklen++] = (char)v;
+    }
+    return len;
+}
+
+void replacer_finish(struct Replacer *r) {
+    if (r->in_token) replacer_emit(r);
+}
@@ -0,0 +1,92 @@
+#ifndef WREPLACE_H_
+#define WREPLACE_H_
+#include <stdint.h>
+#include "mio.h"
+
+// One target/replacement pair, strings are offsets into the rule set's pool
+struct ReplaceRule {
+    uint32_t target;           // lowercased target
+    uint32_t target_len;
+    uint32_t replacement;
+    uint32_t replacement_len;
+    uint32_t hash;             // hash of the lowercased target
+};
+
+// Compiled dictionary layout: header, rules, slots and pool in native byte
+// order. Everything is addressed by offset so the file can be mapped anywhere.
+#define RULES_MAGIC "MWRDICT1"
+#define RULES_VERSION 1
+
+struct RulesHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint32_t nslots;
+    uint32_t pool_len;
+    uint32_t rules_off;
+    uint32_t slots_off;
+    uint32_t pool_off;
+    uint32_t file_size;
+};
+
+// Rule set with an open addressing index keyed on the lowercased target
+struct RuleSet {
+    struct ReplaceRule *rules;
+    int count, cap;
+    char *pool;                // NUL terminated strings
+    int pool_len, pool_cap;
+    uint32_t *slots;           // rule index + 1, 0 marks an empty slot
+    int nslots;                // always a power of two
+    void *map;                 // mapping of a compiled dictionary, NULL when built in memory
+    size_t map_len;
+};
+
+// Frame header of word_replacer -F: each input frame is a chunk that ends on a
+// token boundary and is answered by one output frame with the same sequence
+struct FrameHeader {
+    uint32_t seq;
+    uint32_t len;
+};
+
+// Normalization classes of the token replacer, other values are the folded byte
+#define WR_SPACE 256           // ends a token
+#define WR_DROP 257            // punctuation, removed from the token
+
+// Token replacer: lowercases each whitespace separated token, strips its
+// punctuation, and writes the replacement (or the token) followed by a space
+struct Replacer {
+    const struct RuleSet *rs;
+    uint16_t norm[256];        // byte -> WR_SPACE, WR_DROP or the folded byte
+    char *tok;                 // scratch buffer reused for every token
+    int toklen, tokcap;
+    int in_token;
+    MILE *out;
+    // optional token sink used instead of 'out', gets each output word without the space
+    void (*emit)(void *arg, const char *word, int len);
+    void *emit_arg;
+};
+
+// build/free
+int rules_init(struct RuleSet *rs);
+int rules_add(struct RuleSet *rs, const char *target, int target_len, const char *replacement, int replacement_len);
+int rules_load(struct RuleSet *rs, const char *filename);
+int rules_compile(const struct RuleSet *rs, const char *filename);
+void rules_free(struct RuleSet *rs);
+
+// lookup of an already lowercased word, NULL if there is no rule for it
+const struct ReplaceRule *rules_find(const struct RuleSet *rs, const char *word, int len);
+// do the rule's strings lie in the pool? Only a corrupt mapped dictionary fails this
+int rules_rule_valid(const struct RuleSet *rs, const struct ReplaceRule *r);
+uint32_t rules_hash(const char *s, int len);
+
+// token replacer
+int replacer_init(struct Replacer *r, const struct RuleSet *rs, MILE *out);
+int replacer_feed(struct Replacer *r, const char *buf, int len);
+void replacer_finish(struct Replacer *r);
+void replacer_free(struct Replacer *r);
+
+// Accessors for the pooled strings of a rule
+#define RULE_TARGET(RS, R) ((RS)->pool + (R)->target)
+#define RULE_REPLACEMENT(RS, R) ((RS)->pool + (R)->replacement)
+
+#endif